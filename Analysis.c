@@ -0,0 +1,259 @@
+/*
+
+Analysis.c
+
+Load time control flow analysis. The walk follows every path from the entry
+point the way the machine would, except that JMP, RET and JSRR end a path:
+where they go is only known at run time. Anything the walk doesn't reach is
+still decoded lazily by the engines, so a miss only costs a late decode.
+
+Analysis files are little-endian:
+
+	offset 0	magic "LC3ANAL\0"
+	8			u32 version (ANALYSIS_VERSION)
+	12			u16 entry, u16 padding
+	16			u64 lc3_vm.image_hash
+	24			ANALYSIS_KINDS bitmaps of ANALYSIS_WORDS u64 each
+
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Analysis.h"
+#include "Memory.h"
+#include "ReadImage.h"
+
+#define ANALYSIS_HEADER_SIZE 24
+#define ANALYSIS_FILE_SIZE (ANALYSIS_HEADER_SIZE + ANALYSIS_KINDS * ANALYSIS_WORDS * 8)
+
+static const char analysis_magic[8] = "LC3ANAL";
+
+
+
+// WALK
+
+static void mark(lc3_analysis *analysis, int kind, uint16_t address)
+{
+	analysis->bits[kind][address >> 6] |= (uint64_t)1 << (address & 63);
+}
+
+// Queues address as code, once, unless it is on the device page
+static void reach(lc3_analysis *analysis, uint16_t *stack, size_t *top, uint16_t address)
+{
+	if(address >= MMIO_BASE || analysis_test(analysis, ANALYSIS_CODE, address))
+	{
+		return;
+	}
+	mark(analysis, ANALYSIS_CODE, address);
+	stack[(*top)++] = address;
+}
+
+// Marks the target of a branch or call and queues it
+static void branch_to(lc3_analysis *analysis, uint16_t *stack, size_t *top, uint16_t target)
+{
+	if(target < MMIO_BASE)
+	{
+		mark(analysis, ANALYSIS_LEADER, target);
+	}
+	reach(analysis, stack, top, target);
+}
+
+lc3_analysis *analysis_create(const lc3_vm *vm)
+{
+	lc3_analysis *analysis = calloc(1, sizeof(*analysis));
+	uint16_t *stack = malloc(MEMORY_MAX * sizeof(uint16_t)); // every word is queued at most once
+	if(!analysis || !stack)
+	{
+		free(analysis);
+		free(stack);
+		return NULL;
+	}
+	analysis->entry = vm->reg[R_PC];
+	analysis->image_hash = vm->image_hash;
+
+	size_t top = 0;
+	branch_to(analysis, stack, &top, analysis->entry);
+	while(top > 0)
+	{
+		uint16_t pc = stack[--top];
+		uint16_t instr = memory_peek(vm, pc);
+		uint16_t next = pc + 1;
+		int falls_through = 1;
+
+		switch(instr >> 12)
+		{
+			case OP_BR:
+			{
+				int cond = (instr >> 9) & 0x7;
+				if(cond == 0)
+				{
+					break; // never taken
+				}
+				branch_to(analysis, stack, &top, next + sign_extend(instr & 0x1FF, 9));
+				falls_through = cond != 0x7;
+				if(falls_through && next < MMIO_BASE)
+				{
+					mark(analysis, ANALYSIS_LEADER, next);
+				}
+				break;
+			}
+			case OP_JMP:
+				falls_through = 0;
+				break;
+			case OP_JSR:
+				if((instr >> 11) & 0x1)
+				{
+					uint16_t target = next + sign_extend(instr & 0x7FF, 11);
+					if(target < MMIO_BASE)
+					{
+						mark(analysis, ANALYSIS_CALL_TARGET, target);
+					}
+					branch_to(analysis, stack, &top, target);
+				}
+				if(next < MMIO_BASE)
+				{
+					mark(analysis, ANALYSIS_LEADER, next); // where the call returns
+				}
+				break;
+			case OP_LD:
+			case OP_LDI:
+			case OP_ST:
+			case OP_STI:
+			case OP_LEA:
+			{
+				uint16_t address = next + sign_extend(instr & 0x1FF, 9);
+				if(address < MMIO_BASE)
+				{
+					mark(analysis, ANALYSIS_DATA, address);
+				}
+				break;
+			}
+			case OP_TRAP:
+				mark(analysis, ANALYSIS_TRAP_SITE, pc);
+				falls_through = (instr & 0xFF) != TRAP_HALT;
+				break;
+			case OP_RTI:
+			case OP_RES:
+				falls_through = 0;
+				break;
+		}
+		if(falls_through)
+		{
+			reach(analysis, stack, &top, next);
+		}
+	}
+
+	free(stack);
+	return analysis;
+}
+
+void analysis_free(lc3_analysis *analysis)
+{
+	free(analysis);
+}
+
+
+
+// FILES
+
+static void put64(uint8_t *p, uint64_t v)
+{
+	for(int i = 0; i < 8; i++)
+	{
+		p[i] = (uint8_t)(v >> (8 * i));
+	}
+}
+
+static uint64_t get64(const uint8_t *p)
+{
+	uint64_t v = 0;
+	for(int i = 7; i >= 0; i--)
+	{
+		v = v << 8 | p[i];
+	}
+	return v;
+}
+
+int analysis_save(const lc3_analysis *analysis, const char *path)
+{
+	uint8_t *data = calloc(1, ANALYSIS_FILE_SIZE);
+	if(!data)
+	{
+		return 0;
+	}
+	memcpy(data, analysis_magic, sizeof(analysis_magic));
+	put64(data + 8, ANALYSIS_VERSION | (uint64_t)analysis->entry << 32);
+	put64(data + 16, analysis->image_hash);
+	uint8_t *p = data + ANALYSIS_HEADER_SIZE;
+	for(int kind = 0; kind < ANALYSIS_KINDS; kind++)
+	{
+		for(int i = 0; i < ANALYSIS_WORDS; i++, p += 8)
+		{
+			put64(p, analysis->bits[kind][i]);
+		}
+	}
+
+	FILE *file = fopen(path, "wb");
+	int ok = file && fwrite(data, 1, ANALYSIS_FILE_SIZE, file) == ANALYSIS_FILE_SIZE;
+	if(file && fclose(file) != 0)
+	{
+		ok = 0;
+	}
+	free(data);
+	return ok;
+}
+
+lc3_analysis *analysis_load(const lc3_vm *vm, const char *path)
+{
+	mapped_file m;
+	if(!map_file(&m, path))
+	{
+		return NULL;
+	}
+	lc3_analysis *analysis = NULL;
+	if(m.size == ANALYSIS_FILE_SIZE
+		&& memcmp(m.data, analysis_magic, sizeof(analysis_magic)) == 0
+		&& get64(m.data + 8) == (ANALYSIS_VERSION | (uint64_t)vm->reg[R_PC] << 32)
+		&& get64(m.data + 16) == vm->image_hash)
+	{
+		analysis = malloc(sizeof(*analysis));
+	}
+	if(analysis)
+	{
+		analysis->entry = vm->reg[R_PC];
+		analysis->image_hash = vm->image_hash;
+		const uint8_t *p = m.data + ANALYSIS_HEADER_SIZE;
+		for(int kind = 0; kind < ANALYSIS_KINDS; kind++)
+		{
+			for(int i = 0; i < ANALYSIS_WORDS; i++, p += 8)
+			{
+				analysis->bits[kind][i] = get64(p);
+			}
+		}
+	}
+	unmap_file(&m);
+	return analysis;
+}
+
+int vm_analyze(lc3_vm *vm, const char *cache_path)
+{
+	lc3_analysis *analysis = cache_path ? analysis_load(vm, cache_path) : NULL;
+	if(!analysis)
+	{
+		analysis = analysis_create(vm);
+		if(!analysis)
+		{
+			return 0;
+		}
+		if(cache_path)
+		{
+			analysis_save(analysis, cache_path);
+		}
+	}
+	analysis_free(vm->analysis);
+	vm->analysis = analysis;
+	return 1;
+}
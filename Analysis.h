@@ -0,0 +1,69 @@
+/*
+
+Analysis.h
+
+Static analysis of a loaded program: a walk of its control flow from the
+entry point that marks what each memory word is used as
+
+*/
+
+#ifndef ANALYSIS_H
+#define ANALYSIS_H
+
+#include "LC3.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ANALYSIS_VERSION 2
+
+// One bitmap per kind, a word can be in several
+enum
+{
+	ANALYSIS_CODE,			// reached by the walk
+	ANALYSIS_LEADER,		// starts a basic block: the entry, branch and call targets, the word after a branch or call
+	ANALYSIS_CALL_TARGET,	// JSR target, JSRR targets aren't known until run time
+	ANALYSIS_TRAP_SITE,		// a TRAP instruction
+	ANALYSIS_DATA,			// named by LD, LDI, ST, STI or LEA
+	ANALYSIS_KINDS
+};
+
+#define ANALYSIS_WORDS (MEMORY_MAX / 64)
+
+typedef struct lc3_analysis
+{
+	uint16_t entry;
+	uint64_t image_hash;	// lc3_vm.image_hash of the machine analyzed
+	uint64_t bits[ANALYSIS_KINDS][ANALYSIS_WORDS];
+} lc3_analysis;
+
+static inline int analysis_test(const lc3_analysis *analysis, int kind, uint16_t address)
+{
+	return (int)(analysis->bits[kind][address >> 6] >> (address & 63)) & 1;
+}
+
+// Walks the machine's memory from its PC, NULL if out of memory
+lc3_analysis *analysis_create(const lc3_vm *vm);
+void analysis_free(lc3_analysis *analysis);
+
+// Returns 0 if path can't be written
+int analysis_save(const lc3_analysis *analysis, const char *path);
+
+// Reads an analysis back, NULL unless it is one of this version made from
+// the same images and PC. Memory written since loading isn't looked at.
+lc3_analysis *analysis_load(const lc3_vm *vm, const char *path);
+
+// Gives the machine an analysis of what it has loaded, which the cached and
+// jit engines use to decode (and fuse) all the code up front when they next
+// start from scratch. With a cache_path the analysis is read from there when
+// it is still current and written there when it isn't. Returns 0 if out of
+// memory, a cache that can't be written is only skipped. Loading anything
+// drops the analysis.
+int vm_analyze(lc3_vm *vm, const char *cache_path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,527 @@
+/*
+
+Batch.c
+
+Batch mode. The manifest is parsed and every image is acquired once up
+front, then a pool of workers runs the jobs. Each worker owns a queue of job
+indices and takes from its front; once that is empty it steals from the back
+of the other workers' queues, so uneven jobs still keep every core busy.
+
+A job gets its own machine, keyboard buffer and output capture, nothing is
+shared between workers while jobs run except the (read-only) images and the
+queue locks.
+
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Batch.h"
+#include "LC3.h"
+#include "ReadImage.h"
+#include "Threads.h"
+
+enum
+{
+	JOB_PASSED = 0,
+	JOB_FAILED,		// output differs from the expected file
+	JOB_ILLEGAL,	// stopped on RTI or the reserved opcode
+	JOB_LIMIT,		// ran out of instructions
+	JOB_TIMEOUT,	// ran out of time
+	JOB_ERROR		// an image, input or expected file couldn't be read
+};
+
+typedef struct
+{
+	int line;					// in the manifest, for the report
+	const char *text;			// the manifest line, for the report
+	const lc3_image **images;
+	int image_count;
+	const char *input_path;		// or NULL for no input
+	const char *expected_path;	// or NULL to print the output instead
+
+	// Filled in by the worker
+	int result;					// JOB_*
+	const char *error;			// what couldn't be read for JOB_ERROR
+	size_t mismatch;			// first differing output byte for JOB_FAILED
+	uint64_t instructions;
+	char state[VM_STATE_SIZE];	// for JOB_LIMIT and JOB_TIMEOUT
+	char *output;
+	size_t output_used;
+	size_t output_capacity;
+} batch_job;
+
+// One worker's share of the jobs, [top, bottom) are still to run
+typedef struct
+{
+	lc3_mutex lock;
+	int *jobs;
+	int top;
+	int bottom;
+} job_queue;
+
+typedef struct batch batch;
+
+typedef struct
+{
+	batch *owner;
+	int index;
+	lc3_thread thread;
+	job_queue queue;
+} batch_worker;
+
+struct batch
+{
+	batch_job *jobs;
+	int job_count;
+	batch_worker *workers;
+	int worker_count;
+	int engine;
+	int paged_memory;	// vm_set_paged_memory() for every job
+	const lc3_trap_fn *traps;	// every job's trap handlers, see vm_set_trap()
+	lc3_limits limits;
+};
+
+
+
+// JOB CONSOLE
+
+// Keyboard for one job, the whole input file is read before the machine starts
+typedef struct
+{
+	batch_job *job;
+	const char *input;
+	size_t input_size;
+	size_t input_used;
+} job_console;
+
+static int job_check_key(void *user)
+{
+	job_console *console = user;
+	return console->input_used < console->input_size;
+}
+
+static uint16_t job_read_key(void *user)
+{
+	job_console *console = user;
+	if(console->input_used == console->input_size)
+	{
+		return (uint16_t)EOF;
+	}
+	return (unsigned char)console->input[console->input_used++];
+}
+
+static void job_write(void *user, const char *bytes, size_t count)
+{
+	batch_job *job = ((job_console *)user)->job;
+	if(job->output_used + count > job->output_capacity)
+	{
+		size_t capacity = job->output_capacity ? job->output_capacity : 4096;
+		while(capacity < job->output_used + count)
+		{
+			capacity *= 2;
+		}
+		char *bigger = realloc(job->output, capacity);
+		if(!bigger)
+		{
+			return; // drops the output, and the comparison will fail
+		}
+		job->output = bigger;
+		job->output_capacity = capacity;
+	}
+	memcpy(job->output + job->output_used, bytes, count);
+	job->output_used += count;
+}
+
+
+
+// RUNNING A JOB
+
+static void run_job(batch *b, batch_job *job)
+{
+	job_console console = { job, NULL, 0, 0 };
+	char *input = NULL;
+	if(job->input_path)
+	{
+		input = read_file(job->input_path, &console.input_size);
+		if(!input)
+		{
+			job->result = JOB_ERROR;
+			job->error = job->input_path;
+			return;
+		}
+		console.input = input;
+	}
+
+	lc3_io io = { &console, job_check_key, job_read_key, job_write, NULL };
+	lc3_vm *vm = vm_create(&io);
+	if(vm && b->paged_memory && !vm_set_paged_memory(vm))
+	{
+		vm_destroy(vm);
+		vm = NULL;
+	}
+	if(!vm)
+	{
+		free(input);
+		job->result = JOB_ERROR;
+		job->error = "out of memory";
+		return;
+	}
+	vm_set_engine(vm, b->engine);
+	vm_set_interactive(vm, 0);
+	memcpy(vm->traps, b->traps, sizeof(vm->traps));
+	for(int i = 0; i < job->image_count; i++)
+	{
+		// Paged jobs share the image pages until they write to them. Nothing is decoded yet, no need to invalidate.
+		memory_install(vm, job->images[i]);
+	}
+
+	int status = vm_run_limited(vm, &b->limits);
+	job->instructions = vm->instructions;
+	if(status == VM_LIMIT || status == VM_TIMEOUT)
+	{
+		vm_format_state(vm, job->state);
+	}
+	vm_destroy(vm); // writes out what is still buffered
+	free(input);
+
+	if(status != VM_HALTED)
+	{
+		job->result = status == VM_LIMIT ? JOB_LIMIT : status == VM_TIMEOUT ? JOB_TIMEOUT : JOB_ILLEGAL;
+		return;
+	}
+	if(!job->expected_path)
+	{
+		job->result = JOB_PASSED;
+		return;
+	}
+
+	size_t expected_size;
+	char *expected = read_file(job->expected_path, &expected_size);
+	if(!expected)
+	{
+		job->result = JOB_ERROR;
+		job->error = job->expected_path;
+		return;
+	}
+	size_t common = expected_size < job->output_used ? expected_size : job->output_used;
+	size_t i = 0;
+	while(i < common && expected[i] == job->output[i])
+	{
+		i++;
+	}
+	job->result = i == expected_size && i == job->output_used ? JOB_PASSED : JOB_FAILED;
+	job->mismatch = i;
+	free(expected);
+
+	// The output was only needed for the comparison
+	free(job->output);
+	job->output = NULL;
+	job->output_used = job->output_capacity = 0;
+}
+
+
+
+// WORK STEALING
+
+// Next job from the worker's own queue, else from the back of someone else's, -1 when all are empty
+static int next_job(batch_worker *w)
+{
+	batch *b = w->owner;
+	for(int i = 0; i < b->worker_count; i++)
+	{
+		job_queue *q = &b->workers[(w->index + i) % b->worker_count].queue;
+		int job = -1;
+		mutex_lock(&q->lock);
+		if(q->top < q->bottom)
+		{
+			job = i == 0 ? q->jobs[q->top++] : q->jobs[--q->bottom];
+		}
+		mutex_unlock(&q->lock);
+		if(job >= 0)
+		{
+			return job;
+		}
+	}
+	return -1; // jobs are never added once started, so empty now means done
+}
+
+static void worker_main(void *arg)
+{
+	batch_worker *w = arg;
+	int job;
+	while((job = next_job(w)) >= 0)
+	{
+		run_job(w->owner, &w->owner->jobs[job]);
+	}
+}
+
+
+
+// MANIFEST
+
+static int is_space(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+// Splits the manifest text in place into b->jobs, returns 0 on a bad line
+static int parse_manifest(batch *b, char *text, const char *manifest_path)
+{
+	int capacity = 0;
+	int line = 0;
+	char *next;
+	for(char *p = text; p; p = next)
+	{
+		line++;
+		next = strchr(p, '\n');
+		if(next)
+		{
+			*next++ = '\0';
+		}
+		while(is_space(*p))
+		{
+			p++;
+		}
+		if(*p == '\0' || *p == '#')
+		{
+			continue;
+		}
+
+		if(b->job_count == capacity)
+		{
+			capacity = capacity ? capacity * 2 : 64;
+			batch_job *bigger = realloc(b->jobs, capacity * sizeof(batch_job));
+			if(!bigger)
+			{
+				return 0;
+			}
+			b->jobs = bigger;
+		}
+		batch_job *job = &b->jobs[b->job_count++];
+		memset(job, 0, sizeof(*job));
+		job->line = line;
+
+		// Keep a copy of the line for the report, the tokens are cut out of it
+		size_t length = strlen(p);
+		while(length > 0 && is_space(p[length - 1]))
+		{
+			p[--length] = '\0';
+		}
+		char *copy = malloc(length + 1);
+		if(!copy)
+		{
+			return 0;
+		}
+		memcpy(copy, p, length + 1);
+		job->text = copy;
+
+		while(*p)
+		{
+			char kind = 0;
+			if(*p == '<' || *p == '>')
+			{
+				kind = *p++;
+				while(is_space(*p))
+				{
+					p++;
+				}
+			}
+			char *token = p;
+			while(*p && !is_space(*p))
+			{
+				p++;
+			}
+			if(*p)
+			{
+				*p++ = '\0';
+			}
+			while(is_space(*p))
+			{
+				p++;
+			}
+
+			if(*token == '\0')
+			{
+				printf("%s:%d: expected a file after %c\n", manifest_path, line, kind);
+				return 0;
+			}
+			if(kind == '<')
+			{
+				job->input_path = token;
+				continue;
+			}
+			if(kind == '>')
+			{
+				job->expected_path = token;
+				continue;
+			}
+
+			const lc3_image **bigger = realloc((void *)job->images, (job->image_count + 1) * sizeof(*job->images));
+			if(!bigger)
+			{
+				return 0;
+			}
+			job->images = bigger;
+			job->images[job->image_count] = image_acquire(token);
+			if(!job->images[job->image_count])
+			{
+				job->result = JOB_ERROR;
+				job->error = token;
+				continue;
+			}
+			job->image_count++;
+		}
+		if(job->image_count == 0 && job->result == JOB_PASSED)
+		{
+			printf("%s:%d: no image files\n", manifest_path, line);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+
+
+// RESULTS
+
+static int report(const batch *b, int threads, double seconds)
+{
+	static const char *const names[] = { "PASS", "FAIL", "ILLEGAL", "LIMIT", "TIMEOUT", "ERROR" };
+	int passed = 0;
+	uint64_t instructions = 0;
+	for(int i = 0; i < b->job_count; i++)
+	{
+		const batch_job *job = &b->jobs[i];
+		printf("%-7s %d: %s", names[job->result], job->line, job->text);
+		switch(job->result)
+		{
+			case JOB_PASSED:	passed++;	break;
+			case JOB_FAILED:	printf(" (output differs at byte %zu)", job->mismatch);	break;
+			case JOB_ERROR:		printf(" (can't read %s)", job->error);	break;
+			case JOB_LIMIT:
+			case JOB_TIMEOUT:	printf("\n        %s", job->state);	break;
+		}
+		printf("\n");
+		instructions += job->instructions;
+	}
+
+	for(int i = 0; i < b->job_count; i++)
+	{
+		const batch_job *job = &b->jobs[i];
+		if(job->output_used)
+		{
+			printf("---- %d: %s\n", job->line, job->text);
+			fwrite(job->output, 1, job->output_used, stdout);
+			if(job->output[job->output_used - 1] != '\n')
+			{
+				printf("\n");
+			}
+		}
+	}
+
+	printf("%d jobs, %d passed, %d not passed, %llu instructions on %d threads in %.3f s\n",
+		b->job_count, passed, b->job_count - passed, (unsigned long long)instructions, threads, seconds);
+	return b->job_count - passed;
+}
+
+
+
+int run_batch(const char *manifest_path, int engine, int paged_memory, const lc3_trap_fn *traps, int threads, const lc3_limits *limits)
+{
+	size_t size;
+	char *text = read_file(manifest_path, &size);
+	if(!text)
+	{
+		printf("Failed to load manifest: %s\n", manifest_path);
+		return -1;
+	}
+
+	batch b = { NULL, 0, NULL, 0, engine, paged_memory, traps, *limits };
+	int failed = -1;
+	if(!parse_manifest(&b, text, manifest_path))
+	{
+		goto done;
+	}
+
+	if(threads <= 0)
+	{
+		threads = cpu_count();
+	}
+	if(threads > b.job_count)
+	{
+		threads = b.job_count > 0 ? b.job_count : 1;
+	}
+
+	// Deal the runnable jobs out in contiguous runs, stealing evens out the rest
+	b.workers = calloc(threads, sizeof(batch_worker));
+	int *order = malloc((b.job_count + 1) * sizeof(int));
+	if(!b.workers || !order)
+	{
+		free(order);
+		goto done;
+	}
+	int runnable = 0;
+	for(int i = 0; i < b.job_count; i++)
+	{
+		if(b.jobs[i].result != JOB_ERROR)
+		{
+			order[runnable++] = i;
+		}
+	}
+	b.worker_count = threads;
+	for(int w = 0; w < threads; w++)
+	{
+		batch_worker *worker = &b.workers[w];
+		worker->owner = &b;
+		worker->index = w;
+		mutex_init(&worker->queue.lock);
+		worker->queue.jobs = order;
+		worker->queue.top = (int)((long long)runnable * w / threads);
+		worker->queue.bottom = (int)((long long)runnable * (w + 1) / threads);
+	}
+
+	double start = monotonic_seconds();
+
+	// The calling thread is worker 0
+	int started = 1;
+	for(int w = 1; w < threads; w++)
+	{
+		if(!thread_start(&b.workers[w].thread, worker_main, &b.workers[w]))
+		{
+			break; // the others steal its jobs
+		}
+		started++;
+	}
+	worker_main(&b.workers[0]);
+	for(int w = 1; w < started; w++)
+	{
+		thread_join(b.workers[w].thread);
+	}
+
+	failed = report(&b, started, monotonic_seconds() - start);
+
+	for(int w = 0; w < threads; w++)
+	{
+		mutex_destroy(&b.workers[w].queue.lock);
+	}
+	free(order);
+
+done:
+	for(int i = 0; i < b.job_count; i++)
+	{
+		for(int j = 0; j < b.jobs[i].image_count; j++)
+		{
+			image_release(b.jobs[i].images[j]);
+		}
+		free((void *)b.jobs[i].images);
+		free((void *)b.jobs[i].text);
+		free(b.jobs[i].output);
+	}
+	free(b.jobs);
+	free(b.workers);
+	free(text);
+	return failed;
+}
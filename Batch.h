@@ -0,0 +1,40 @@
+/*
+
+Batch.h
+
+Runs a manifest of LC-3 jobs in parallel, one machine per job
+
+*/
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "LC3.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Runs every job in the manifest with the given ENGINE_* and limits (see
+// vm_run_limited()), on paged memory if paged_memory is set and with a copy
+// of the 256 trap handlers in traps (see vm_set_trap()). Jobs go to threads
+// workers (0 for one per processor), and one result line per job is printed
+// plus a summary. Returns the number of jobs that did not pass, -1 if the
+// manifest can't be read.
+//
+// One job per line, blank lines and lines starting with # are skipped:
+//
+//     image-file1 [image-file2 ...] [< input-file] [> expected-output-file]
+//
+// The images are loaded in order like the CLI's arguments. The machine reads
+// input-file as its keyboard (nothing, if left out) and its output is
+// compared against expected-output-file. Jobs without one pass by halting,
+// and their output is printed after the results. Jobs stopped by a limit
+// fail and have their machine state printed.
+int run_batch(const char *manifest_path, int engine, int paged_memory, const lc3_trap_fn *traps, int threads, const lc3_limits *limits);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
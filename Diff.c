@@ -0,0 +1,350 @@
+/*
+
+Diff.c
+
+Differential testing. Two copies of a machine run side by side, one under
+the reference switch engine and one under the engine being tested, and are
+compared every interval instructions. When they disagree both go back to the
+last checkpoint where they matched and the interval is bisected down to the
+single instruction that sets them apart. vm_run() stops after exactly the
+number of instructions asked for under every engine, so any run can be
+repeated in shorter pieces.
+
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Diff.h"
+#include "InputBuffering.h"
+#include "Threads.h"
+
+#define DIFF_MAX_SHOWN 8 // differing memory words listed in a report
+
+#define FNV_OFFSET 14695981039346656037ull
+#define FNV_PRIME 1099511628211ull
+
+
+
+// CONSOLES
+
+// Both machines read the same keys and only hash what they write
+typedef struct
+{
+	const char *input;
+	size_t size;
+	size_t used;
+	uint64_t output_hash;	// FNV-1a of every byte written
+	uint64_t output_bytes;
+	int echo;				// also write to stdout, the reference machine outside of bisecting
+} diff_console;
+
+static int diff_check_key(void *user)
+{
+	diff_console *console = user;
+	return console->used < console->size;
+}
+
+static uint16_t diff_read_key(void *user)
+{
+	diff_console *console = user;
+	if(console->used == console->size)
+	{
+		return (uint16_t)EOF;
+	}
+	return (unsigned char)console->input[console->used++];
+}
+
+static void diff_write(void *user, const char *bytes, size_t count)
+{
+	diff_console *console = user;
+	for(size_t i = 0; i < count; i++)
+	{
+		console->output_hash = (console->output_hash ^ (unsigned char)bytes[i]) * FNV_PRIME;
+	}
+	console->output_bytes += count;
+	if(console->echo)
+	{
+		fwrite(bytes, 1, count, stdout);
+		fflush(stdout);
+	}
+}
+
+
+
+// MACHINES
+
+typedef struct
+{
+	lc3_vm *vm;
+	diff_console console;
+	uint64_t steps;		// for the next run_side()
+} diff_side;
+
+// Everything two sides are compared on, as of a point both agreed
+typedef struct
+{
+	uint16_t memory[MEMORY_MAX];
+	uint16_t reg[R_COUNT];
+	uint16_t psr;
+	uint16_t saved_sp;
+	uint8_t irq_pending;
+	uint8_t irq_vectors[8];
+	uint64_t instructions;
+	diff_console console;
+} diff_checkpoint;
+
+static void run_side(void *arg)
+{
+	diff_side *side = arg;
+	vm_run(side->vm, side->steps);
+	output_flush(&side->vm->out);
+}
+
+// Runs both sides steps instructions, the tested one on its own thread when there is a processor for it
+static void run_both(diff_side *ref, diff_side *test, uint64_t steps, int threaded)
+{
+	lc3_thread thread;
+	ref->steps = test->steps = steps;
+	if(threaded && thread_start(&thread, run_side, test))
+	{
+		run_side(ref);
+		thread_join(thread);
+		return;
+	}
+	run_side(ref);
+	run_side(test);
+}
+
+static void copy_machine(const lc3_vm *vm, diff_checkpoint *checkpoint)
+{
+	for(unsigned page = 0; page < MEMORY_PAGES; page++)
+	{
+		memcpy(checkpoint->memory + (page << MEMORY_PAGE_SHIFT), vm->pages[page], MEMORY_PAGE_SIZE * sizeof(uint16_t));
+	}
+	memcpy(checkpoint->reg, vm->reg, sizeof(vm->reg));
+	checkpoint->psr = vm->psr;
+	checkpoint->saved_sp = vm->saved_sp;
+	checkpoint->irq_pending = vm->irq_pending;
+	memcpy(checkpoint->irq_vectors, vm->irq_vectors, sizeof(vm->irq_vectors));
+	checkpoint->instructions = vm->instructions;
+}
+
+static void capture(const diff_side *side, diff_checkpoint *checkpoint)
+{
+	copy_machine(side->vm, checkpoint);
+	checkpoint->console = side->console;
+}
+
+// Puts a side back at the checkpoint, quietly from then on
+static void restore(diff_side *side, const diff_checkpoint *checkpoint)
+{
+	lc3_vm *vm = side->vm;
+	memory_store(vm, 0, checkpoint->memory, MEMORY_MAX);
+	engine_invalidate(vm, 0, MEMORY_MAX);
+	memcpy(vm->reg, checkpoint->reg, sizeof(vm->reg));
+	vm->psr = checkpoint->psr;
+	vm->saved_sp = checkpoint->saved_sp;
+	vm->irq_pending = checkpoint->irq_pending;
+	memcpy(vm->irq_vectors, checkpoint->irq_vectors, sizeof(vm->irq_vectors));
+	vm->interrupts = 1; // until the next slice boundary finds nothing to wait for
+	vm->instructions = checkpoint->instructions;
+	vm->status = VM_RUNNING;
+	side->console = checkpoint->console;
+	side->console.echo = 0;
+}
+
+static int same_memory(const lc3_vm *a, const lc3_vm *b)
+{
+	for(unsigned page = 0; page < MEMORY_PAGES; page++)
+	{
+		if(a->pages[page] != b->pages[page]
+			&& memcmp(a->pages[page], b->pages[page], MEMORY_PAGE_SIZE * sizeof(uint16_t)) != 0)
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int same(const diff_side *ref, const diff_side *test)
+{
+	return ref->vm->status == test->vm->status
+		&& ref->vm->instructions == test->vm->instructions
+		&& memcmp(ref->vm->reg, test->vm->reg, sizeof(ref->vm->reg)) == 0
+		&& ref->vm->psr == test->vm->psr
+		&& ref->vm->saved_sp == test->vm->saved_sp
+		&& ref->vm->irq_pending == test->vm->irq_pending
+		&& memcmp(ref->vm->irq_vectors, test->vm->irq_vectors, sizeof(ref->vm->irq_vectors)) == 0
+		&& ref->console.used == test->console.used
+		&& ref->console.output_bytes == test->console.output_bytes
+		&& ref->console.output_hash == test->console.output_hash
+		&& same_memory(ref->vm, test->vm);
+}
+
+
+
+// REPORTING
+
+static const char *status_name(int status)
+{
+	switch(status)
+	{
+		case VM_RUNNING:	return "running";
+		case VM_HALTED:		return "halted";
+		case VM_ILLEGAL:	return "illegal instruction";
+		default:			return "stopped";
+	}
+}
+
+static void report(const diff_side *ref, const diff_side *test, int engine, uint16_t pc, uint16_t instr)
+{
+	const char *names[2] = { engine_name(ENGINE_SWITCH), engine_name(engine) };
+	const diff_side *sides[2] = { ref, test };
+
+	fprintf(stderr, "Engines diverge at instruction %llu, x%04X: x%04X\n",
+		(unsigned long long)ref->vm->instructions, pc, instr);
+	for(int i = 0; i < 2; i++)
+	{
+		char state[VM_STATE_SIZE];
+		vm_format_state(sides[i]->vm, state);
+		fprintf(stderr, "%-8s %s, %s, %llu keys read, %llu bytes written\n", names[i], state,
+			status_name(sides[i]->vm->status), (unsigned long long)sides[i]->console.used,
+			(unsigned long long)sides[i]->console.output_bytes);
+	}
+	if(ref->console.output_hash != test->console.output_hash)
+	{
+		fprintf(stderr, "output differs\n");
+	}
+
+	unsigned shown = 0, differing = 0;
+	for(uint32_t address = 0; address < MEMORY_MAX; address++)
+	{
+		uint16_t a = memory_peek(ref->vm, (uint16_t)address), b = memory_peek(test->vm, (uint16_t)address);
+		if(a != b && differing++ < DIFF_MAX_SHOWN)
+		{
+			fprintf(stderr, "memory x%04X: %s x%04X, %s x%04X\n", (unsigned)address, names[0], a, names[1], b);
+			shown++;
+		}
+	}
+	if(differing > shown)
+	{
+		fprintf(stderr, "... %u more differing words\n", differing - shown);
+	}
+}
+
+// Both sides were equal at checkpoint and differ steps instructions later:
+// narrows that down to the one instruction after which they first differ
+static void locate(diff_side *ref, diff_side *test, int engine, diff_checkpoint *checkpoint, uint64_t steps)
+{
+	uint64_t lo = 0, hi = steps; // equal after lo, different after hi
+	while(hi - lo > 1)
+	{
+		uint64_t mid = lo + (hi - lo) / 2;
+		restore(ref, checkpoint);
+		restore(test, checkpoint);
+		run_both(ref, test, mid - lo, 0);
+		if(same(ref, test))
+		{
+			capture(ref, checkpoint);
+			lo = mid;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+
+	restore(ref, checkpoint);
+	restore(test, checkpoint);
+	uint16_t pc = ref->vm->reg[R_PC];
+	uint16_t instr = memory_peek(ref->vm, pc);
+	run_both(ref, test, 1, 0);
+	report(ref, test, engine, pc, instr);
+}
+
+
+
+int run_diff(const lc3_vm *vm, int engine, uint64_t interval, const lc3_limits *limits)
+{
+	size_t size = 0;
+	char *input = stdin_is_terminal() ? NULL : read_all_input(&size);
+	diff_checkpoint *checkpoint = malloc(sizeof(*checkpoint));
+	diff_side ref = { NULL, { input, input ? size : 0, 0, FNV_OFFSET, 0, 1 }, 0 };
+	diff_side test = { NULL, { input, input ? size : 0, 0, FNV_OFFSET, 0, 0 }, 0 };
+	lc3_io ref_io = { &ref.console, diff_check_key, diff_read_key, diff_write, NULL };
+	lc3_io test_io = { &test.console, diff_check_key, diff_read_key, diff_write, NULL };
+	ref.vm = vm_create(&ref_io);
+	test.vm = vm_create(&test_io);
+
+	int result = -1;
+	if(checkpoint && ref.vm && test.vm)
+	{
+		// Both start from a copy of the loaded machine
+		copy_machine(vm, checkpoint);
+		checkpoint->console = ref.console;
+		restore(&ref, checkpoint);
+		restore(&test, checkpoint);
+		ref.console.echo = 1;
+		memcpy(ref.vm->traps, vm->traps, sizeof(vm->traps));
+		memcpy(test.vm->traps, vm->traps, sizeof(vm->traps));
+		vm_set_engine(ref.vm, ENGINE_SWITCH);
+		vm_set_engine(test.vm, engine);
+		vm_set_interactive(ref.vm, 0);
+		vm_set_interactive(test.vm, 0);
+
+		int threaded = cpu_count() > 1;
+		double deadline = limits->timeout > 0 ? monotonic_seconds() + limits->timeout : 0;
+		uint64_t start = vm->instructions;
+		result = 0;
+		for(;;)
+		{
+			uint64_t steps = interval;
+			if(limits->max_instructions)
+			{
+				uint64_t left = limits->max_instructions - (ref.vm->instructions - start);
+				if(left == 0)
+				{
+					ref.vm->status = VM_LIMIT;
+					break;
+				}
+				if(left < steps)
+				{
+					steps = left;
+				}
+			}
+
+			capture(&ref, checkpoint);
+			run_both(&ref, &test, steps, threaded);
+			if(!same(&ref, &test))
+			{
+				locate(&ref, &test, engine, checkpoint, steps);
+				result = 1;
+				break;
+			}
+			if(ref.vm->status != VM_RUNNING)
+			{
+				break;
+			}
+			if(deadline && monotonic_seconds() >= deadline)
+			{
+				ref.vm->status = VM_TIMEOUT;
+				break;
+			}
+		}
+		if(result == 0)
+		{
+			fprintf(stderr, "%s and %s agree over %llu instructions (%s)\n", engine_name(ENGINE_SWITCH), engine_name(engine),
+				(unsigned long long)(ref.vm->instructions - start),
+				ref.vm->status == VM_LIMIT ? "instruction limit" : ref.vm->status == VM_TIMEOUT ? "timed out" : status_name(ref.vm->status));
+		}
+	}
+
+	vm_destroy(ref.vm);
+	vm_destroy(test.vm);
+	free(checkpoint);
+	free(input);
+	return result;
+}
@@ -0,0 +1,36 @@
+/*
+
+Diff.h
+
+Differential testing of an engine against the reference switch engine
+
+*/
+
+#ifndef DIFF_H
+#define DIFF_H
+
+#include "LC3.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DIFF_INTERVAL (1 << 16) // default instructions between comparisons
+
+// Copies vm (as loaded, it isn't run itself) into two machines, one on the
+// switch engine and one on engine, and runs them side by side within limits.
+// Registers, memory, input taken and output written are compared every
+// interval instructions; on a mismatch the interval is bisected and the first
+// instruction whose result differs is reported on stderr. Stdin is read up
+// front like --headless and both machines get the same keys, the reference
+// machine's output goes to stdout.
+//
+// Returns 0 if the machines agreed until they stopped, 1 if they diverged and
+// -1 if out of memory.
+int run_diff(const lc3_vm *vm, int engine, uint64_t interval, const lc3_limits *limits);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
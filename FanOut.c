@@ -0,0 +1,232 @@
+/*
+
+FanOut.c
+
+--fan-out. The prefix runs on the calling thread with an empty keyboard
+until vm_run_until() stops it in front of the first TRAP that reads a key.
+Every clone then shares its memory copy-on-write (see vm_clone()), reads its
+own input file and writes into its own buffer, so the clones run on threads
+of their own with nothing to lock.
+
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "FanOut.h"
+#include "ReadImage.h"
+#include "Threads.h"
+
+typedef struct
+{
+	const char *input_path;
+	lc3_vm *vm;
+	const lc3_limits *limits;
+	lc3_thread thread;
+	int threaded;		// thread was started and has to be joined
+
+	// Filled in by the clone's thread
+	int status;
+	uint64_t instructions;	// since the fork
+	char *output;
+	size_t output_used;
+	size_t output_capacity;
+} fan_out_branch;
+
+
+
+// BRANCH CONSOLE
+
+// vm_buffer_input() answers for the keyboard
+static int branch_check_key(void *user)
+{
+	return 0;
+}
+
+static uint16_t branch_read_key(void *user)
+{
+	return (uint16_t)EOF;
+}
+
+static void branch_write(void *user, const char *bytes, size_t count)
+{
+	fan_out_branch *branch = user;
+	if(branch->output_used + count > branch->output_capacity)
+	{
+		size_t capacity = branch->output_capacity ? branch->output_capacity : 4096;
+		while(capacity < branch->output_used + count)
+		{
+			capacity *= 2;
+		}
+		char *bigger = realloc(branch->output, capacity);
+		if(!bigger)
+		{
+			return; // the rest of the output is lost, the run goes on
+		}
+		branch->output = bigger;
+		branch->output_capacity = capacity;
+	}
+	memcpy(branch->output + branch->output_used, bytes, count);
+	branch->output_used += count;
+}
+
+
+
+// RUNNING
+
+// vm_run_limited() for the prefix, stopping short of the first key read.
+// VM_BREAK means the machine is at the fork point.
+static int run_prefix(lc3_vm *vm, const lc3_limits *limits)
+{
+	double deadline = limits->timeout > 0 ? monotonic_seconds() + limits->timeout : 0;
+	uint64_t start = vm->instructions;
+	// Every call checks its first instruction too, the TRAP may be the entry
+	// point or sit right where a slice ends
+	lc3_until until = { VM_UNTIL_INPUT | VM_UNTIL_CHECK_FIRST | VM_UNTIL_INSTRUCTIONS, 0, 0, 0 };
+	for(;;)
+	{
+		// Without a clock to check the whole instruction budget can go in one call
+		until.instructions = deadline ? vm->instructions + VM_LIMIT_SLICE : UINT64_MAX;
+		if(limits->max_instructions && until.instructions > start + limits->max_instructions)
+		{
+			until.instructions = start + limits->max_instructions;
+		}
+		int status = vm_run_until(vm, &until);
+		if(status != VM_BREAK || vm->instructions < until.instructions)
+		{
+			return status; // stopped by itself, or in front of the TRAP
+		}
+		if(limits->max_instructions && vm->instructions - start >= limits->max_instructions)
+		{
+			vm->status = VM_LIMIT;
+			return VM_LIMIT;
+		}
+		if(deadline && monotonic_seconds() >= deadline)
+		{
+			vm->status = VM_TIMEOUT;
+			return VM_TIMEOUT;
+		}
+	}
+}
+
+static void run_branch(void *arg)
+{
+	fan_out_branch *branch = arg;
+	uint64_t start = branch->vm->instructions;
+	branch->status = vm_run_limited(branch->vm, branch->limits);
+	branch->instructions = branch->vm->instructions - start;
+	output_flush(&branch->vm->out);
+}
+
+static const char *status_name(int status)
+{
+	switch(status)
+	{
+		case VM_HALTED:		return "halted";
+		case VM_ILLEGAL:	return "illegal instruction";
+		case VM_LIMIT:		return "instruction limit";
+		case VM_TIMEOUT:	return "timed out";
+		default:			return "stopped";
+	}
+}
+
+
+
+int run_fan_out(lc3_vm *vm, const char *const *inputs, int count, const lc3_limits *limits)
+{
+	fan_out_branch *branches = calloc(count, sizeof(*branches));
+	char *nothing = branches ? malloc(1) : NULL;
+	if(!nothing || !vm_buffer_input(vm, nothing, 0)) // frees nothing if it fails
+	{
+		free(branches);
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+	vm_set_interactive(vm, 0);
+
+	int status = run_prefix(vm, limits);
+	output_flush(&vm->out);
+	if(status != VM_BREAK)
+	{
+		fprintf(stderr, "No fan-out: the machine %s after %llu instructions without reading a key\n",
+			status_name(status), (unsigned long long)vm->instructions);
+		free(branches);
+		return -1;
+	}
+	fflush(stdout);
+	fprintf(stderr, "Fanning out %d ways at x%04X after %llu instructions\n",
+		count, vm->reg[R_PC], (unsigned long long)vm->instructions);
+
+	// Clone everything first, nothing may run while the parent's pages are handed out
+	int result = 0;
+	for(int i = 0; i < count; i++)
+	{
+		fan_out_branch *branch = &branches[i];
+		branch->input_path = inputs[i];
+		branch->limits = limits;
+		size_t size;
+		char *input = read_file(inputs[i], &size);
+		if(!input)
+		{
+			fprintf(stderr, "Failed to read input: %s\n", inputs[i]);
+			result = -1;
+			break;
+		}
+		lc3_io io = { branch, branch_check_key, branch_read_key, branch_write, NULL };
+		branch->vm = vm_clone(vm, &io);
+		if(!branch->vm || !vm_buffer_input(branch->vm, input, size))
+		{
+			if(!branch->vm)
+			{
+				free(input);
+			}
+			fprintf(stderr, "Out of memory\n");
+			result = -1;
+			break;
+		}
+	}
+
+	if(result == 0)
+	{
+		for(int i = 0; i < count; i++)
+		{
+			branches[i].threaded = thread_start(&branches[i].thread, run_branch, &branches[i]);
+			if(!branches[i].threaded)
+			{
+				run_branch(&branches[i]);
+			}
+		}
+		for(int i = 0; i < count; i++)
+		{
+			if(branches[i].threaded)
+			{
+				thread_join(branches[i].thread);
+			}
+		}
+		for(int i = 0; i < count; i++)
+		{
+			fan_out_branch *branch = &branches[i];
+			printf("== %s: %s after %llu more instructions\n", branch->input_path,
+				status_name(branch->status), (unsigned long long)branch->instructions);
+			fwrite(branch->output, 1, branch->output_used, stdout);
+			if(branch->output_used && branch->output[branch->output_used - 1] != '\n')
+			{
+				printf("\n"); // keeps the next heading on a line of its own
+			}
+			if(branch->status != VM_HALTED)
+			{
+				result++;
+			}
+		}
+	}
+
+	for(int i = 0; i < count; i++)
+	{
+		vm_destroy(branches[i].vm);
+		free(branches[i].output);
+	}
+	free(branches);
+	return result;
+}
@@ -0,0 +1,34 @@
+/*
+
+FanOut.h
+
+What-if runs for --fan-out: one machine runs up to the point where it first
+wants a key, then is cloned once per input file and every clone goes on
+from there on its own thread. The shared prefix runs once however many
+inputs there are.
+
+*/
+
+#ifndef FAN_OUT_H
+#define FAN_OUT_H
+
+#include "LC3.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Runs vm, loaded and with the keyboard left to this, up to the first TRAP
+// to GETC or IN (see VM_UNTIL_INPUT) with no keys to read, then runs one
+// clone of it per input file with that file as its keyboard. The limits
+// (see vm_run_limited()) apply to the prefix and to every clone from the
+// fork on. Each clone's status and output is printed in the order of inputs.
+// Returns the number of clones that did not halt, -1 if an input can't be
+// read or the prefix never reaches a fork point.
+int run_fan_out(lc3_vm *vm, const char *const *inputs, int count, const lc3_limits *limits);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
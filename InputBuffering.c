@@ -0,0 +1,355 @@
+/*
+
+InputBuffering.c
+
+Console input for the LC-3 VM. Keys are collected into a ring buffer so that
+polling KBSR never blocks, and GETC, IN and KBDR all take them from there.
+The backend is picked at compile time: Win32 console APIs with a reader
+thread, or termios and poll() everywhere else. Input that isn't a terminal
+is read in large blocks, and on POSIX a regular file is mapped whole.
+
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "InputBuffering.h"
+
+#define INPUT_RING_SIZE 256 // must be a power of two
+#define INPUT_RING_MASK (INPUT_RING_SIZE - 1)
+#define INPUT_CHUNK_SIZE 65536 // read_all_input() grows its buffer by at least this much, and the POSIX ring for redirected input
+
+
+
+#ifdef _WIN32
+
+// WIN32 BACKEND
+
+// A background thread blocks on the console and pushes keys into the ring,
+// so polling KBSR only has to compare two indices instead of waiting on the handle
+
+#include <Windows.h>
+
+static HANDLE hStdin = INVALID_HANDLE_VALUE;
+static HANDLE hInputReady = NULL; // auto-reset event, signalled on every push and on EOF
+static DWORD fdwMode, fdwOldMode;
+
+// Single producer moves the head, single consumer (the VM) moves the tail
+static unsigned char input_ring[INPUT_RING_SIZE];
+
+static volatile LONG input_head = 0;
+static volatile LONG input_tail = 0;
+static volatile LONG input_eof = 0;
+static volatile LONG input_interrupted = 0;
+
+static DWORD WINAPI input_reader(LPVOID param)
+{
+    for(;;)
+    {
+        // Ring is full, wait for the VM to drain it rather than dropping keys
+        while(input_head - input_tail == INPUT_RING_SIZE)
+        {
+            Sleep(1);
+        }
+
+        // As much as fits up to the wrap point, a console returns whatever was typed
+        LONG start = input_head & INPUT_RING_MASK;
+        LONG room = INPUT_RING_SIZE - (input_head - input_tail);
+        if(room > INPUT_RING_SIZE - start)
+        {
+            room = INPUT_RING_SIZE - start;
+        }
+        DWORD n;
+        if(!ReadFile(hStdin, input_ring + start, (DWORD)room, &n, NULL) || n == 0)
+        {
+            break;
+        }
+        InterlockedExchange(&input_head, input_head + (LONG)n); /* publish after the bytes are stored */
+        SetEvent(hInputReady);
+    }
+    InterlockedExchange(&input_eof, 1);
+    SetEvent(hInputReady);
+    return 0;
+}
+
+void disable_input_buffering()
+{
+    hStdin = GetStdHandle(STD_INPUT_HANDLE);
+    GetConsoleMode(hStdin, &fdwOldMode); /* save old mode */
+    fdwMode = fdwOldMode
+            ^ ENABLE_ECHO_INPUT  /* no input echo */
+            ^ ENABLE_LINE_INPUT; /* return when one or
+                                    more characters are available */
+    SetConsoleMode(hStdin, fdwMode); /* set new mode */
+    FlushConsoleInputBuffer(hStdin); /* clear buffer */
+
+    hInputReady = CreateEvent(NULL, FALSE, FALSE, NULL);
+    CreateThread(NULL, 0, input_reader, NULL, 0, NULL);
+}
+
+void restore_input_buffering()
+{
+    SetConsoleMode(hStdin, fdwOldMode);
+}
+
+uint16_t check_key()
+{
+    return input_head != input_tail;
+}
+
+uint16_t read_key()
+{
+    while(input_head == input_tail)
+    {
+        if((input_eof || input_interrupted) && input_head == input_tail)
+        {
+            return (uint16_t)EOF;
+        }
+        WaitForSingleObject(hInputReady, INFINITE);
+    }
+    unsigned char c = input_ring[input_tail & INPUT_RING_MASK];
+    InterlockedExchange(&input_tail, input_tail + 1);
+    return c;
+}
+
+void interrupt_input()
+{
+    InterlockedExchange(&input_interrupted, 1);
+    if(hInputReady)
+    {
+        SetEvent(hInputReady);
+    }
+}
+
+int stdin_is_terminal()
+{
+    return GetFileType(GetStdHandle(STD_INPUT_HANDLE)) == FILE_TYPE_CHAR;
+}
+
+// Reads up to room bytes, 0 at the end of input (a closed pipe reports that as an error)
+static size_t read_input_chunk(char *buffer, size_t room)
+{
+    DWORD n;
+    if(!ReadFile(GetStdHandle(STD_INPUT_HANDLE), buffer, (DWORD)room, &n, NULL))
+    {
+        return GetLastError() == ERROR_BROKEN_PIPE ? 0 : (size_t)-1;
+    }
+    return n;
+}
+
+// END WIN32 BACKEND
+
+
+
+#else
+
+// POSIX BACKEND
+
+// Everything runs on the VM thread: poll() with a zero timeout tells us whether
+// stdin has bytes, and whatever is waiting is read into the ring in one call
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <unistd.h>
+
+static struct termios original_tio;
+static int have_original_tio = 0; // stdin was a terminal and its mode was saved
+
+// Single consumer (the VM), which also refills it. A terminal gets the small
+// ring, a pipe one of INPUT_CHUNK_SIZE, and a regular file is mapped in
+// place of a ring with everything after the file offset already in it.
+static unsigned char terminal_ring[INPUT_RING_SIZE];
+static unsigned char *input_ring = NULL;
+static size_t input_ring_mask = 0; // ring size - 1, SIZE_MAX for a mapped file
+static size_t input_head = 0;
+static size_t input_tail = 0;
+static int input_eof = 0;
+static volatile sig_atomic_t input_interrupted = 0;
+static int wake_pipe[2] = { -1, -1 }; // interrupt_input() writes to it to end a poll() waiting for a key
+
+// Picks the buffer for whatever stdin turns out to be, on first use
+static void setup_input_ring(void)
+{
+    if(pipe(wake_pipe) != 0)
+    {
+        wake_pipe[0] = wake_pipe[1] = -1; // ^C then only takes effect once a key arrives
+    }
+    struct stat st;
+    if(fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        off_t offset = lseek(STDIN_FILENO, 0, SEEK_CUR);
+        void *p = offset >= 0 ? mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, STDIN_FILENO, 0) : MAP_FAILED;
+        if(p != MAP_FAILED)
+        {
+            input_ring = p;
+            input_ring_mask = SIZE_MAX;
+            input_tail = offset < st.st_size ? (size_t)offset : (size_t)st.st_size;
+            input_head = (size_t)st.st_size;
+            input_eof = 1;
+            return;
+        }
+    }
+    if(!isatty(STDIN_FILENO) && (input_ring = malloc(INPUT_CHUNK_SIZE)) != NULL)
+    {
+        input_ring_mask = INPUT_CHUNK_SIZE - 1;
+        return;
+    }
+    input_ring = terminal_ring;
+    input_ring_mask = INPUT_RING_MASK;
+}
+
+// Move pending stdin bytes into the ring, waiting at most timeout ms (-1 waits forever)
+static void fill_input_ring(int timeout)
+{
+    if(!input_ring)
+    {
+        setup_input_ring();
+    }
+    if(input_eof || input_head - input_tail == input_ring_mask + 1)
+    {
+        return;
+    }
+
+    struct pollfd pfd[2] = { { STDIN_FILENO, POLLIN, 0 }, { wake_pipe[0], POLLIN, 0 } }; // poll() skips a -1
+    if(poll(pfd, 2, timeout) <= 0 || !pfd[0].revents)
+    {
+        return;
+    }
+
+    // Only read up to the wrap point so one read() fills a contiguous span
+    size_t size = input_ring_mask + 1;
+    size_t start = input_head & input_ring_mask;
+    size_t room = size - (input_head - input_tail);
+    if(room > size - start)
+    {
+        room = size - start;
+    }
+
+    ssize_t n = read(STDIN_FILENO, input_ring + start, room);
+    if(n > 0)
+    {
+        input_head += (size_t)n;
+    }
+    else if(n == 0 || (errno != EINTR && errno != EAGAIN))
+    {
+        input_eof = 1;
+    }
+}
+
+void disable_input_buffering()
+{
+    if(tcgetattr(STDIN_FILENO, &original_tio) != 0)
+    {
+        return; /* not a terminal, nothing to switch */
+    }
+    have_original_tio = 1;
+
+    struct termios new_tio = original_tio;
+    new_tio.c_lflag &= ~(ICANON | ECHO); /* no line editing, no echo */
+    new_tio.c_cc[VMIN] = 1;
+    new_tio.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSANOW, &new_tio);
+    tcflush(STDIN_FILENO, TCIFLUSH); /* clear buffer */
+}
+
+void restore_input_buffering()
+{
+    if(have_original_tio)
+    {
+        tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
+    }
+}
+
+uint16_t check_key()
+{
+    if(input_head == input_tail)
+    {
+        fill_input_ring(0);
+    }
+    return input_head != input_tail;
+}
+
+uint16_t read_key()
+{
+    while(input_head == input_tail)
+    {
+        if(input_eof || input_interrupted)
+        {
+            return (uint16_t)EOF;
+        }
+        fill_input_ring(-1);
+    }
+    return input_ring[input_tail++ & input_ring_mask];
+}
+
+void interrupt_input()
+{
+    input_interrupted = 1;
+    if(wake_pipe[1] >= 0)
+    {
+        char c = 0;
+        ssize_t n = write(wake_pipe[1], &c, 1); // a full pipe already wakes poll()
+        (void)n;
+    }
+}
+
+int stdin_is_terminal()
+{
+    return isatty(STDIN_FILENO);
+}
+
+// Reads up to room bytes, 0 at the end of input
+static size_t read_input_chunk(char *buffer, size_t room)
+{
+    ssize_t n;
+    do
+    {
+        n = read(STDIN_FILENO, buffer, room);
+    } while(n < 0 && errno == EINTR);
+    return n < 0 ? (size_t)-1 : (size_t)n;
+}
+
+// END POSIX BACKEND
+
+#endif
+
+
+
+// WHOLE INPUT
+
+char *read_all_input(size_t *size)
+{
+    size_t used = 0, capacity = INPUT_CHUNK_SIZE;
+    char *buffer = malloc(capacity);
+    while(buffer)
+    {
+        if(capacity - used < INPUT_CHUNK_SIZE)
+        {
+            char *grown = realloc(buffer, capacity * 2);
+            if(!grown)
+            {
+                break;
+            }
+            buffer = grown;
+            capacity *= 2;
+        }
+        size_t n = read_input_chunk(buffer + used, capacity - used);
+        if(n == 0)
+        {
+            *size = used;
+            return buffer;
+        }
+        if(n == (size_t)-1)
+        {
+            break;
+        }
+        used += n;
+    }
+    free(buffer);
+    return NULL;
+}
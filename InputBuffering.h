@@ -0,0 +1,38 @@
+/*
+
+InputBuffering.h
+
+Console input layer, one API over the Win32 and POSIX backends
+
+*/
+
+#ifndef INPUT_BUFFERING_H
+#define INPUT_BUFFERING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Put the terminal in raw (unechoed, unbuffered) mode and start collecting keys
+void disable_input_buffering(void);
+
+// Put the terminal back the way disable_input_buffering() found it
+void restore_input_buffering(void);
+
+// Never blocks, non-zero when a key is waiting
+uint16_t check_key(void);
+
+// Blocks until a key is available, returns EOF (as a 16-bit word) once stdin is closed
+uint16_t read_key(void);
+
+// For a SIGINT handler, and async-signal-safe: from now on read_key() returns
+// EOF instead of waiting for a key, one that is waiting already included
+void interrupt_input(void);
+
+// Non-zero when stdin is a terminal (a console on Win32) rather than a pipe or a file
+int stdin_is_terminal(void);
+
+// Reads stdin to the end in large chunks, without any of the above. Returns a
+// malloc()ed buffer, or NULL if stdin couldn't be read or memory ran out.
+char *read_all_input(size_t *size);
+
+#endif
@@ -0,0 +1,133 @@
+/*
+
+InterruptHandling.c
+
+Supervisor stack switching and interrupt delivery. Interrupts are only
+taken between engine runs, at VM_INTERRUPT_SLICE boundaries, so every engine
+sees a key or a raised interrupt at the same instruction.
+
+*/
+
+
+#include "InterruptHandling.h"
+#include "Memory.h"
+
+
+
+// SUPERVISOR STACK
+
+// The stack can sit anywhere, even on the device page
+static void stack_write(lc3_vm *vm, uint16_t address, uint16_t val)
+{
+	if(address >= MMIO_BASE)
+	{
+		mmio_write(vm, address, val);
+		return;
+	}
+	vm_write_memory(vm, address, val);
+}
+
+static uint16_t stack_read(lc3_vm *vm, uint16_t address)
+{
+	return address >= MMIO_BASE ? mmio_read(vm, address) : memory_peek(vm, address);
+}
+
+void enter_supervisor(lc3_vm *vm, uint16_t psr)
+{
+	if(vm->psr & PSR_USER)
+	{
+		uint16_t user_sp = vm->reg[R_R6];
+		vm->reg[R_R6] = vm->saved_sp;
+		vm->saved_sp = user_sp;
+		vm->psr &= ~PSR_USER;
+	}
+	stack_write(vm, --vm->reg[R_R6], psr);
+	stack_write(vm, --vm->reg[R_R6], vm->reg[R_PC]);
+}
+
+uint16_t leave_supervisor(lc3_vm *vm)
+{
+	vm->reg[R_PC] = stack_read(vm, vm->reg[R_R6]++);
+	uint16_t psr = stack_read(vm, vm->reg[R_R6]++);
+	vm->psr = psr & (PSR_USER | PSR_PRIORITY);
+	if(vm->psr & PSR_USER)
+	{
+		uint16_t supervisor_sp = vm->reg[R_R6];
+		vm->reg[R_R6] = vm->saved_sp;
+		vm->saved_sp = supervisor_sp;
+	}
+	return psr;
+}
+
+
+
+// INTERRUPTS
+
+void vm_check_interrupts(lc3_vm *vm)
+{
+	vm->interrupts = 1;
+	uint64_t to_boundary = (VM_INTERRUPT_SLICE - vm_instruction_count(vm) % VM_INTERRUPT_SLICE) % VM_INTERRUPT_SLICE;
+	if(vm->steps > to_boundary)
+	{
+		uint64_t cut = vm->steps - to_boundary;
+		vm->steps -= cut;
+		vm->run_steps -= cut;
+	}
+}
+
+void vm_raise_interrupt(lc3_vm *vm, uint8_t vector, int priority)
+{
+	vm->irq_pending |= 1 << (priority & 7);
+	vm->irq_vectors[priority & 7] = vector;
+	vm_check_interrupts(vm);
+}
+
+void service_interrupts(lc3_vm *vm)
+{
+	// Only sources with a handler in the table compete, so one without
+	// can't hold back the ones below it
+	int level = -1;
+	uint16_t target = 0;
+	int raised = 0; // by vm_raise_interrupt() rather than the keyboard
+	
+	// The keyboard is asked here rather than from a thread of its own, so
+	// keys arrive at the same instruction under every engine and in replays
+	uint16_t kbsr = memory_peek(vm, MR_KBSR);
+	if(kbsr & KBSR_IE)
+	{
+		if(!(kbsr & KBSR_READY) && vm_check_key(vm))
+		{
+			memory_poke(vm, MR_KBDR, vm_read_key(vm));
+			memory_poke(vm, MR_KBSR, kbsr |= KBSR_READY);
+		}
+		uint16_t handler = memory_peek(vm, INTERRUPT_TABLE + INTERRUPT_KEYBOARD);
+		if((kbsr & KBSR_READY) && handler)
+		{
+			level = KEYBOARD_PRIORITY;
+			target = handler;
+		}
+	}
+	for(int l = 7; l > level; l--)
+	{
+		uint16_t handler = memory_peek(vm, INTERRUPT_TABLE + vm->irq_vectors[l]);
+		if((vm->irq_pending & (1 << l)) && handler)
+		{
+			level = l;
+			target = handler;
+			raised = 1;
+			break;
+		}
+	}
+	
+	if(level > (vm->psr & PSR_PRIORITY) >> 8)
+	{
+		if(raised)
+		{
+			vm->irq_pending &= ~(1 << level);
+		}
+		enter_supervisor(vm, vm->psr | vm->reg[R_COND]);
+		vm->psr = (vm->psr & ~PSR_PRIORITY) | level << 8;
+		vm->reg[R_PC] = target;
+	}
+	vm->interrupts = (kbsr & KBSR_IE) || vm->irq_pending;
+}
@@ -0,0 +1,38 @@
+/*
+
+InterruptHandling.h
+
+Privilege modes and interrupts. The supervisor stack switch shared by TRAPs
+through the vector table, exceptions, device interrupts and RTI, and the
+check between engine runs that delivers interrupts.
+
+*/
+
+#ifndef INTERRUPT_HANDLING_H
+#define INTERRUPT_HANDLING_H
+
+#include <stdint.h>
+
+#include "LC3.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Saves psr and PC on the supervisor stack, switching to it from user mode
+void enter_supervisor(lc3_vm *vm, uint16_t psr);
+
+// RTI in supervisor mode: pops PC and the PSR enter_supervisor() saved,
+// going back to the user stack if that PSR is user mode. Sets vm->psr and
+// returns the whole saved PSR, the caller restores the condition codes.
+uint16_t leave_supervisor(lc3_vm *vm);
+
+// Between engine runs: takes the most urgent interrupt with a handler if the
+// PSR lets it through, and clears vm->interrupts once no device can raise one
+void service_interrupts(lc3_vm *vm);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
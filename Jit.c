@@ -0,0 +1,643 @@
+/*
+
+Jit.c
+
+Basic-block JIT from LC-3 to x86-64.
+
+The interpreter counts taken branches per target. Once a target reaches
+JIT_HOT_THRESHOLD, the straight-line run of ADD/AND/NOT/LEA starting there
+is translated, up to and including the BR or JMP that ends it:
+	- R0-R7 live in host r8w-r15w for the whole block, loaded on entry and
+	  written back on exit
+	- condition codes are lazy: we only track which host register holds the
+	  last flag-setting result and test it when the BR needs it
+	- a BR back to the block start loops natively, counting iterations in
+	  edx and returning to the interpreter once the caller's limit is reached
+Anything else (memory access, traps, the device page) ends the block and the
+interpreter takes over at that instruction.
+
+Writes through mem_write() to a page with translated code drop every block on
+that page, see jit_invalidate_page().
+
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "Jit.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define LC3_JIT_X64
+#endif
+
+#define JIT_ARENA_SIZE (4 << 20)	// bytes of native code before everything is flushed
+#define JIT_MAX_BLOCKS 4096
+#define JIT_MAX_INSTRS 128			// LC-3 instructions per block
+#define JIT_MAX_BLOCK_BYTES 2048	// worst case native size of one block
+
+// Source range of a translated block, for invalidation
+typedef struct
+{
+	uint16_t start;
+	uint16_t last;	// address of the final instruction
+} jit_block_range;
+
+struct jit_state
+{
+	jit_block_fn entry[MEMORY_MAX];	// per block start
+	uint16_t length[MEMORY_MAX];	// per block start
+	uint16_t hits[MEMORY_MAX];		// taken-branch counts per target
+	uint8_t *code_pages;			// owned by the caller
+	
+	jit_block_range blocks[JIT_MAX_BLOCKS];
+	int block_count;
+	
+	uint8_t *arena;		// allocated on the first translation
+	size_t arena_used;
+	uint8_t *out;		// emit position
+};
+
+jit_state *jit_create(uint8_t *code_pages)
+{
+	jit_state *jit = calloc(1, sizeof(*jit));
+	if(jit)
+	{
+		jit->code_pages = code_pages;
+	}
+	return jit;
+}
+
+int jit_hit(jit_state *jit, uint16_t target)
+{
+	return ++jit->hits[target] == JIT_HOT_THRESHOLD;
+}
+
+jit_block_fn jit_block(jit_state *jit, uint16_t pc)
+{
+	return jit->entry[pc];
+}
+
+uint16_t jit_block_length(jit_state *jit, uint16_t pc)
+{
+	return jit->length[pc];
+}
+
+
+
+#ifdef LC3_JIT_X64
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+
+
+// CODE ARENA
+
+static int arena_init(jit_state *j)
+{
+	if(j->arena)
+	{
+		return 1;
+	}
+#ifdef _WIN32
+	j->arena = VirtualAlloc(NULL, JIT_ARENA_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+	j->arena = mmap(NULL, JIT_ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(j->arena == MAP_FAILED)
+	{
+		j->arena = NULL;
+	}
+#endif
+	return j->arena != NULL;
+}
+
+// The arena is never writable and executable at the same time
+static void arena_writable(jit_state *j, int writable)
+{
+#ifdef _WIN32
+	DWORD old;
+	VirtualProtect(j->arena, JIT_ARENA_SIZE, writable ? PAGE_READWRITE : PAGE_EXECUTE_READ, &old);
+	if(!writable)
+	{
+		FlushInstructionCache(GetCurrentProcess(), j->arena, JIT_ARENA_SIZE);
+	}
+#else
+	mprotect(j->arena, JIT_ARENA_SIZE, writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC);
+#endif
+}
+
+static void arena_free(jit_state *j)
+{
+	if(!j->arena)
+	{
+		return;
+	}
+#ifdef _WIN32
+	VirtualFree(j->arena, 0, MEM_RELEASE);
+#else
+	munmap(j->arena, JIT_ARENA_SIZE);
+#endif
+	j->arena = NULL;
+}
+
+
+
+// X86-64 EMITTER
+
+// LC-3 register r lives in host register r8 + r, so every register operand
+// needs a REX prefix and its low three bits are just r
+
+enum
+{
+	CC_MEM = -1,	// flags are still the FL_* bits in reg[R_COND]
+	CC_EAX = -2		// last flag-setting result was saved to ax
+};
+
+enum
+{
+	X86_CC_B = 0x2,
+	X86_CC_NE = 0x5,
+	X86_CC_E = 0x4,
+	X86_CC_S = 0x8,
+	X86_CC_NS = 0x9,
+	X86_CC_LE = 0xE,
+	X86_CC_G = 0xF
+};
+
+#define REG_OFFSET(r) ((r) * 2) // byte offset of reg[r] from rbx
+
+static void emit1(jit_state *j, uint8_t b)
+{
+	*j->out++ = b;
+}
+
+static void emit16(jit_state *j, uint16_t v)
+{
+	emit1(j, v & 0xFF);
+	emit1(j, v >> 8);
+}
+
+static void emit32(jit_state *j, uint32_t v)
+{
+	emit16(j, v & 0xFFFF);
+	emit16(j, v >> 16);
+}
+
+// movzx r(8+r)d, word [rbx + reg[r]]
+static void emit_load_reg(jit_state *j, int r)
+{
+	emit1(j, 0x44); emit1(j, 0x0F); emit1(j, 0xB7); emit1(j, 0x43 | (r << 3)); emit1(j, REG_OFFSET(r));
+}
+
+// mov word [rbx + reg[r]], r(8+r)w
+static void emit_store_reg(jit_state *j, int r)
+{
+	emit1(j, 0x66); emit1(j, 0x44); emit1(j, 0x89); emit1(j, 0x43 | (r << 3)); emit1(j, REG_OFFSET(r));
+}
+
+// <op> dw, sw for the r/m16, r16 forms (0x89 mov, 0x01 add, 0x21 and, 0x85 test)
+static void emit_rr(jit_state *j, uint8_t opcode, int d, int s)
+{
+	emit1(j, 0x66); emit1(j, 0x45); emit1(j, opcode); emit1(j, 0xC0 | (s << 3) | d);
+}
+
+// <op> dw, imm8 sign extended (ext 0 add, 4 and)
+static void emit_ri(jit_state *j, int ext, int d, uint16_t imm)
+{
+	emit1(j, 0x66); emit1(j, 0x41); emit1(j, 0x83); emit1(j, 0xC0 | (ext << 3) | d); emit1(j, imm & 0xFF);
+}
+
+// not dw, leaves the host flags alone
+static void emit_not(jit_state *j, int d)
+{
+	emit1(j, 0x66); emit1(j, 0x41); emit1(j, 0xF7); emit1(j, 0xD0 | d);
+}
+
+// mov dw, imm16
+static void emit_mov_ri(jit_state *j, int d, uint16_t imm)
+{
+	emit1(j, 0x66); emit1(j, 0x41); emit1(j, 0xB8 + d); emit16(j, imm);
+}
+
+// mov word [rbx + reg[R_PC]], imm16
+static void emit_set_pc(jit_state *j, uint16_t pc)
+{
+	emit1(j, 0x66); emit1(j, 0xC7); emit1(j, 0x43); emit1(j, REG_OFFSET(R_PC)); emit16(j, pc);
+}
+
+// mov word [rbx + reg[R_PC]], r(8+r)w
+static void emit_set_pc_reg(jit_state *j, int r)
+{
+	emit1(j, 0x66); emit1(j, 0x44); emit1(j, 0x89); emit1(j, 0x43 | (r << 3)); emit1(j, REG_OFFSET(R_PC));
+}
+
+// Save the register holding the lazy flags to eax before it is overwritten
+static void emit_save_cc(jit_state *j, int r)
+{
+	emit1(j, 0x44); emit1(j, 0x89); emit1(j, 0xC0 | (r << 3)); // mov eax, r(8+r)d
+}
+
+// Sets host flags from the lazy condition, returns the jcc that is taken when
+// any of the nzp bits in mask hold
+static int emit_test_cc(jit_state *j, int cc, int mask)
+{
+	if(cc == CC_MEM)
+	{
+		emit1(j, 0xF6); emit1(j, 0x43); emit1(j, REG_OFFSET(R_COND)); emit1(j, mask); // test byte [cond], mask
+		return X86_CC_NE;
+	}
+	if(cc == CC_EAX)
+	{
+		emit1(j, 0x66); emit1(j, 0x85); emit1(j, 0xC0); // test ax, ax
+	}
+	else
+	{
+		emit_rr(j, 0x85, cc, cc);
+	}
+	
+	// After test, S is the LC-3 N flag and Z the LC-3 Z flag
+	switch(mask)
+	{
+		case FL_NEG:			return X86_CC_S;
+		case FL_ZRO:			return X86_CC_E;
+		case FL_POS:			return X86_CC_G;
+		case FL_NEG | FL_ZRO:	return X86_CC_LE;
+		case FL_NEG | FL_POS:	return X86_CC_NE;
+		default:				return X86_CC_NS; // FL_ZRO | FL_POS
+	}
+}
+
+// jcc rel32, returns the position of the displacement for patching
+static uint8_t *emit_jcc(jit_state *j, int cc)
+{
+	emit1(j, 0x0F); emit1(j, 0x80 | cc);
+	uint8_t *at = j->out;
+	emit32(j, 0);
+	return at;
+}
+
+static uint8_t *emit_jmp(jit_state *j)
+{
+	emit1(j, 0xE9);
+	uint8_t *at = j->out;
+	emit32(j, 0);
+	return at;
+}
+
+static void patch(jit_state *j, uint8_t *at, uint8_t *target)
+{
+	int32_t rel = (int32_t)(target - (at + 4));
+	memcpy(at, &rel, sizeof(rel));
+}
+
+// Writes the FL_* bits for the lazy condition back to reg[R_COND]
+static void emit_materialize_cc(jit_state *j, int cc)
+{
+	if(cc == CC_MEM)
+	{
+		return;
+	}
+	emit1(j, 0xB9); emit32(j, FL_ZRO);				// mov ecx, FL_ZRO
+	if(cc == CC_EAX)
+	{
+		emit1(j, 0x66); emit1(j, 0x85); emit1(j, 0xC0);	// test ax, ax
+	}
+	else
+	{
+		emit_rr(j, 0x85, cc, cc);
+	}
+	emit1(j, 0x74); emit1(j, 12);						// je done
+	emit1(j, 0xB9); emit32(j, FL_POS);				// mov ecx, FL_POS
+	emit1(j, 0x79); emit1(j, 5);						// jns done
+	emit1(j, 0xB9); emit32(j, FL_NEG);				// mov ecx, FL_NEG
+	emit1(j, 0x66); emit1(j, 0x89); emit1(j, 0x4B); emit1(j, REG_OFFSET(R_COND)); // done: mov [cond], cx
+}
+
+
+
+// TRANSLATION
+
+// Non-zero for instructions a block can contain or end with
+static int jit_can_translate(uint16_t instr)
+{
+	switch(instr >> 12)
+	{
+		case OP_ADD:
+		case OP_AND:
+		case OP_NOT:
+		case OP_LEA:
+		case OP_BR:
+		case OP_JMP:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+static void drop_block(jit_state *j, int i)
+{
+	j->entry[j->blocks[i].start] = NULL;
+	j->hits[j->blocks[i].start] = 0;
+	j->blocks[i] = j->blocks[--j->block_count];
+}
+
+int jit_supported(void)
+{
+	return 1;
+}
+
+void jit_destroy(jit_state *jit)
+{
+	if(jit)
+	{
+		arena_free(jit);
+		free(jit);
+	}
+}
+
+void jit_reset(jit_state *jit)
+{
+	while(jit->block_count > 0)
+	{
+		drop_block(jit, jit->block_count - 1);
+	}
+	memset(jit->code_pages, 0, MEMORY_MAX >> JIT_PAGE_SHIFT);
+	memset(jit->hits, 0, sizeof(jit->hits));
+	jit->arena_used = 0;
+}
+
+void jit_invalidate_page(jit_state *jit, uint16_t page)
+{
+	uint16_t first = page << JIT_PAGE_SHIFT;
+	uint16_t last = first + (1 << JIT_PAGE_SHIFT) - 1;
+	for(int i = jit->block_count - 1; i >= 0; i--)
+	{
+		if(jit->blocks[i].start <= last && jit->blocks[i].last >= first)
+		{
+			drop_block(jit, i);
+		}
+	}
+	// Blocks that spanned into neighbouring pages leave those flagged, which only costs a rescan
+	jit->code_pages[page] = 0;
+}
+
+int jit_compile(jit_state *j, const uint16_t *const *pages, uint16_t start)
+{
+	if(j->entry[start])
+	{
+		return 1; // still translated, a second copy would only take up arena space
+	}
+	if(!arena_init(j))
+	{
+		return 0;
+	}
+	if(j->block_count == JIT_MAX_BLOCKS || j->arena_used + JIT_MAX_BLOCK_BYTES > JIT_ARENA_SIZE)
+	{
+		jit_reset(j); // simpler than tracking free space, hot blocks get re-translated quickly
+	}
+	
+	// Find the extent of the block and the registers it touches
+	uint16_t pc = start;
+	unsigned used = 0, written = 0;
+	int count = 0;
+	int ends_in_branch = 0;
+	while(count < JIT_MAX_INSTRS && pc < MR_KBSR)
+	{
+		uint16_t instr = pages[pc >> MEMORY_PAGE_SHIFT][pc & MEMORY_PAGE_MASK];
+		if(!jit_can_translate(instr))
+		{
+			break;
+		}
+		int op = instr >> 12;
+		int r0 = (instr >> 9) & 0x7, r1 = (instr >> 6) & 0x7, r2 = instr & 0x7;
+		count++;
+		pc++;
+		if(op == OP_BR)
+		{
+			if(r0 == 0)
+			{
+				continue; // no condition bits, never taken
+			}
+			ends_in_branch = 1;
+			break;
+		}
+		if(op == OP_JMP)
+		{
+			used |= 1u << r1;
+			ends_in_branch = 1;
+			break;
+		}
+		used |= 1u << r0;
+		written |= 1u << r0;
+		if(op != OP_LEA)
+		{
+			used |= 1u << r1;
+		}
+		if((op == OP_ADD || op == OP_AND) && !((instr >> 5) & 0x1))
+		{
+			used |= 1u << r2;
+		}
+	}
+	if(count == 0)
+	{
+		return 0;
+	}
+	uint16_t last = start + count - 1;
+	
+	arena_writable(j, 1);
+	uint8_t *code = j->arena + j->arena_used;
+	j->out = code;
+	
+	// PROLOGUE
+	emit1(j, 0x53);						// push rbx
+	emit1(j, 0x41); emit1(j, 0x54);			// push r12
+	emit1(j, 0x41); emit1(j, 0x55);			// push r13
+	emit1(j, 0x41); emit1(j, 0x56);			// push r14
+	emit1(j, 0x41); emit1(j, 0x57);			// push r15
+#ifdef _WIN32
+	emit1(j, 0x48); emit1(j, 0x89); emit1(j, 0xCB);	// mov rbx, rcx
+	emit1(j, 0x52);						// push rdx, max_iterations is [rsp] from here on
+#else
+	emit1(j, 0x48); emit1(j, 0x89); emit1(j, 0xFB);	// mov rbx, rdi
+	emit1(j, 0x56);						// push rsi, max_iterations is [rsp] from here on
+#endif
+	emit1(j, 0x31); emit1(j, 0xD2);		// xor edx, edx
+	for(int r = 0; r < 8; r++)
+	{
+		if(used & (1u << r))
+		{
+			emit_load_reg(j, r);
+		}
+	}
+	
+	// BODY
+	uint8_t *body = j->out;
+	emit1(j, 0xFF); emit1(j, 0xC2);		// inc edx
+	uint8_t *to_epilogue = NULL; // not-taken side of the final BR
+	int cc = CC_MEM;
+	pc = start;
+	for(int i = 0; i < count; i++)
+	{
+		uint16_t instr = pages[pc >> MEMORY_PAGE_SHIFT][pc & MEMORY_PAGE_MASK];
+		pc++;
+		int op = instr >> 12;
+		int r0 = (instr >> 9) & 0x7, r1 = (instr >> 6) & 0x7, r2 = instr & 0x7;
+		int imm_flag = (instr >> 5) & 0x1;
+		
+		switch(op)
+		{
+			case OP_ADD:
+			case OP_AND:
+			{
+				uint8_t opcode = op == OP_ADD ? 0x01 : 0x21;
+				if(imm_flag)
+				{
+					if(r0 != r1)
+					{
+						emit_rr(j, 0x89, r0, r1);
+					}
+					emit_ri(j, op == OP_ADD ? 0 : 4, r0, sign_extend(instr & 0x1F, 5));
+				}
+				else if(r0 == r2)
+				{
+					emit_rr(j, opcode, r0, r1); // both ops commute
+				}
+				else
+				{
+					if(r0 != r1)
+					{
+						emit_rr(j, 0x89, r0, r1);
+					}
+					emit_rr(j, opcode, r0, r2);
+				}
+				cc = r0;
+				break;
+			}
+			case OP_NOT:
+			{
+				if(cc == r0)
+				{
+					emit_save_cc(j, r0);
+					cc = CC_EAX;
+				}
+				if(r0 != r1)
+				{
+					emit_rr(j, 0x89, r0, r1);
+				}
+				emit_not(j, r0);
+				break;
+			}
+			case OP_LEA:
+			{
+				emit_mov_ri(j, r0, pc + sign_extend(instr & 0x1FF, 9));
+				cc = r0;
+				break;
+			}
+			case OP_JMP:
+			{
+				emit_set_pc_reg(j, r1); // last instruction, falls into the epilogue
+				break;
+			}
+			case OP_BR:
+			{
+				if(r0 == 0)
+				{
+					break;
+				}
+				uint16_t target = pc + sign_extend(instr & 0x1FF, 9);
+				uint8_t *taken = NULL;
+				if(r0 != (FL_NEG | FL_ZRO | FL_POS))
+				{
+					taken = emit_jcc(j, emit_test_cc(j, cc, r0));
+					emit_set_pc(j, pc); // not taken, fall through
+					to_epilogue = emit_jmp(j);
+					patch(j, taken, j->out);
+				}
+				if(target == start)
+				{
+					emit1(j, 0x3B); emit1(j, 0x14); emit1(j, 0x24);	// cmp edx, [rsp]
+					patch(j, emit_jcc(j, X86_CC_B), body);
+				}
+				emit_set_pc(j, target);
+				break;
+			}
+		}
+	}
+	if(!ends_in_branch)
+	{
+		emit_set_pc(j, pc); // the interpreter runs the instruction that stopped us
+	}
+	
+	// EPILOGUE
+	if(to_epilogue)
+	{
+		patch(j, to_epilogue, j->out);
+	}
+	emit_materialize_cc(j, cc);
+	for(int r = 0; r < 8; r++)
+	{
+		if(written & (1u << r))
+		{
+			emit_store_reg(j, r);
+		}
+	}
+	emit1(j, 0x89); emit1(j, 0xD0);		// mov eax, edx
+	emit1(j, 0x59);						// pop rcx, drops max_iterations
+	emit1(j, 0x41); emit1(j, 0x5F);			// pop r15
+	emit1(j, 0x41); emit1(j, 0x5E);			// pop r14
+	emit1(j, 0x41); emit1(j, 0x5D);			// pop r13
+	emit1(j, 0x41); emit1(j, 0x5C);			// pop r12
+	emit1(j, 0x5B);						// pop rbx
+	emit1(j, 0xC3);						// ret
+	
+	j->arena_used += (size_t)(j->out - code);
+	j->arena_used = (j->arena_used + 15) & ~(size_t)15;
+	arena_writable(j, 0);
+	
+	j->blocks[j->block_count].start = start;
+	j->blocks[j->block_count].last = last;
+	j->block_count++;
+	for(unsigned page = start >> JIT_PAGE_SHIFT; page <= (unsigned)(last >> JIT_PAGE_SHIFT); page++)
+	{
+		j->code_pages[page] = 1;
+	}
+	j->length[start] = (uint16_t)count;
+	j->entry[start] = (jit_block_fn)(void *)code;
+	return 1;
+}
+
+
+
+#else
+
+// No native backend for this host, ENGINE_JIT behaves like ENGINE_CACHED
+
+int jit_supported(void)
+{
+	return 0;
+}
+
+void jit_destroy(jit_state *jit)
+{
+	free(jit);
+}
+
+void jit_reset(jit_state *jit)
+{
+	memset(jit->hits, 0, sizeof(jit->hits));
+}
+
+int jit_compile(jit_state *jit, const uint16_t *const *pages, uint16_t pc)
+{
+	return 0;
+}
+
+void jit_invalidate_page(jit_state *jit, uint16_t page)
+{
+}
+
+#endif
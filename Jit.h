@@ -0,0 +1,56 @@
+/*
+
+Jit.h
+
+Basic-block translator from LC-3 to native x86-64, used by ENGINE_JIT
+
+*/
+
+#ifndef JIT_H
+#define JIT_H
+
+#include <stdint.h>
+
+#include "LC3.h"
+
+#define JIT_HOT_THRESHOLD 64	// taken branches to an address before its block is translated
+#define JIT_PAGE_SHIFT 8		// invalidation granularity, 256-word pages
+#define JIT_LOOP_FUEL (1 << 20)	// most native loop iterations per call into a block
+
+// Native code for one block. Runs with the LC-3 register file, leaves
+// reg[R_PC] at the first instruction it did not execute and returns how many
+// times the block was entered, never more than max_iterations (at least 1).
+// Every iteration runs the whole block.
+typedef uint32_t (*jit_block_fn)(uint16_t *regs, uint32_t max_iterations);
+
+// Translated code for one machine
+typedef struct jit_state jit_state;
+
+// code_pages is set non-zero for pages that hold the source of at least one
+// translated block, so stores only need to call jit_invalidate_page() there
+jit_state *jit_create(uint8_t *code_pages);
+void jit_destroy(jit_state *jit);
+
+// Non-zero when this build can generate native code at all
+int jit_supported(void);
+
+// Drops every translated block and resets the counters
+void jit_reset(jit_state *jit);
+
+// Counts a taken branch to target, returns non-zero once it is hot
+int jit_hit(jit_state *jit, uint16_t target);
+
+// Translates the block starting at pc, reading it through a machine's page
+// table, returns non-zero if jit_block(pc) is now valid
+int jit_compile(jit_state *jit, const uint16_t *const *pages, uint16_t pc);
+
+// Native entry point for a translated block start, NULL elsewhere
+jit_block_fn jit_block(jit_state *jit, uint16_t pc);
+
+// Length in LC-3 instructions of the block at pc
+uint16_t jit_block_length(jit_state *jit, uint16_t pc);
+
+// Drops every block whose source overlaps the page, called when it is written
+void jit_invalidate_page(jit_state *jit, uint16_t page);
+
+#endif
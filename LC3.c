@@ -16,532 +16,496 @@ Date: 12/20/2022
 #include <stdio.h>
 #include <stdint.h>
 #include <signal.h>
-#include <Windows.h>
-#include <conio.h>
-
-#define MEMORY_MAX (1 << 16) // 16-bit registers, 2^16 memory locations 
-
-uint16_t memory[MEMORY_MAX]; // Array that holds all our memory addresses
-
-
-
-// MEMORY MAPPED REGISTERS
-
+#include <stdlib.h>
+#include <string.h>
+
+#include "Analysis.h"
+#include "Batch.h"
+#include "Diff.h"
+#include "FanOut.h"
+#include "InputBuffering.h"
+#include "LC3.h"
+#include "Output.h"
+#include "Profile.h"
+#include "Replay.h"
+#include "Snapshot.h"
+#include "Stats.h"
+#include "Trace.h"
+
+static volatile sig_atomic_t cli_stats_requested; // by SIGUSR1, answered between slices by run_cli()
+static volatile sig_atomic_t cli_interrupted; // by ^C, run_cli() stops at the next slice and main() exits
+
+// Exit codes besides 0, 1 (bad image) and 2 (bad arguments)
 enum
 {
-	MR_KBSR = 0xFE00,	// keyboard status
-	MR_KBDR = 0xFE02	// keyboard data 
-};
-
-
-
-
-// TRAP OPCODES
-
-
-enum 
-{
-	TRAP_GETC = 0x20,	// get char from keyboard, not echoed to terminal
-	TRAP_OUT = 0x21,	// output a char
-	TRAP_PUTS = 0x22,	// output a string
-	TRAP_IN = 0x23,		// get char from keyboard and echo to terminal
-	TRAP_PUTSP = 0x24,	// output a byte string
-	TRAP_HALT = 0x25	// halt the program
-	
-};
-
-
-
-// REGISTERS
-
-
-enum 
-{
-	
-	R_R0 = 0,
-	R_R1,
-	R_R2,
-	R_R3,
-	R_R4,
-	R_R5,
-	R_R6,
-	R_R7,
-	R_PC, // Program counter, holds address of next instruction in memory to execute
-	R_COND,
-	R_COUNT
-		
+	EXIT_INSTRUCTION_LIMIT = 3,	// --max-instructions ran out
+	EXIT_TIMEOUT = 4,			// --timeout ran out
+	EXIT_DIVERGED = 5			// --diff-engines found a difference
 };
 
-uint16_t reg[R_COUNT]; // Array that holds our registers
-
-
-
-// CONDITION FLAGS
-
-enum 
-{
-	
-	FL_POS = 1 << 0, // P
-	FL_ZRO = 1 << 1, // Z
-	FL_NEG = 1 << 2, // N
-};
-
-
-
-// INSTRUCTION SET -- OPCODES
-
-enum 
-{
-	
-	OP_BR = 0,	// branch
-	OP_ADD,		// add
-	OP_LD,		// load
-	OP_ST,		// store
-	OP_JSR,		// jump register
-	OP_AND,		// bitwise and
-	OP_LDR,		// load register
-	OP_STR,		// store register
-	OP_RTI,		// unused
-	OP_NOT,		// bitwise not
-	OP_LDI,		// load indirect
-	OP_STI,		// store indirect
-	OP_JMP,		// jump
-	OP_RES,		// reserved (unused)
-	OP_LEA,		// load effective address
-	OP_TRAP		// execute trap
-	
-};
-
-
-// INPUT BUFFERING
-
-HANDLE hStdin = INVALID_HANDLE_VALUE;
-DWORD fdwMode, fdwOldMode;
-
-void disable_input_buffering()
-{
-    hStdin = GetStdHandle(STD_INPUT_HANDLE);
-    GetConsoleMode(hStdin, &fdwOldMode); /* save old mode */
-    fdwMode = fdwOldMode
-            ^ ENABLE_ECHO_INPUT  /* no input echo */
-            ^ ENABLE_LINE_INPUT; /* return when one or
-                                    more characters are available */
-    SetConsoleMode(hStdin, fdwMode); /* set new mode */
-    FlushConsoleInputBuffer(hStdin); /* clear buffer */
-}
-
-void restore_input_buffering()
-{
-    SetConsoleMode(hStdin, fdwOldMode);
-}
-
-uint16_t check_key()
-{
-    return WaitForSingleObject(hStdin, 1000) == WAIT_OBJECT_0 && _kbhit();
-}
-
-// END INPUT BUFFERING
-
-
-
 
 
 // INTERRUPT HANDLER
-void handle_interrupt(int signal)
+
+// Everything ^C leaves behind but the trace, once run_cli() has returned
+static void exit_interrupted(lc3_vm *vm, const char *profile)
 {
     restore_input_buffering();
+    output_flush(&vm->out);
+    if(profile)
+    {
+        profile_write(vm, profile);
+    }
     printf("\n");
     exit(-2);
 }
 
-
-
-// Extends data with bit_count bits to 16 bits for addition
-uint16_t sign_extend(uint16_t x, int bit_count) 
+void handle_interrupt(int signal)
 {
-	if((x >> (bit_count - 1)) & 1) 
-	{
-		x |= (0xFFFF << bit_count);
-	}
-	return x;
+    // The machine may be in the middle of an output or trace write, so it is
+    // only asked to stop, and a machine waiting for a key stops waiting. A
+    // second ^C gives up on the run without writing anything.
+    if(!cli_interrupted)
+    {
+        cli_interrupted = 1;
+        interrupt_input();
+        return;
+    }
+    restore_input_buffering();
+    _Exit(-2);
 }
 
-
-// Swap from big to little endian
-uint16_t swap16(uint16_t x)
+#ifdef SIGUSR1
+// kill -USR1 prints the machine's stats to stderr and lets it run on. Nothing
+// here is safe to do in a handler, so run_cli() does it at the next slice.
+void handle_stats_request(int signal)
 {
-	return (x << 8) | (x >> 8);
+    cli_stats_requested = 1;
 }
+#endif
 
-
-// Need to update a value's sign when written to a register
-
-void update_flags(uint16_t r) 
+static void print_stats(lc3_vm *vm)
 {
-	if(reg[r] == 0)
-	{
-		reg[R_COND] = FL_ZRO;
-	}
-	else if(reg[r] >> 15)
-	{
-		reg[R_COND] = FL_NEG; // 1 in the leftmost bit means negative
-	}
-	else
-	{
-		reg[R_COND] = FL_POS;
-	}
-	
+	static char text[STATS_TEXT_SIZE];
+	lc3_stats stats;
+	output_flush(&vm->out);
+	vm_get_stats(vm, &stats);
+	stats_format(&stats, text, sizeof(text));
+	fputs(text, stderr);
 }
 
-
-
-
-void read_image_file(FILE *file)
+// Answers the signal handlers' requests, non-zero once ^C was pressed
+static int answer_signals(lc3_vm *vm, void *user)
 {
-	// The origin tells us where in memory to place the image
-	uint16_t origin;
-	fread(&origin, sizeof(origin), 1, file);
-	origin = swap16(origin);
-	
-	// We know the max file size so we only need one fread
-	uint16_t max_read = MEMORY_MAX - origin;
-	uint16_t *p = memory + origin;
-	size_t read = fread(p, sizeof(uint16_t), max_read, file);
-	
-	// Swap to little endian
-	while(read-- > 0)
+	if(cli_stats_requested)
 	{
-		*p = swap16(*p);
-		++p;
+		cli_stats_requested = 0;
+		print_stats(vm);
 	}
+	return cli_interrupted;
 }
 
-
-
-int read_image(const char *image_path)
-{
-	FILE* file = fopen(image_path, "rb");
-	if(!file) { return 0; }
-	read_image_file(file);
-	fclose(file);
-	return 1;
-}
-
-
-
-
-void mem_write(uint16_t address, uint16_t val)
+// vm_run_limited() with the signal handlers' requests answered between
+// slices. A machine blocked reading a key answers SIGUSR1 once it has the
+// key, ^C ends the wait.
+static int run_cli(lc3_vm *vm, const lc3_limits *limits)
 {
-	memory[address] = val;
+	lc3_limits sliced = *limits;
+	sliced.between_slices = answer_signals;
+	int status = vm_run_limited(vm, &sliced);
+	answer_signals(vm, NULL); // in case the last slice was cut short
+	return status;
 }
 
 
 
-uint16_t mem_read(uint16_t address)
+// --vectored-traps: "all" or a comma separated list of vectors (hex as xNN)
+// that go through the trap vector table instead of the built-in handlers
+static int parse_traps(lc3_vm *vm, const char *list)
 {
-	if(address == MR_KBSR)
+	if(strcmp(list, "all") == 0)
 	{
-		if(check_key())
+		for(int vector = 0; vector < 256; vector++)
 		{
-			memory[MR_KBSR] = (1 << 15);
-			memory[MR_KBDR] = getchar();
+			vm_set_trap(vm, (uint8_t)vector, NULL);
 		}
-		else
+		return 1;
+	}
+	while(*list)
+	{
+		const char *digits = *list == 'x' || *list == 'X' ? list + 1 : list;
+		char *end;
+		unsigned long vector = strtoul(digits, &end, digits == list ? 0 : 16);
+		if(end == digits || (*end && *end != ',') || vector > 0xFF)
 		{
-			memory[MR_KBSR] = 0;
+			return 0;
 		}
+		vm_set_trap(vm, (uint8_t)vector, NULL);
+		list = *end ? end + 1 : end;
 	}
-	return memory[address];
+	return 1;
 }
 
 
 
-
-
-
-
-
-
 int main(int argc, const char **argv) {
 	
 	
-	signal(SIGINT, handle_interrupt);
-	disable_input_buffering();
-	
-	// LOAD ARGUMENTS
-	
-	if(argc < 2)
+	lc3_vm *vm = vm_create(NULL);
+	if(!vm)
 	{
-		// show usage string
-		printf("LC3 [image-file1] ...\n");
-		exit(2);
+		printf("Out of memory\n");
+		exit(1);
 	}
 	
-	for(int j = 1; j < argc; j++) 
-	{
-		if(!read_image(argv[j])) 
-		{
-			printf("Failed to load image: %s\n", argv[j]);
-			exit(1);
-		}
-	}
-	
-	// SETUP
-	
-	// One condition flag must be set at any given time, so initialize with the Z (zero) flag
-	reg[R_COND] = FL_ZRO;
+	// LOAD ARGUMENTS
 	
-	// Set PC to starting position, 0x3000 is start
-	enum { PC_START = 0x3000 };
-	reg[R_PC] = PC_START;
+	int images = 0;
+	const char *manifest = NULL;
+	int threads = 0;
+	lc3_limits limits = { 0, 0, NULL, NULL };
+	const char *save_snapshot = NULL;
+	const char *profile = NULL;
+	const char *trace = NULL;
+	const char *record = NULL;
+	const char *replay = NULL;
+	int headless = 0;
+	int paged_memory = 0;
+	int diff_engine = -1;
+	uint64_t diff_interval = DIFF_INTERVAL;
+	int analyze = 0;			// 2 with --analysis-cache
+	int stats = 0;
+	char *fan_out = NULL;		// --fan-out list, split in place into fan_out_inputs
+	const char **fan_out_inputs = NULL;
+	int fan_out_count = 0;
+	const char *first_image = NULL;
 	
-	int running = 1;
-	while(running) 
+	for(int j = 1; j < argc; j++) 
 	{
-		// FETCH
-		uint16_t instr = mem_read(reg[R_PC]++);
-		uint16_t op = instr >> 12;
-		
-		switch(op) 
+		if(strcmp(argv[j], "--engine") == 0 && j + 1 < argc)
 		{
-			case OP_ADD: 
-			{	
-				// Destination register
-				uint16_t r0 = (instr >> 9) & 0x7;
-				// first operand SR1
-				uint16_t r1 = (instr >> 6) & 0x7;
-				// grab bit 5 to check for imm mode
-				uint16_t imm_flag = (instr >> 5) & 0x1;
-				
-				if(imm_flag)
-				{
-					uint16_t imm5 = sign_extend(instr & 0x1F, 5);
-					reg[r0] = reg[r1] + imm5;
-				}
-				else
-				{
-					uint16_t r2 = instr & 0x7;
-					reg[r0] = reg[r1] + reg[r2];
-				}
-				update_flags(r0);
-				break;
-			}
-			case OP_AND:
-			{
-				// Destination register
-				uint16_t r0 = (instr >> 9) & 0x7;
-				// first operand SR1
-				uint16_t r1 = (instr >> 6) & 0x7;
-				// check if in immediate mode
-				uint16_t imm_flag = (instr >> 5) & 0x1;
-				
-				if(imm_flag)
-				{
-					uint16_t imm5 = sign_extend(instr & 0x1F, 5);
-					reg[r0] = reg[r1] & imm5;
-				}
-				else
-				{
-					uint16_t r2 = instr & 0x7;
-					reg[r0] = reg[r1] & reg[r2];
-				}
-				update_flags(r0);
-				break;
-			}
-			case OP_NOT: 
+			int engine = parse_engine(argv[++j]);
+			if(engine < 0)
 			{
-			
-				// Destination register
-				uint16_t r0 = (instr >> 9) & 0x7;
-				// Source register
-				uint16_t r1 = (instr >> 6) & 0x7;
-				reg[r0] = ~reg[r1];
-				break;
+				printf("Unknown engine: %s\n", argv[j]);
+				exit(2);
 			}
-			case OP_BR:
-			{
-				// Get condicion flag (negative, zero, or positive)
-				uint16_t cond_flag = (instr >> 9) & 0x7;
-				// Get pc offset 
-				uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
-				
-				if(cond_flag & reg[R_COND])
-				{
-					reg[R_PC] += pc_offset;
-				}
-				break;
-			}
-			case OP_JMP:
-			{
-				// Get register to JMP to (RET occurs when r1 == 0x7)
-				uint16_t r1 = (instr >> 6) & 0x7;
-				reg[R_PC] = reg[r1];
-				break;
-			}
-			case OP_JSR:
-			{
-				// PC is saved in R7
-				reg[R_R7] = reg[R_PC];
-				uint16_t long_flag = (instr >> 11) & 0x1;
-				if(long_flag) // JSR
-				{
-					uint16_t pc_offset = sign_extend(instr & 0x7FF, 11);
-					reg[R_PC] += pc_offset;
-				}
-				else // JSRR
-				{
-					uint16_t r1 = (instr >> 6) & 0x7;
-					reg[R_PC] = reg[r1];
-				}
-				break;
-			}
-			case OP_LD:
-			{
-				// Destination register
-				uint16_t r0 = (instr >> 9) & 0x7;
-				// PC offset
-				uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
-				reg[r0] = mem_read(reg[R_PC] + pc_offset);
-				update_flags(r0);
-				break;
-			}
-			case OP_LDI:
+			vm_set_engine(vm, engine);
+			continue;
+		}
+		if(strcmp(argv[j], "--diff-engines") == 0 && j + 1 < argc)
+		{
+			diff_engine = parse_engine(argv[++j]);
+			if(diff_engine < 0)
 			{
-				// Destination register
-				uint16_t r0 = (instr >> 9) & 0x7;
-				// PC offset 9
-				uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
-				// add PC offset to to current PC, and read that memory address to get the final address
-				reg[r0] = mem_read(reg[R_PC] + pc_offset);
-				update_flags(r0);
-				break;
+				printf("Unknown engine: %s\n", argv[j]);
+				exit(2);
 			}
-			case OP_LDR:
+			continue;
+		}
+		if(strcmp(argv[j], "--diff-interval") == 0 && j + 1 < argc)
+		{
+			diff_interval = strtoull(argv[++j], NULL, 0);
+			continue;
+		}
+		if(strcmp(argv[j], "--analyze") == 0)
+		{
+			analyze = 1;
+			continue;
+		}
+		if(strcmp(argv[j], "--analysis-cache") == 0)
+		{
+			analyze = 2;
+			continue;
+		}
+		if(strcmp(argv[j], "--fan-out") == 0 && j + 1 < argc)
+		{
+			free(fan_out);
+			free(fan_out_inputs);
+			fan_out = malloc(strlen(argv[++j]) + 1);
+			fan_out_count = 1;
+			for(const char *c = argv[j]; *c; c++)
 			{
-				// Get destination register
-				uint16_t r0 = (instr >> 9) & 0x7;
-				// Get base register
-				uint16_t r1 = (instr >> 6) & 0x7;
-				// PC offset
-				uint16_t pc_offset = sign_extend(instr & 0x3F, 6);
-				reg[r0] = mem_read(reg[r1] + pc_offset);
-				update_flags(r0);
-				break;
+				fan_out_count += *c == ',';
 			}
-			case OP_LEA:
+			fan_out_inputs = malloc(fan_out_count * sizeof(*fan_out_inputs));
+			if(!fan_out || !fan_out_inputs)
 			{
-				// Destination register
-				uint16_t r0 = (instr >> 9) & 0x7;
-				// PC offset
-				uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
-				reg[r0] = reg[R_PC] + pc_offset;
-				update_flags(r0);
-				break;
+				printf("Out of memory\n");
+				exit(1);
 			}
-			case OP_ST:
+			strcpy(fan_out, argv[j]);
+			char *input = fan_out;
+			for(int i = 0; i < fan_out_count; i++)
 			{
-				// Source register
-				uint16_t r0 = (instr >> 9) & 0x7;
-				// PC offset
-				uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
-				mem_write(reg[R_PC] + pc_offset, reg[r0]);
-				break;
+				fan_out_inputs[i] = input;
+				input += strcspn(input, ",");
+				*input++ = '\0';
 			}
-			case OP_STI:
+			continue;
+		}
+		if(strcmp(argv[j], "--stats") == 0)
+		{
+			stats = 1;
+			continue;
+		}
+		if(strcmp(argv[j], "--unbuffered") == 0)
+		{
+			output_set_unbuffered(&vm->out, 1);
+			continue;
+		}
+		if(strcmp(argv[j], "--headless") == 0)
+		{
+			headless = 1;
+			continue;
+		}
+		if(strcmp(argv[j], "--paged-memory") == 0)
+		{
+			// Before any image, so loading only allocates the pages it touches
+			if(!paged_memory && !vm_set_paged_memory(vm))
 			{
-				// Source register
-				uint16_t r0 = (instr >> 9) & 0x7;
-				// PC offset
-				uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
-				mem_write(mem_read(reg[R_PC] + pc_offset), reg[r0]);
-				break;
+				printf("Out of memory\n");
+				exit(1);
 			}
-			case OP_STR:
+			paged_memory = 1;
+			continue;
+		}
+		if(strcmp(argv[j], "--vectored-traps") == 0 && j + 1 < argc)
+		{
+			if(!parse_traps(vm, argv[++j]))
 			{
-				// Source register
-				uint16_t r0 = (instr >> 9) & 0x7;
-				uint16_t r1 = (instr >> 6) & 0x7;
-				uint16_t pc_offset = sign_extend(instr & 0x3F, 6);
-				mem_write(reg[r1] + pc_offset, reg[r0]);
-				break;
+				printf("Bad trap list: %s\n", argv[j]);
+				exit(2);
 			}
-			case OP_TRAP:
+			continue;
+		}
+		if(strcmp(argv[j], "--batch") == 0 && j + 1 < argc)
+		{
+			manifest = argv[++j];
+			continue;
+		}
+		if(strcmp(argv[j], "--threads") == 0 && j + 1 < argc)
+		{
+			threads = atoi(argv[++j]);
+			continue;
+		}
+		if(strcmp(argv[j], "--max-instructions") == 0 && j + 1 < argc)
+		{
+			limits.max_instructions = strtoull(argv[++j], NULL, 0);
+			continue;
+		}
+		if(strcmp(argv[j], "--timeout") == 0 && j + 1 < argc)
+		{
+			limits.timeout = atof(argv[++j]);
+			continue;
+		}
+		if(strcmp(argv[j], "--profile") == 0 && j + 1 < argc)
+		{
+			profile = argv[++j];
+			continue;
+		}
+		if(strcmp(argv[j], "--trace") == 0 && j + 1 < argc)
+		{
+			trace = argv[++j];
+			continue;
+		}
+		if(strcmp(argv[j], "--record") == 0 && j + 1 < argc)
+		{
+			record = argv[++j];
+			continue;
+		}
+		if(strcmp(argv[j], "--replay") == 0 && j + 1 < argc)
+		{
+			replay = argv[++j];
+			continue;
+		}
+		if(strcmp(argv[j], "--save-snapshot") == 0 && j + 1 < argc)
+		{
+			save_snapshot = argv[++j];
+			continue;
+		}
+		if(strcmp(argv[j], "--load-snapshot") == 0 && j + 1 < argc)
+		{
+			// Replaces everything loaded so far, images after it still go on top
+			if(!vm_load_snapshot(vm, argv[++j]))
 			{
-				reg[R_R7] = reg[R_PC];
-				switch(instr & 0xFF)
-				{
-					case TRAP_GETC:
-					{
-						reg[R_R0] = (uint16_t)getchar();
-						update_flags(R_R0);
-						break;
-					}
-					case TRAP_OUT:
-					{
-						putc((char)reg[R_R0], stdout);
-						fflush(stdout);
-						break;
-					}
-					case TRAP_PUTS:
-					{
-						// One char per word
-						uint16_t *c = memory + reg[R_R0];
-						while(*c)
-						{
-							putc((char)*c, stdout);
-							++c;	
-						}
-						fflush(stdout);
-						break;
-					}
-					case TRAP_IN:
-					{
-						printf("Enter a character:");
-						char c = getchar();
-						putc(c, stdout);
-						fflush(stdout);
-						reg[R_R0] = (uint16_t)c;
-						update_flags(R_R0);
-						break;
-					}
-					case TRAP_PUTSP:
-					{
-						uint16_t *c = memory + reg[R_R0];
-						while(*c)
-						{
-							char char1 = (*c) & 0xFF;
-							putc(char1, stdout);
-							char char2 = (*c) >> 8;
-							if(char2)
-							{
-								putc(char2, stdout);
-							}
-							++c;
-						}
-						fflush(stdout);
-						break;
-					}
-					case TRAP_HALT:
-					{
-						puts("HALT");
-						fflush(stdout);
-						running = 0;
-						break;
-					}
-				}
-				break;
+				printf("Failed to load snapshot: %s\n", argv[j]);
+				exit(1);
 			}
-			case OP_RES:
-			case OP_RTI:
-			default:
-				abort();
-				break;
+			images++;
+			continue;
+		}
+		
+		if(!vm_load_image(vm, argv[j])) 
+		{
+			printf("Failed to load image: %s\n", argv[j]);
+			exit(1);
+		}
+		if(!first_image)
+		{
+			first_image = argv[j];
 		}
+		images++;
+	}
+	
+	if((images == 0) == (manifest == NULL) || (record && replay) || diff_interval == 0)
+	{
+		// show usage string
+		printf("LC3 [options] [--load-snapshot file] [image-file1] ...\n");
+		printf("LC3 [options] [--threads N] --batch manifest-file\n");
+		printf("LC3 [options] --diff-engines threaded|cached|jit [--diff-interval N] [image-file1] ...\n");
+		printf("LC3 [options] --fan-out input1,input2,... [image-file1] ... (a clone per input from the first key read)\n");
+		printf("options: [--engine switch|threaded|cached|jit] [--unbuffered] [--headless] [--paged-memory]\n");
+		printf("         [--max-instructions N] [--timeout seconds] [--save-snapshot file]\n");
+		printf("         [--profile prefix] (writes prefix.txt and prefix.folded)\n");
+		printf("         [--trace file] (every instruction, tools/lc3trace prints it)\n");
+		printf("         [--record input-log | --replay input-log]\n");
+		printf("         [--analyze | --analysis-cache] (kept in image-file1.analysis)\n");
+		printf("         [--vectored-traps all|x20,x25,...] (through the trap vector table)\n");
+		printf("         [--stats] (to stderr on exit, kill -USR1 shows them while running)\n");
+		exit(2);
+	}
+	
+	if(manifest)
+	{
+		// Jobs get their own consoles, the terminal is left alone
+		int failed = run_batch(manifest, vm->engine, paged_memory, vm->traps, threads, &limits);
+		vm_destroy(vm);
+		exit(failed == 0 ? 0 : 1);
+	}
+	
+	if(diff_engine >= 0)
+	{
+		// Both machines get stdin read up front and their own consoles, like batch jobs
+		int diverged = run_diff(vm, diff_engine, diff_interval, &limits);
+		vm_destroy(vm);
+		exit(diverged == 0 ? 0 : diverged > 0 ? EXIT_DIVERGED : 1);
+	}
+	
+	if(fan_out)
+	{
+		// The clones get their own consoles, the terminal only sees the report
+		int failed = run_fan_out(vm, fan_out_inputs, fan_out_count, &limits);
+		vm_destroy(vm);
+		free(fan_out_inputs);
+		free(fan_out);
+		exit(failed == 0 ? 0 : 1);
+	}
+	
+	// RUN
+	
+	if(analyze)
+	{
+		char cache[1024];
+		int cached = analyze == 2 && first_image && snprintf(cache, sizeof(cache), "%s.analysis", first_image) < (int)sizeof(cache);
+		if(!vm_analyze(vm, cached ? cache : NULL))
+		{
+			printf("Out of memory\n");
+			exit(1);
+		}
+	}
+	
+	// Started after loading so the call tree is rooted at the entry point
+	if(profile && !profile_enable(vm))
+	{
+		printf("Out of memory\n");
+		exit(1);
+	}
+	if(trace && !vm_trace_start(vm, trace))
+	{
+		printf("Failed to create trace: %s\n", trace);
+		exit(1);
+	}
+	
+	if(headless)
+	{
+		// All of a redirected stdin is read now, a terminal isn't read at all
+		size_t size = 0;
+		char *input = stdin_is_terminal() ? malloc(1) : read_all_input(&size);
+		if(!input || !vm_buffer_input(vm, input, size))
+		{
+			printf("Failed to read input\n");
+			exit(1);
+		}
+	}
+	if(record && !vm_record_input(vm, record))
+	{
+		printf("Failed to create input log: %s\n", record);
+		exit(1);
+	}
+	if(replay && !vm_replay_input(vm, replay))
+	{
+		printf("Failed to read input log: %s\n", replay);
+		exit(1);
+	}
+	
+	// Nobody sees prompts before typing when the input was prepared up front
+	vm_set_interactive(vm, !replay && !headless && stdin_is_terminal());
+	
+	signal(SIGINT, handle_interrupt);
+#ifdef SIGUSR1
+	signal(SIGUSR1, handle_stats_request);
+#endif
+	if(stats)
+	{
+		vm_enable_perf_counters(vm); // cycles and branch misses too where the kernel allows it
+	}
+	if(!replay && !headless)
+	{
+		disable_input_buffering(); // headless runs and replays take no keys from the terminal
+	}
+	
+	// vm_create() already set the flags and PC_START, just keep going until it stops
+	int status = run_cli(vm, &limits);
+	if(cli_interrupted)
+	{
+		if(trace && !vm_trace_stop(vm))
+		{
+			printf("Failed to write trace: %s\n", trace);
+		}
+		exit_interrupted(vm, profile);
 	}
 	
 	// SHUTDOWN
 	
+	if(profile && !profile_write(vm, profile))
+	{
+		printf("Failed to write profile: %s\n", profile);
+	}
+	if(trace && !vm_trace_stop(vm))
+	{
+		printf("Failed to write trace: %s\n", trace);
+	}
+	
+	if(stats)
+	{
+		print_stats(vm);
+	}
 	
+	if(status == VM_ILLEGAL)
+	{
+		output_flush(&vm->out);
+		abort(); // RTI in user mode or the reserved opcode, and no exception handler to take it
+	}
+	
+	// Taken wherever the machine stopped, so a limit can end a boot sequence early
+	if(save_snapshot && !vm_save_snapshot(vm, save_snapshot))
+	{
+		restore_input_buffering();
+		printf("Failed to save snapshot: %s\n", save_snapshot);
+		exit(1);
+	}
+	if(status == VM_LIMIT || status == VM_TIMEOUT)
+	{
+		char state[VM_STATE_SIZE];
+		vm_format_state(vm, state);
+		output_flush(&vm->out);
+		restore_input_buffering();
+		fprintf(stderr, "\n%s: %s\n", status == VM_LIMIT ? "Instruction limit reached" : "Timed out", state);
+		exit(status == VM_LIMIT ? EXIT_INSTRUCTION_LIMIT : EXIT_TIMEOUT);
+	}
+	vm_destroy(vm);
+	restore_input_buffering();
 }
 
 
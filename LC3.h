@@ -0,0 +1,544 @@
+/*
+
+LC3.h
+
+Machine definitions shared by every part of the LC-3 VM
+
+*/
+
+#ifndef LC3_H
+#define LC3_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "Output.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MEMORY_MAX (1 << 16) // 16-bit registers, 2^16 memory locations 
+
+// Memory is reached through a table of 256-word pages
+#define MEMORY_PAGE_SHIFT 8
+#define MEMORY_PAGE_SIZE (1 << MEMORY_PAGE_SHIFT)
+#define MEMORY_PAGE_MASK (MEMORY_PAGE_SIZE - 1)
+#define MEMORY_PAGES (MEMORY_MAX >> MEMORY_PAGE_SHIFT)
+
+
+
+// MEMORY MAPPED REGISTERS
+
+enum
+{
+	MR_KBSR = 0xFE00,	// keyboard status
+	MR_KBDR = 0xFE02,	// keyboard data 
+	MR_DSR = 0xFE04,	// display status
+	MR_DDR = 0xFE06		// display data
+};
+
+// KBSR bits
+enum
+{
+	KBSR_IE = 1 << 14,		// interrupt enable, written by the program
+	KBSR_READY = 1 << 15	// a key is waiting in KBDR, until KBDR is read
+};
+
+
+
+
+// TRAP OPCODES
+
+
+enum 
+{
+	TRAP_GETC = 0x20,	// get char from keyboard, not echoed to terminal
+	TRAP_OUT = 0x21,	// output a char
+	TRAP_PUTS = 0x22,	// output a string
+	TRAP_IN = 0x23,		// get char from keyboard and echo to terminal
+	TRAP_PUTSP = 0x24,	// output a byte string
+	TRAP_HALT = 0x25	// halt the program
+	
+};
+
+// Trap vector table, a vector's entry holds the address of its handler
+enum { TRAP_TABLE = 0x0000 };
+
+
+
+// PROCESSOR STATUS
+
+// PSR bits besides the condition codes
+enum
+{
+	PSR_PRIORITY = 0x7 << 8,	// priority level
+	PSR_USER = 1 << 15			// user mode, clear in supervisor mode
+};
+
+// Supervisor stack pointer a machine starts with, the stack grows down from here
+enum { SUPERVISOR_STACK = 0x3000 };
+
+
+
+// INTERRUPTS
+
+// Interrupt vector table, exceptions and interrupts share it like in the hardware
+enum { INTERRUPT_TABLE = 0x0100 };
+
+enum
+{
+	EXCEPTION_PRIVILEGE = 0x00,	// RTI in user mode
+	EXCEPTION_ILLEGAL = 0x01,	// the reserved opcode
+	INTERRUPT_KEYBOARD = 0x80	// a key is ready with KBSR_IE set
+};
+
+enum { KEYBOARD_PRIORITY = 4 };
+
+// Interrupts are only looked for once every this many instructions, counted
+// over the machine's lifetime so every engine takes them at the same point
+#define VM_INTERRUPT_SLICE 1024
+
+
+
+// REGISTERS
+
+
+enum 
+{
+	
+	R_R0 = 0,
+	R_R1,
+	R_R2,
+	R_R3,
+	R_R4,
+	R_R5,
+	R_R6,
+	R_R7,
+	R_PC, // Program counter, holds address of next instruction in memory to execute
+	R_COND,
+	R_COUNT
+		
+};
+
+
+
+
+// CONDITION FLAGS
+
+enum 
+{
+	
+	FL_POS = 1 << 0, // P
+	FL_ZRO = 1 << 1, // Z
+	FL_NEG = 1 << 2, // N
+};
+
+
+
+// INSTRUCTION SET -- OPCODES
+
+enum 
+{
+	
+	OP_BR = 0,	// branch
+	OP_ADD,		// add
+	OP_LD,		// load
+	OP_ST,		// store
+	OP_JSR,		// jump register
+	OP_AND,		// bitwise and
+	OP_LDR,		// load register
+	OP_STR,		// store register
+	OP_RTI,		// return from trap or interrupt
+	OP_NOT,		// bitwise not
+	OP_LDI,		// load indirect
+	OP_STI,		// store indirect
+	OP_JMP,		// jump
+	OP_RES,		// reserved (unused)
+	OP_LEA,		// load effective address
+	OP_TRAP		// execute trap
+	
+};
+
+
+
+// Extends data with bit_count bits to 16 bits for addition
+static inline uint16_t sign_extend(uint16_t x, int bit_count) 
+{
+	if((x >> (bit_count - 1)) & 1) 
+	{
+		x |= (0xFFFF << bit_count);
+	}
+	return x;
+}
+
+
+
+// FL_* bits for a value written to a register: 1 + 1 when zero + 3 when negative
+static inline uint16_t cond_flags(uint16_t value)
+{
+	return (uint16_t)(FL_POS + (value == 0) + 3 * (value >> 15));
+}
+
+// A register value that produces the given FL_* bits, inverse of cond_flags()
+static inline uint16_t cond_value(uint16_t flags)
+{
+	return flags & FL_NEG ? 0x8000 : flags & FL_ZRO ? 0 : 1;
+}
+
+
+
+// ENGINES
+
+enum
+{
+	ENGINE_SWITCH = 0,	// portable switch(op) loop
+	ENGINE_THREADED,	// computed goto, falls back to ENGINE_SWITCH where unsupported
+	ENGINE_CACHED,		// pre-decoded instruction cache
+	ENGINE_JIT,			// cached engine plus native x86-64 code for hot blocks
+	ENGINE_COUNT
+};
+
+// Maps an engine name ("switch", "threaded", "cached", "jit") to ENGINE_*, -1 if unknown
+int parse_engine(const char *name);
+
+// The name parse_engine() takes for an ENGINE_*
+const char *engine_name(int engine);
+
+
+
+// VIRTUAL MACHINE
+
+// Set PC to starting position, 0x3000 is start
+enum { PC_START = 0x3000 };
+
+// Why vm_run() returned
+enum
+{
+	VM_RUNNING = 0,	// step budget used up, vm_run() can pick up where it left off
+	VM_HALTED,		// TRAP_HALT
+	VM_ILLEGAL,		// RTI in user mode or the reserved opcode, without an exception handler
+	VM_LIMIT,		// vm_run_limited() used up max_instructions
+	VM_TIMEOUT,		// vm_run_limited() ran out of time
+	VM_BREAK		// vm_run_until() met one of its conditions
+};
+
+// Conditions for vm_run_until(), any combination of VM_UNTIL_*
+enum
+{
+	VM_UNTIL_PC = 1 << 0,			// about to run the instruction at pc
+	VM_UNTIL_INSTRUCTIONS = 1 << 1,	// the machine has retired instructions in total
+	VM_UNTIL_TRAP = 1 << 2,			// a TRAP to vector trap just ran, -1 for any vector
+	VM_UNTIL_INPUT = 1 << 3,		// about to run a TRAP to GETC or IN
+	VM_UNTIL_CHECK_FIRST = 1 << 4	// VM_UNTIL_PC and VM_UNTIL_INPUT apply to the first instruction too
+};
+
+typedef struct
+{
+	int conditions;
+	uint16_t pc;
+	uint64_t instructions;
+	int trap;
+} lc3_until;
+
+// Running totals behind vm_get_stats() (Stats.h), kept up a vm_run() or a
+// TRAP at a time so no loop counts anything per instruction
+typedef struct
+{
+	uint64_t traps[256];		// by vector
+	uint64_t key_reads;
+	double key_wait_seconds;	// blocked in the console's read_key
+	double run_seconds;			// inside timed vm_run() calls that have returned
+	double run_start;			// monotonic_seconds() when the current timed vm_run() started, 0 otherwise
+	uint64_t timed_instructions;	// retired in the calls run_seconds covers
+	uint64_t run_start_instructions;	// vm->instructions when the current timed vm_run() started
+} lc3_counters;
+
+// Where a machine's console goes, every callback gets user back
+typedef struct
+{
+	void *user;
+	int (*check_key)(void *user);		// never blocks, non-zero when a key is waiting
+	uint16_t (*read_key)(void *user);	// blocks, EOF (as a 16-bit word) once input is closed
+	void (*write)(void *user, const char *bytes, size_t count);
+	void (*close)(void *user);			// optional, from vm_destroy()
+} lc3_io;
+
+struct decoded;
+struct jit_state;
+struct lc3_analysis;
+struct lc3_image;
+struct lc3_perf;
+struct lc3_profile;
+struct lc3_shared_pages;
+struct lc3_trace;
+struct lc3_vm;
+
+// Host code standing in for an LC-3 trap handler. It runs in the middle of
+// vm_run() with PC already past the TRAP and R7 holding it, see vm_set_trap().
+typedef void (*lc3_trap_fn)(struct lc3_vm *vm);
+
+// Limits for vm_run_limited(), 0 for none
+typedef struct
+{
+	uint64_t max_instructions;
+	double timeout;		// wall-clock seconds
+	
+	// Optional, called between VM_LIMIT_SLICE runs while the machine runs on.
+	// Non-zero ends vm_run_limited() there, returning VM_RUNNING.
+	int (*between_slices)(struct lc3_vm *vm, void *user);
+	void *user;
+} lc3_limits;
+
+// One LC-3 machine. Nothing in here is shared, so any number of them can run
+// side by side as long as each one is only used by one thread at a time.
+typedef struct lc3_vm
+{
+	// A flat machine has all its pages in one block. A paged machine starts
+	// with every page on a shared zero page and gets its own copy of a page
+	// the first time it writes there, see memory_poke().
+	const uint16_t *pages[MEMORY_PAGES];	// every page, for reading
+	uint16_t *write_pages[MEMORY_PAGES];	// NULL while a page is shared
+	uint16_t *flat;							// the block of a flat machine, NULL when paged
+	struct lc3_shared_pages *shared;		// pages shared with clones, see vm_clone()
+	
+	uint16_t reg[R_COUNT];			// Array that holds our registers
+	
+	// Lazy condition codes: instructions that set the flags only record the
+	// value they wrote, see update_flags() in Operations.c. reg[R_COND] is
+	// exact whenever vm_run() is not running.
+	uint16_t cond_result;
+	
+	uint16_t psr;		// PSR_* bits, the condition codes are in reg[R_COND]
+	uint16_t saved_sp;	// R6 of the other mode: the supervisor stack pointer in user mode and the other way round
+	
+	// Interrupts cost nothing while no device can raise one. Otherwise
+	// vm_run() stops the engine every VM_INTERRUPT_SLICE instructions and
+	// delivers the most urgent request whose priority beats the PSR's.
+	int interrupts;				// non-zero while a device may be requesting an interrupt
+	uint8_t irq_pending;		// bit per priority level, from vm_raise_interrupt()
+	uint8_t irq_vectors[8];		// by priority level
+	
+	int engine;
+	int status;				// VM_* for the last vm_run()
+	uint64_t steps;			// instructions left in the current vm_run()
+	uint64_t run_steps;		// n_steps of the current vm_run()
+	uint64_t stop_steps;	// steps when vm_stop() was called
+	uint64_t instructions;	// retired over the machine's lifetime
+	
+	struct decoded *icache;			// cached/jit engines, allocated on first use
+	int icache_jit;					// icache entries were decoded for the JIT tier
+	struct jit_state *jit;			// jit engine only
+	uint8_t jit_pages[MEMORY_MAX >> 8];	// pages holding the source of translated code
+	struct lc3_profile *profile;	// see Profile.h, NULL unless profiling
+	struct lc3_trace *trace;		// see Trace.h, NULL unless tracing
+	struct lc3_analysis *analysis;	// see Analysis.h, NULL unless vm_analyze() was called
+	uint64_t image_hash;			// memory_hash_words() of every image loaded, in order
+	lc3_counters counters;
+	struct lc3_perf *perf;			// see Stats.h, NULL unless vm_enable_perf_counters() was called
+	
+	lc3_trap_fn traps[256];			// by vector, NULL goes through the trap vector table
+	
+	lc3_io io;
+	lc3_output out;
+	int interactive;	// see vm_set_interactive()
+	lc3_until until;	// of the vm_run_until() in progress, conditions 0 otherwise
+} lc3_vm;
+
+// Makes a machine ready to run from PC_START, io NULL means the process console
+lc3_vm *vm_create(const lc3_io *io);
+void vm_destroy(lc3_vm *vm);
+
+// A new machine in the state vm is in now, talking to io (NULL for the
+// process console). vm must not be running. Both go on with the same memory
+// copy-on-write, a page at a time, so cloning costs nothing like a reload and
+// parent and clones can then run on threads of their own. vm moves to paged
+// memory if it wasn't already, and what it printed so far is written out
+// first. Profiling, analysis and hardware counters aren't carried over.
+// Returns NULL if out of memory.
+lc3_vm *vm_clone(lc3_vm *vm, const lc3_io *io);
+
+// Serves keys from input[0..size) and then EOF instead of asking the
+// machine's console, which still takes the output. The machine frees input,
+// which must come from malloc(). Returns 0 (input freed) if out of memory.
+int vm_buffer_input(lc3_vm *vm, char *input, size_t size);
+
+// Moves the machine to the paged memory backend, keeping what is already in
+// memory. Returns 0 (the machine stays flat) if out of memory.
+int vm_set_paged_memory(lc3_vm *vm);
+
+// Non-zero (the default) when someone may be typing the input: output is
+// written out every time the machine asks for a key, so prompts show before
+// it waits. With input prepared in advance that only costs a write per key.
+void vm_set_interactive(lc3_vm *vm, int interactive);
+
+// Selects the ENGINE_* used by vm_run(), ENGINE_CACHED by default
+void vm_set_engine(lc3_vm *vm, int engine);
+
+// Picks how a TRAP to vector runs. A native handler runs on the host, NULL runs
+// the LC-3 code the trap vector table points to the way the hardware does:
+// the PSR and the return address go on the supervisor stack, and the
+// handler ends with RTI. A vector whose table entry is still zero falls back
+// to the built-in handler, so programs keep working without an OS loaded.
+// Machines start with the built-in handlers for GETC, OUT, PUTS, IN, PUTSP
+// and HALT and every other vector going through the table.
+void vm_set_trap(lc3_vm *vm, uint8_t vector, lc3_trap_fn handler);
+
+// The built-in handler for vector, NULL for vectors without one
+lc3_trap_fn vm_builtin_trap(uint8_t vector);
+
+// Sets the condition codes from a value, for trap handlers
+void vm_set_cc(lc3_vm *vm, uint16_t value);
+
+// Requests the interrupt at vector with priority 0-7 for a device that
+// isn't on the device page. It stays pending until taken, one per priority
+// level. The keyboard interrupts on its own once the program sets KBSR_IE.
+void vm_raise_interrupt(lc3_vm *vm, uint8_t vector, int priority);
+
+// For devices: makes sure the current vm_run() looks for interrupts at the
+// next VM_INTERRUPT_SLICE boundary
+void vm_check_interrupts(lc3_vm *vm);
+
+// Loads an image file into the machine's memory, returns 0 if it can't be read
+int vm_load_image(lc3_vm *vm, const char *image_path);
+
+// Loads a shared image (see ReadImage.h). A paged machine maps the image's
+// pages instead of copying them, so the image must outlive the machine.
+void vm_install_image(lc3_vm *vm, const struct lc3_image *image);
+
+// Runs at most n_steps instructions and returns VM_*. reg[R_COND] is only
+// kept up to date on entry and return.
+int vm_run(lc3_vm *vm, uint64_t n_steps);
+
+// Only vm_run() calls of this many steps or more read the clock for the
+// stats' run_seconds, a vm_step() isn't worth two clock reads
+#define VM_TIMED_STEPS 4096
+
+// Runs until the machine stops or a limit is reached and returns VM_*, never
+// VM_RUNNING unless between_slices asked to stop. The clock is only read
+// every VM_LIMIT_SLICE instructions, and time spent blocked waiting for a
+// key counts but can't be cut short.
+int vm_run_limited(lc3_vm *vm, const lc3_limits *limits);
+
+#define VM_LIMIT_SLICE (1 << 20)
+
+// Runs a single instruction and returns VM_*
+int vm_step(lc3_vm *vm);
+
+// Runs until one of the conditions is met (VM_BREAK) or the machine stops by
+// itself, never VM_RUNNING. Unless the instruction count is already there at
+// least one instruction runs, so a machine sitting at until->pc moves on.
+// With VM_UNTIL_CHECK_FIRST it doesn't, for carrying on with a run that was
+// cut short. A VM_UNTIL_PC or VM_UNTIL_INPUT run checks before every
+// instruction and so uses the switch loop whatever the engine.
+int vm_run_until(lc3_vm *vm, const lc3_until *until);
+
+// Describes the registers and instruction count on one line, for when a
+// machine is stopped early. buffer needs room for VM_STATE_SIZE chars.
+void vm_format_state(const lc3_vm *vm, char *buffer);
+
+#define VM_STATE_SIZE 160
+
+// Ends the current vm_run() after the instruction being executed
+static inline void vm_stop(lc3_vm *vm, int status)
+{
+	vm->status = status;
+	vm->stop_steps = vm->steps;
+	vm->steps = 0;
+}
+
+// Instructions retired so far including the one being executed, also in the
+// middle of vm_run(). Engines keep this exact at every point that can touch a
+// device or the console.
+static inline uint64_t vm_instruction_count(const lc3_vm *vm)
+{
+	return vm->instructions + (vm->run_steps - vm->steps);
+}
+
+// Registers by R_*, between runs. R_COND holds one FL_* bit.
+uint16_t vm_get_reg(const lc3_vm *vm, int reg);
+void vm_set_reg(lc3_vm *vm, int reg, uint16_t value);
+
+// The whole PSR, condition codes included
+uint16_t vm_get_psr(const lc3_vm *vm);
+
+// Memory without going through the devices. Writes also drop whatever the
+// engines decoded from the word.
+uint16_t vm_read_memory(const lc3_vm *vm, uint16_t address);
+void vm_write_memory(lc3_vm *vm, uint16_t address, uint16_t value);
+
+// Console input for the machine. On an interactive machine both write out
+// pending output first.
+int vm_check_key(lc3_vm *vm);
+uint16_t vm_read_key(lc3_vm *vm);
+
+
+
+// MEMORY (Memory.c)
+
+// Plain RAM access, no devices and no invalidation of decoded code. Writing
+// to a shared page first gives the machine its own copy of it.
+
+uint16_t *memory_fault(lc3_vm *vm, unsigned page);
+
+static inline uint16_t memory_peek(const lc3_vm *vm, uint16_t address)
+{
+	return vm->pages[address >> MEMORY_PAGE_SHIFT][address & MEMORY_PAGE_MASK];
+}
+
+static inline void memory_poke(lc3_vm *vm, uint16_t address, uint16_t val)
+{
+	uint16_t *page = vm->write_pages[address >> MEMORY_PAGE_SHIFT];
+	if(!page)
+	{
+		page = memory_fault(vm, address >> MEMORY_PAGE_SHIFT);
+	}
+	page[address & MEMORY_PAGE_MASK] = val;
+}
+
+// Sets up all-zero flat memory, returns 0 if out of memory
+int memory_init(lc3_vm *vm);
+void memory_release(lc3_vm *vm);
+
+// See vm_set_paged_memory()
+int memory_set_paged(lc3_vm *vm);
+
+// Zeroes all of memory, a paged machine drops every page it owns
+void memory_clear(lc3_vm *vm);
+
+// Moves vm to paged memory and gives clone, a new machine, the same pages
+// copy-on-write for both, see vm_clone(). Returns 0 if out of memory.
+int memory_clone(lc3_vm *clone, lc3_vm *vm);
+
+// Copies count words to address, address + count must not pass MEMORY_MAX
+void memory_store(lc3_vm *vm, uint16_t address, const uint16_t *words, size_t count);
+
+// See vm_install_image(), leaves decoded code alone
+void memory_install(lc3_vm *vm, const struct lc3_image *image);
+
+// FNV-1a of every word in memory, low byte first
+uint64_t memory_hash(const lc3_vm *vm);
+
+// Carries on hash (0 to start one) with address and the count words loaded there
+uint64_t memory_hash_words(uint64_t hash, uint16_t address, const uint16_t *words, size_t count);
+
+
+
+// INTERPRETER (Operations.c)
+
+// Runs vm->steps instructions with the given engine or until vm_stop().
+// A profiled machine always runs the profiling loop.
+void run_engine(lc3_vm *vm, int engine);
+
+// Forgets anything decoded or translated from count words at address,
+// for writes to memory that don't go through the interpreter
+void engine_invalidate(lc3_vm *vm, uint16_t address, size_t count);
+
+// Frees the engine state hanging off the machine
+void engine_release(lc3_vm *vm);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,383 @@
+/*
+
+Memory.c
+
+Machine memory and memory mapped devices. The page tables behind
+memory_peek() and memory_poke() are filled in here, and each register on the
+device page gets a read and/or write handler in mmio_table, to add a device
+just register its handlers.
+
+vm_clone() shares memory copy-on-write: the pages the parent owns move into
+a reference counted set that parent and clone both read from, and either
+one gets its own copy of a page on its first write there, like any other
+shared page.
+
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Memory.h"
+#include "Output.h"
+#include "ReadImage.h"
+#include "Threads.h"
+
+#define PAGE_BYTES (MEMORY_PAGE_SIZE * sizeof(uint16_t))
+
+// Every page of a paged machine that holds nothing but zeros, never written
+static const uint16_t zero_page[MEMORY_PAGE_SIZE];
+
+// Pages machines gave up when they were cloned, never written again and
+// freed when the last machine or newer set pointing into them lets go
+struct lc3_shared_pages
+{
+	lc3_mutex lock;
+	int holders;
+	struct lc3_shared_pages *base;	// the set the giving machine was already reading from, this one holds it
+	uint16_t *owned[MEMORY_PAGES];
+};
+
+
+
+// PAGES
+
+int memory_init(lc3_vm *vm)
+{
+	vm->flat = calloc(MEMORY_MAX, sizeof(uint16_t));
+	if(!vm->flat)
+	{
+		return 0;
+	}
+	for(unsigned page = 0; page < MEMORY_PAGES; page++)
+	{
+		vm->pages[page] = vm->write_pages[page] = vm->flat + (page << MEMORY_PAGE_SHIFT);
+	}
+	return 1;
+}
+
+// Puts a page of a paged machine back on the zero page
+static void drop_page(lc3_vm *vm, unsigned page)
+{
+	free(vm->write_pages[page]);
+	vm->write_pages[page] = NULL;
+	vm->pages[page] = zero_page;
+}
+
+// Drops a machine's hold on a set, and the set's on its base when it was the last
+static void release_shared(struct lc3_shared_pages *shared)
+{
+	while(shared)
+	{
+		mutex_lock(&shared->lock);
+		int holders = --shared->holders; // clones on other threads may let go at the same time
+		mutex_unlock(&shared->lock);
+		if(holders > 0)
+		{
+			return;
+		}
+		struct lc3_shared_pages *base = shared->base;
+		for(unsigned page = 0; page < MEMORY_PAGES; page++)
+		{
+			free(shared->owned[page]);
+		}
+		mutex_destroy(&shared->lock);
+		free(shared);
+		shared = base;
+	}
+}
+
+void memory_release(lc3_vm *vm)
+{
+	if(vm->flat)
+	{
+		free(vm->flat);
+		vm->flat = NULL;
+		return;
+	}
+	for(unsigned page = 0; page < MEMORY_PAGES; page++)
+	{
+		free(vm->write_pages[page]);
+	}
+	release_shared(vm->shared);
+	vm->shared = NULL;
+}
+
+uint16_t *memory_fault(lc3_vm *vm, unsigned page)
+{
+	// Only paged machines get here, and a write can't be refused halfway through an instruction
+	uint16_t *copy = malloc(PAGE_BYTES);
+	if(!copy)
+	{
+		fprintf(stderr, "Out of memory\n");
+		abort();
+	}
+	memcpy(copy, vm->pages[page], PAGE_BYTES);
+	vm->pages[page] = vm->write_pages[page] = copy;
+	return copy;
+}
+
+int memory_set_paged(lc3_vm *vm)
+{
+	if(!vm->flat)
+	{
+		return 1;
+	}
+	
+	// Copy out every page with something in it before giving up the block
+	uint16_t *copies[MEMORY_PAGES];
+	for(unsigned page = 0; page < MEMORY_PAGES; page++)
+	{
+		const uint16_t *words = vm->flat + (page << MEMORY_PAGE_SHIFT);
+		copies[page] = NULL;
+		if(memcmp(words, zero_page, PAGE_BYTES) == 0)
+		{
+			continue;
+		}
+		copies[page] = malloc(PAGE_BYTES);
+		if(!copies[page])
+		{
+			while(page-- > 0)
+			{
+				free(copies[page]);
+			}
+			return 0;
+		}
+		memcpy(copies[page], words, PAGE_BYTES);
+	}
+	
+	free(vm->flat);
+	vm->flat = NULL;
+	for(unsigned page = 0; page < MEMORY_PAGES; page++)
+	{
+		vm->write_pages[page] = copies[page];
+		vm->pages[page] = copies[page] ? copies[page] : zero_page;
+	}
+	return 1;
+}
+
+void memory_clear(lc3_vm *vm)
+{
+	if(vm->flat)
+	{
+		memset(vm->flat, 0, MEMORY_MAX * sizeof(uint16_t));
+		return;
+	}
+	for(unsigned page = 0; page < MEMORY_PAGES; page++)
+	{
+		drop_page(vm, page);
+	}
+	release_shared(vm->shared); // nothing points into it any more
+	vm->shared = NULL;
+}
+
+int memory_clone(lc3_vm *clone, lc3_vm *vm)
+{
+	if(!memory_set_paged(vm))
+	{
+		return 0;
+	}
+	
+	// Whatever vm owns goes into a new set, unless it has written nothing since the last clone
+	int owns = 0;
+	for(unsigned page = 0; page < MEMORY_PAGES; page++)
+	{
+		owns |= vm->write_pages[page] != NULL;
+	}
+	if(owns)
+	{
+		struct lc3_shared_pages *shared = calloc(1, sizeof(*shared));
+		if(!shared)
+		{
+			return 0;
+		}
+		mutex_init(&shared->lock);
+		shared->holders = 1;
+		shared->base = vm->shared; // vm's hold on it passes to the new set
+		for(unsigned page = 0; page < MEMORY_PAGES; page++)
+		{
+			shared->owned[page] = vm->write_pages[page];
+			vm->write_pages[page] = NULL;
+		}
+		vm->shared = shared;
+	}
+	
+	memory_release(clone);
+	memcpy(clone->pages, vm->pages, sizeof(vm->pages));
+	memset(clone->write_pages, 0, sizeof(clone->write_pages));
+	clone->shared = vm->shared;
+	if(clone->shared)
+	{
+		mutex_lock(&clone->shared->lock);
+		clone->shared->holders++;
+		mutex_unlock(&clone->shared->lock);
+	}
+	return 1;
+}
+
+void memory_store(lc3_vm *vm, uint16_t address, const uint16_t *words, size_t count)
+{
+	size_t at = address;
+	while(count > 0)
+	{
+		unsigned page = (unsigned)(at >> MEMORY_PAGE_SHIFT);
+		size_t offset = at & MEMORY_PAGE_MASK;
+		size_t n = MEMORY_PAGE_SIZE - offset;
+		if(n > count)
+		{
+			n = count;
+		}
+		uint16_t *target = vm->write_pages[page] ? vm->write_pages[page] : memory_fault(vm, page);
+		memcpy(target + offset, words, n * sizeof(uint16_t));
+		at += n;
+		words += n;
+		count -= n;
+	}
+}
+
+void memory_install(lc3_vm *vm, const lc3_image *image)
+{
+	if(vm->flat)
+	{
+		memcpy(vm->flat + image->origin, image->words, image->length * sizeof(uint16_t));
+		return;
+	}
+	
+	size_t image_end = image->origin + image->length;
+	for(unsigned i = 0; i < image->page_count; i++)
+	{
+		unsigned page = image->first_page + i;
+		size_t start = (size_t)page << MEMORY_PAGE_SHIFT, end = start + MEMORY_PAGE_SIZE;
+		
+		// The image page can stand in for the machine's if it covers all of
+		// it, or if what it doesn't cover is zero on both sides
+		if((image->origin <= start && image_end >= end) || vm->pages[page] == zero_page)
+		{
+			drop_page(vm, page);
+			vm->pages[page] = image->pages + ((size_t)i << MEMORY_PAGE_SHIFT);
+			continue;
+		}
+		size_t from = image->origin > start ? image->origin : start;
+		size_t to = image_end < end ? image_end : end;
+		memory_store(vm, (uint16_t)from, image->words + (from - image->origin), to - from);
+	}
+}
+
+
+uint64_t memory_hash(const lc3_vm *vm)
+{
+	uint64_t hash = 14695981039346656037ull;
+	for(unsigned page = 0; page < MEMORY_PAGES; page++)
+	{
+		const uint16_t *words = vm->pages[page];
+		for(unsigned i = 0; i < MEMORY_PAGE_SIZE; i++)
+		{
+			hash = (hash ^ (words[i] & 0xFF)) * 1099511628211ull;
+			hash = (hash ^ (words[i] >> 8)) * 1099511628211ull;
+		}
+	}
+	return hash;
+}
+
+uint64_t memory_hash_words(uint64_t hash, uint16_t address, const uint16_t *words, size_t count)
+{
+	hash = (hash ? hash : 14695981039346656037ull) ^ ((uint64_t)address << 32 | count);
+	for(size_t i = 0; i < count; i++)
+	{
+		hash = (hash ^ (words[i] & 0xFF)) * 1099511628211ull;
+		hash = (hash ^ (words[i] >> 8)) * 1099511628211ull;
+	}
+	return hash;
+}
+
+
+
+// KEYBOARD
+
+// Reading KBSR polls the keyboard and latches the key into KBDR, where it
+// stays until KBDR is read
+static uint16_t kbsr_read(lc3_vm *vm, uint16_t address)
+{
+	uint16_t kbsr = memory_peek(vm, MR_KBSR);
+	if(kbsr & KBSR_READY)
+	{
+		return kbsr;
+	}
+	// An interactive vm_check_key() writes out pending output, a program polling for keys has usually just prompted
+	if(vm_check_key(vm))
+	{
+		memory_poke(vm, MR_KBDR, vm_read_key(vm));
+		kbsr |= KBSR_READY;
+	}
+	memory_poke(vm, MR_KBSR, kbsr);
+	return kbsr;
+}
+
+// Only the interrupt enable bit can be written
+static void kbsr_write(lc3_vm *vm, uint16_t address, uint16_t val)
+{
+	uint16_t kbsr = (memory_peek(vm, MR_KBSR) & KBSR_READY) | (val & KBSR_IE);
+	memory_poke(vm, MR_KBSR, kbsr);
+	if(kbsr & KBSR_IE)
+	{
+		vm_check_interrupts(vm);
+	}
+}
+
+static uint16_t kbdr_read(lc3_vm *vm, uint16_t address)
+{
+	memory_poke(vm, MR_KBSR, memory_peek(vm, MR_KBSR) & ~KBSR_READY);
+	return memory_peek(vm, MR_KBDR);
+}
+
+
+
+// DISPLAY
+
+// The console is always ready for another character
+static uint16_t dsr_read(lc3_vm *vm, uint16_t address)
+{
+	return 1 << 15;
+}
+
+static void ddr_write(lc3_vm *vm, uint16_t address, uint16_t val)
+{
+	memory_poke(vm, MR_DDR, val);
+	output_char(&vm->out, (char)val);
+}
+
+
+
+mmio_device mmio_table[MMIO_SIZE] =
+{
+	[MR_KBSR - MMIO_BASE] = { kbsr_read, kbsr_write },
+	[MR_KBDR - MMIO_BASE] = { kbdr_read, NULL },
+	[MR_DSR - MMIO_BASE] = { dsr_read, NULL },
+	[MR_DDR - MMIO_BASE] = { NULL, ddr_write },
+};
+
+void mmio_register(uint16_t address, mmio_read_fn read, mmio_write_fn write)
+{
+	mmio_table[address - MMIO_BASE].read = read;
+	mmio_table[address - MMIO_BASE].write = write;
+}
+
+uint16_t mmio_read(lc3_vm *vm, uint16_t address)
+{
+	mmio_read_fn read = mmio_table[address - MMIO_BASE].read;
+	return read ? read(vm, address) : memory_peek(vm, address);
+}
+
+void mmio_write(lc3_vm *vm, uint16_t address, uint16_t val)
+{
+	mmio_write_fn write = mmio_table[address - MMIO_BASE].write;
+	if(write)
+	{
+		write(vm, address, val);
+	}
+	else
+	{
+		memory_poke(vm, address, val);
+	}
+}
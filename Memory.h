@@ -0,0 +1,40 @@
+/*
+
+Memory.h
+
+Device page (xFE00-xFFFF) dispatch. Everything below MMIO_BASE is plain RAM
+and never goes through here.
+
+*/
+
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <stdint.h>
+
+#include "LC3.h"
+
+#define MMIO_BASE 0xFE00 // first device address
+#define MMIO_SIZE (MEMORY_MAX - MMIO_BASE)
+
+typedef uint16_t (*mmio_read_fn)(lc3_vm *vm, uint16_t address);
+typedef void (*mmio_write_fn)(lc3_vm *vm, uint16_t address, uint16_t val);
+
+// Handlers for one device register, a NULL handler behaves like plain RAM
+typedef struct
+{
+	mmio_read_fn read;
+	mmio_write_fn write;
+} mmio_device;
+
+// Indexed by address - MMIO_BASE, shared by every machine
+extern mmio_device mmio_table[MMIO_SIZE];
+
+// Installs (or with NULLs removes) the handlers for a device register
+void mmio_register(uint16_t address, mmio_read_fn read, mmio_write_fn write);
+
+// Slow paths for addresses >= MMIO_BASE
+uint16_t mmio_read(lc3_vm *vm, uint16_t address);
+void mmio_write(lc3_vm *vm, uint16_t address, uint16_t val);
+
+#endif
@@ -0,0 +1,1302 @@
+/*
+
+Operations.c
+
+LC-3 instruction implementations and the interpreter loops that dispatch them.
+
+Every opcode is a small inline handler so the same code backs all the loops:
+	- run_switch(): one switch on instr >> 12, works on every compiler. It
+	  comes in a variant per combination of flat or paged memory, the
+	  --profile counters (Profile.h), --trace records (Trace.h) and the
+	  checks vm_run_until() needs, so none of them costs anything in a run
+	  that doesn't use it
+	- run_threaded(): GCC/Clang computed goto, each handler jumps straight to the next
+	- run_cached(): pre-decoded instruction cache, one entry per address,
+	  with common two and three instruction idioms fused into one handler,
+	  optionally handing hot blocks to the JIT (Jit.c)
+
+The threaded loop is only built when the compiler supports it, build with
+-DLC3_SWITCH_DISPATCH to leave it out. Asking for it without it falls back to
+the switch loop.
+
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "Analysis.h"
+#include "InterruptHandling.h"
+#include "Jit.h"
+#include "LC3.h"
+#include "Memory.h"
+#include "Output.h"
+#include "Profile.h"
+#include "Trace.h"
+
+#if defined(__GNUC__) && !defined(LC3_SWITCH_DISPATCH)
+#define LC3_THREADED_DISPATCH
+#endif
+
+
+
+// CONDITION CODES
+
+// Condition codes are lazy: instructions that set them only record the value
+// they wrote in vm->cond_result, and N/Z/P are derived when a BR actually needs
+// them. run_engine() loads it from reg[R_COND] on the way in and writes
+// reg[R_COND] back on the way out, so outside the loop the register is exact.
+
+// Need to update a value's sign when written to a register
+static inline void update_flags(lc3_vm *vm, uint16_t r) 
+{
+	vm->cond_result = vm->reg[r];
+}
+
+static inline uint16_t current_flags(lc3_vm *vm)
+{
+	return cond_flags(vm->cond_result);
+}
+
+
+
+
+// DECODED INSTRUCTION CACHE
+
+typedef struct decoded decoded_t;
+typedef void (*handler_fn)(lc3_vm *vm, const decoded_t *d);
+
+// One entry per address: the handler for that exact instruction form plus
+// its fields already extracted and sign-extended
+struct decoded
+{
+	handler_fn fn;	// h_decode until the word at this address has been decoded
+	uint16_t instr;	// raw word, for handlers that fall back to op_*()
+	uint16_t imm;	// sign-extended imm5 / offset6 / PCoffset9 / PCoffset11
+	uint8_t r0;		// DR / SR, or the nzp mask for BR
+	uint8_t r1;		// SR1 / BaseR
+	uint8_t r2;		// SR2
+};
+
+static void h_decode(lc3_vm *vm, const decoded_t *d);
+
+// Any store may overwrite code, so the entry goes back to being decoded on next fetch
+static inline void invalidate_icache(lc3_vm *vm, uint16_t address)
+{
+	if(vm->icache)
+	{
+		vm->icache[address].fn = h_decode;
+	}
+}
+
+
+
+
+// MEMORY ACCESS
+
+// Only the device page (MMIO_BASE and up) needs any checking, instruction
+// fetch and plain RAM go straight to memory. Flat machines skip the page
+// table, the test is one well predicted branch.
+
+static inline uint16_t mem_fetch(lc3_vm *vm, uint16_t address)
+{
+	return vm->flat ? vm->flat[address] : memory_peek(vm, address);
+}
+
+// Store to an address known to be below MMIO_BASE
+static inline void mem_write_ram(lc3_vm *vm, uint16_t address, uint16_t val)
+{
+	if(vm->flat)
+	{
+		vm->flat[address] = val;
+	}
+	else
+	{
+		memory_poke(vm, address, val);
+	}
+	invalidate_icache(vm, address);
+	if(vm->jit_pages[address >> JIT_PAGE_SHIFT])
+	{
+		jit_invalidate_page(vm->jit, address >> JIT_PAGE_SHIFT);
+	}
+}
+
+static inline void mem_write(lc3_vm *vm, uint16_t address, uint16_t val)
+{
+	if(address >= MMIO_BASE)
+	{
+		mmio_write(vm, address, val); // device page is never cached or translated
+		return;
+	}
+	mem_write_ram(vm, address, val);
+}
+
+static inline uint16_t mem_read(lc3_vm *vm, uint16_t address)
+{
+	if(address >= MMIO_BASE)
+	{
+		return mmio_read(vm, address);
+	}
+	return mem_fetch(vm, address);
+}
+
+
+
+
+// INSTRUCTION HANDLERS
+
+
+static inline void op_add(lc3_vm *vm, uint16_t instr)
+{	
+	// Destination register
+	uint16_t r0 = (instr >> 9) & 0x7;
+	// first operand SR1
+	uint16_t r1 = (instr >> 6) & 0x7;
+	// grab bit 5 to check for imm mode
+	uint16_t imm_flag = (instr >> 5) & 0x1;
+	
+	if(imm_flag)
+	{
+		uint16_t imm5 = sign_extend(instr & 0x1F, 5);
+		vm->reg[r0] = vm->reg[r1] + imm5;
+	}
+	else
+	{
+		uint16_t r2 = instr & 0x7;
+		vm->reg[r0] = vm->reg[r1] + vm->reg[r2];
+	}
+	update_flags(vm, r0);
+}
+
+static inline void op_and(lc3_vm *vm, uint16_t instr)
+{
+	// Destination register
+	uint16_t r0 = (instr >> 9) & 0x7;
+	// first operand SR1
+	uint16_t r1 = (instr >> 6) & 0x7;
+	// check if in immediate mode
+	uint16_t imm_flag = (instr >> 5) & 0x1;
+	
+	if(imm_flag)
+	{
+		uint16_t imm5 = sign_extend(instr & 0x1F, 5);
+		vm->reg[r0] = vm->reg[r1] & imm5;
+	}
+	else
+	{
+		uint16_t r2 = instr & 0x7;
+		vm->reg[r0] = vm->reg[r1] & vm->reg[r2];
+	}
+	update_flags(vm, r0);
+}
+
+static inline void op_not(lc3_vm *vm, uint16_t instr)
+{
+	// Destination register
+	uint16_t r0 = (instr >> 9) & 0x7;
+	// Source register
+	uint16_t r1 = (instr >> 6) & 0x7;
+	vm->reg[r0] = ~vm->reg[r1];
+}
+
+static inline void op_br(lc3_vm *vm, uint16_t instr)
+{
+	// Get condicion flag (negative, zero, or positive)
+	uint16_t cond_flag = (instr >> 9) & 0x7;
+	// Get pc offset 
+	uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
+	
+	if(cond_flag & current_flags(vm))
+	{
+		vm->reg[R_PC] += pc_offset;
+	}
+}
+
+static inline void op_jmp(lc3_vm *vm, uint16_t instr)
+{
+	// Get register to JMP to (RET occurs when r1 == 0x7)
+	uint16_t r1 = (instr >> 6) & 0x7;
+	vm->reg[R_PC] = vm->reg[r1];
+}
+
+static inline void op_jsr(lc3_vm *vm, uint16_t instr)
+{
+	// PC is saved in R7
+	vm->reg[R_R7] = vm->reg[R_PC];
+	uint16_t long_flag = (instr >> 11) & 0x1;
+	if(long_flag) // JSR
+	{
+		uint16_t pc_offset = sign_extend(instr & 0x7FF, 11);
+		vm->reg[R_PC] += pc_offset;
+	}
+	else // JSRR
+	{
+		uint16_t r1 = (instr >> 6) & 0x7;
+		vm->reg[R_PC] = vm->reg[r1];
+	}
+}
+
+static inline void op_ld(lc3_vm *vm, uint16_t instr)
+{
+	// Destination register
+	uint16_t r0 = (instr >> 9) & 0x7;
+	// PC offset
+	uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
+	vm->reg[r0] = mem_read(vm, vm->reg[R_PC] + pc_offset);
+	update_flags(vm, r0);
+}
+
+static inline void op_ldi(lc3_vm *vm, uint16_t instr)
+{
+	// Destination register
+	uint16_t r0 = (instr >> 9) & 0x7;
+	// PC offset 9
+	uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
+	// add PC offset to to current PC, and read that memory address to get the final address
+	vm->reg[r0] = mem_read(vm, mem_read(vm, vm->reg[R_PC] + pc_offset));
+	update_flags(vm, r0);
+}
+
+static inline void op_ldr(lc3_vm *vm, uint16_t instr)
+{
+	// Get destination register
+	uint16_t r0 = (instr >> 9) & 0x7;
+	// Get base register
+	uint16_t r1 = (instr >> 6) & 0x7;
+	// PC offset
+	uint16_t pc_offset = sign_extend(instr & 0x3F, 6);
+	vm->reg[r0] = mem_read(vm, vm->reg[r1] + pc_offset);
+	update_flags(vm, r0);
+}
+
+static inline void op_lea(lc3_vm *vm, uint16_t instr)
+{
+	// Destination register
+	uint16_t r0 = (instr >> 9) & 0x7;
+	// PC offset
+	uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
+	vm->reg[r0] = vm->reg[R_PC] + pc_offset;
+	update_flags(vm, r0);
+}
+
+static inline void op_st(lc3_vm *vm, uint16_t instr)
+{
+	// Source register
+	uint16_t r0 = (instr >> 9) & 0x7;
+	// PC offset
+	uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
+	mem_write(vm, vm->reg[R_PC] + pc_offset, vm->reg[r0]);
+}
+
+static inline void op_sti(lc3_vm *vm, uint16_t instr)
+{
+	// Source register
+	uint16_t r0 = (instr >> 9) & 0x7;
+	// PC offset
+	uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
+	mem_write(vm, mem_read(vm, vm->reg[R_PC] + pc_offset), vm->reg[r0]);
+}
+
+static inline void op_str(lc3_vm *vm, uint16_t instr)
+{
+	// Source register
+	uint16_t r0 = (instr >> 9) & 0x7;
+	uint16_t r1 = (instr >> 6) & 0x7;
+	uint16_t pc_offset = sign_extend(instr & 0x3F, 6);
+	mem_write(vm, vm->reg[r1] + pc_offset, vm->reg[r0]);
+}
+
+// PUTS/PUTSP from R0 a page at a time, a string that runs off the end of
+// memory stops there
+static void put_string(lc3_vm *vm, size_t (*put)(lc3_output *, const uint16_t *, size_t))
+{
+	uint32_t address = vm->reg[R_R0];
+	while(address < MEMORY_MAX)
+	{
+		size_t offset = address & MEMORY_PAGE_MASK;
+		size_t room = MEMORY_PAGE_SIZE - offset;
+		if(put(&vm->out, vm->pages[address >> MEMORY_PAGE_SHIFT] + offset, room) < room)
+		{
+			return;
+		}
+		address += (uint32_t)room;
+	}
+}
+
+// TRAPS
+
+// The built-in handlers
+
+// A key KBSR already latched comes first, it was taken from the console
+static uint16_t trap_key(lc3_vm *vm)
+{
+	uint16_t kbsr = memory_peek(vm, MR_KBSR);
+	if(kbsr & KBSR_READY)
+	{
+		memory_poke(vm, MR_KBSR, kbsr & ~KBSR_READY);
+		return memory_peek(vm, MR_KBDR);
+	}
+	return vm_read_key(vm);
+}
+
+static void trap_getc(lc3_vm *vm)
+{
+	vm->reg[R_R0] = trap_key(vm);
+	update_flags(vm, R_R0);
+}
+
+static void trap_out(lc3_vm *vm)
+{
+	output_char(&vm->out, (char)vm->reg[R_R0]);
+}
+
+static void trap_puts(lc3_vm *vm)
+{
+	// One char per word
+	put_string(vm, output_words);
+}
+
+static void trap_in(lc3_vm *vm)
+{
+	output_bytes(&vm->out, "Enter a character:", 18);
+	char c = (char)trap_key(vm);
+	output_char(&vm->out, c);
+	vm->reg[R_R0] = (uint16_t)c;
+	update_flags(vm, R_R0);
+}
+
+static void trap_putsp(lc3_vm *vm)
+{
+	// Two chars per word, low byte first
+	put_string(vm, output_packed);
+}
+
+// Stops the machine
+static void trap_halt(lc3_vm *vm)
+{
+	output_bytes(&vm->out, "HALT\n", 5);
+	output_flush(&vm->out);
+	vm_stop(vm, VM_HALTED);
+}
+
+static const lc3_trap_fn builtin_traps[256] =
+{
+	[TRAP_GETC] = trap_getc,
+	[TRAP_OUT] = trap_out,
+	[TRAP_PUTS] = trap_puts,
+	[TRAP_IN] = trap_in,
+	[TRAP_PUTSP] = trap_putsp,
+	[TRAP_HALT] = trap_halt
+};
+
+lc3_trap_fn vm_builtin_trap(uint8_t vector)
+{
+	return builtin_traps[vector];
+}
+
+void vm_set_cc(lc3_vm *vm, uint16_t value)
+{
+	vm->cond_result = value;
+}
+
+// Runs the handler for an EXCEPTION_* raised by the instruction just fetched,
+// with no handler installed the machine stops there as VM_ILLEGAL
+static void raise_exception(lc3_vm *vm, uint8_t vector)
+{
+	uint16_t target = mem_fetch(vm, INTERRUPT_TABLE + vector);
+	if(!target)
+	{
+		vm->reg[R_PC]--; // left at the offending instruction
+		vm_stop(vm, VM_ILLEGAL);
+		return;
+	}
+	enter_supervisor(vm, vm->psr | current_flags(vm));
+	vm->reg[R_PC] = target;
+}
+
+// Runs the vector's native handler or enters the one in the trap vector table
+static void op_trap(lc3_vm *vm, uint16_t instr)
+{
+	uint8_t vector = instr & 0xFF;
+	vm->counters.traps[vector]++;
+	vm->reg[R_R7] = vm->reg[R_PC];
+	lc3_trap_fn handler = vm->traps[vector];
+	uint16_t target = handler ? 0 : mem_fetch(vm, TRAP_TABLE + vector);
+	if(target)
+	{
+		enter_supervisor(vm, vm->psr | current_flags(vm));
+		vm->reg[R_PC] = target;
+	}
+	else
+	{
+		if(!handler)
+		{
+			handler = builtin_traps[vector]; // nothing installed in the table, other vectors do nothing
+		}
+		if(handler)
+		{
+			handler(vm);
+		}
+	}
+	
+	if((vm->until.conditions & VM_UNTIL_TRAP) && (vm->until.trap < 0 || vm->until.trap == vector) && vm->status == VM_RUNNING)
+	{
+		vm_stop(vm, VM_BREAK);
+	}
+}
+
+// Returns to what enter_supervisor() saved, user mode has no business here
+static void op_rti(lc3_vm *vm, uint16_t instr)
+{
+	if(vm->psr & PSR_USER)
+	{
+		raise_exception(vm, EXCEPTION_PRIVILEGE);
+		return;
+	}
+	uint16_t psr = leave_supervisor(vm);
+	vm->cond_result = cond_value(psr & (FL_NEG | FL_ZRO | FL_POS));
+}
+
+
+
+
+// SWITCH DISPATCH
+
+// The switch loop is one body specialized at compile time for every
+// combination of the LOOP_* features: each run_loop() instantiation below
+// gets its features as a constant, so the tests for features it doesn't have
+// fold away and the plain loop is exactly fetch, switch and handler.
+// run_engine() picks the instantiation once per vm_run().
+enum
+{
+	LOOP_PAGED = 1 << 0,	// fetch through the page table instead of vm->flat
+	LOOP_PROFILE = 1 << 1,	// the --profile counters (Profile.h)
+	LOOP_WATCH = 1 << 2,	// stop in front of vm->until.pc or a TRAP reading a key
+	LOOP_TRACE = 1 << 3,	// a trace_record per instruction (Trace.h)
+	LOOP_VARIANTS = 1 << 4
+};
+
+#if defined(__GNUC__)
+#define LOOP_INLINE inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define LOOP_INLINE __forceinline
+#else
+#define LOOP_INLINE inline
+#endif
+
+// A TRAP that waits for a key
+static inline int reads_key(uint16_t instr)
+{
+	return instr == (OP_TRAP << 12 | TRAP_GETC) || instr == (OP_TRAP << 12 | TRAP_IN);
+}
+
+// Whether vm_run_until() wants the machine stopped in front of pc
+static inline int watched(lc3_vm *vm, uint16_t pc)
+{
+	return ((vm->until.conditions & VM_UNTIL_PC) && pc == vm->until.pc)
+		|| ((vm->until.conditions & VM_UNTIL_INPUT) && reads_key(memory_peek(vm, pc)));
+}
+
+static LOOP_INLINE void run_loop(lc3_vm *vm, const int features)
+{
+	lc3_profile *p = vm->profile;
+	while(vm->steps) 
+	{
+		uint16_t pc = vm->reg[R_PC];
+		if((features & LOOP_WATCH) && watched(vm, pc))
+		{
+			vm_stop(vm, VM_BREAK);
+			return;
+		}
+		vm->steps--;
+		
+		// FETCH
+		uint16_t instr = features & LOOP_PAGED ? memory_peek(vm, pc) : vm->flat[pc];
+		vm->reg[R_PC] = pc + 1;
+		if(features & LOOP_PROFILE)
+		{
+			profile_instruction(p, pc, instr);
+		}
+		uint16_t before[R_R7 + 1];
+		if(features & LOOP_TRACE)
+		{
+			memcpy(before, vm->reg, sizeof(before));
+		}
+		
+		switch(instr >> 12) 
+		{
+			case OP_ADD:	op_add(vm, instr);	break;
+			case OP_AND:	op_and(vm, instr);	break;
+			case OP_NOT:	op_not(vm, instr);	break;
+			case OP_BR:		op_br(vm, instr);	break;
+			case OP_JMP:
+				op_jmp(vm, instr);
+				if(features & LOOP_PROFILE)
+				{
+					profile_jump(p, vm->reg[R_PC]);
+				}
+				break;
+			case OP_JSR:
+				op_jsr(vm, instr);
+				if(features & LOOP_PROFILE)
+				{
+					profile_call(p, vm->reg[R_PC], vm->reg[R_R7]);
+				}
+				break;
+			case OP_LD:		op_ld(vm, instr);	break;
+			case OP_LDI:	op_ldi(vm, instr);	break;
+			case OP_LDR:	op_ldr(vm, instr);	break;
+			case OP_LEA:	op_lea(vm, instr);	break;
+			case OP_ST:		op_st(vm, instr);	break;
+			case OP_STI:	op_sti(vm, instr);	break;
+			case OP_STR:	op_str(vm, instr);	break;
+			case OP_TRAP:
+				if(features & LOOP_PROFILE)
+				{
+					p->traps[instr & 0xFF]++;
+				}
+				op_trap(vm, instr);
+				if((features & LOOP_PROFILE) && vm->reg[R_PC] != (uint16_t)(pc + 1))
+				{
+					profile_call(p, vm->reg[R_PC], pc + 1); // into a handler in the vector table
+				}
+				break;
+			case OP_RTI:
+				op_rti(vm, instr);
+				if(features & LOOP_PROFILE)
+				{
+					profile_jump(p, vm->reg[R_PC]);
+				}
+				break;
+			case OP_RES:
+			default:
+				raise_exception(vm, EXCEPTION_ILLEGAL);
+				break;
+		}
+		
+		if(features & LOOP_TRACE)
+		{
+			trace_instruction(vm->trace, pc, instr, before, vm->reg, current_flags(vm));
+		}
+	}
+}
+
+#define LOOP_VARIANT(features) static void run_loop_##features(lc3_vm *vm) { run_loop(vm, features); }
+LOOP_VARIANT(0)
+LOOP_VARIANT(1)
+LOOP_VARIANT(2)
+LOOP_VARIANT(3)
+LOOP_VARIANT(4)
+LOOP_VARIANT(5)
+LOOP_VARIANT(6)
+LOOP_VARIANT(7)
+LOOP_VARIANT(8)
+LOOP_VARIANT(9)
+LOOP_VARIANT(10)
+LOOP_VARIANT(11)
+LOOP_VARIANT(12)
+LOOP_VARIANT(13)
+LOOP_VARIANT(14)
+LOOP_VARIANT(15)
+#undef LOOP_VARIANT
+
+// Indexed by LOOP_* bits
+static void (*const switch_loops[LOOP_VARIANTS])(lc3_vm *vm) =
+{
+	run_loop_0, run_loop_1, run_loop_2, run_loop_3, run_loop_4, run_loop_5, run_loop_6, run_loop_7,
+	run_loop_8, run_loop_9, run_loop_10, run_loop_11, run_loop_12, run_loop_13, run_loop_14, run_loop_15
+};
+
+// The switch loop with the features this run needs
+static void run_switch(lc3_vm *vm)
+{
+	int features = vm->flat ? 0 : LOOP_PAGED;
+	if(vm->profile)
+	{
+		features |= LOOP_PROFILE;
+	}
+	if(vm->until.conditions & (VM_UNTIL_PC | VM_UNTIL_INPUT))
+	{
+		features |= LOOP_WATCH;
+	}
+	if(vm->trace)
+	{
+		features |= LOOP_TRACE;
+	}
+	switch_loops[features](vm);
+}
+
+
+
+
+// THREADED DISPATCH
+
+#ifdef LC3_THREADED_DISPATCH
+
+// Every handler ends with its own fetch and indirect jump, so the branch
+// predictor sees one jump site per opcode instead of a single shared one
+#define DISPATCH() \
+	do { \
+		if(!vm->steps) return; \
+		vm->steps--; \
+		instr = mem_fetch(vm, vm->reg[R_PC]++); \
+		goto *dispatch_table[instr >> 12]; \
+	} while(0)
+
+static void run_threaded(lc3_vm *vm)
+{
+	// Indexed by opcode, same order as the OP_ enum
+	static void *const dispatch_table[16] =
+	{
+		&&do_br, &&do_add, &&do_ld, &&do_st, &&do_jsr, &&do_and, &&do_ldr, &&do_str,
+		&&do_rti, &&do_not, &&do_ldi, &&do_sti, &&do_jmp, &&do_res, &&do_lea, &&do_trap
+	};
+	
+	uint16_t instr;
+	DISPATCH();
+	
+	do_add:		op_add(vm, instr);	DISPATCH();
+	do_and:		op_and(vm, instr);	DISPATCH();
+	do_not:		op_not(vm, instr);	DISPATCH();
+	do_br:		op_br(vm, instr);	DISPATCH();
+	do_jmp:		op_jmp(vm, instr);	DISPATCH();
+	do_jsr:		op_jsr(vm, instr);	DISPATCH();
+	do_ld:		op_ld(vm, instr);	DISPATCH();
+	do_ldi:		op_ldi(vm, instr);	DISPATCH();
+	do_ldr:		op_ldr(vm, instr);	DISPATCH();
+	do_lea:		op_lea(vm, instr);	DISPATCH();
+	do_st:		op_st(vm, instr);	DISPATCH();
+	do_sti:		op_sti(vm, instr);	DISPATCH();
+	do_str:		op_str(vm, instr);	DISPATCH();
+	do_trap:	op_trap(vm, instr);	DISPATCH();
+	do_rti:		op_rti(vm, instr);	DISPATCH();
+	do_res:		raise_exception(vm, EXCEPTION_ILLEGAL);	DISPATCH();
+}
+
+#undef DISPATCH
+
+#endif
+
+
+
+
+// CACHED DISPATCH
+
+// Handlers are specialised per instruction form so none of them tests the
+// imm bit or re-extracts a field. Rare or complicated instructions just call
+// the shared op_*() handler with the raw word.
+
+static void h_add_imm(lc3_vm *vm, const decoded_t *d)
+{
+	vm->reg[d->r0] = vm->reg[d->r1] + d->imm;
+	update_flags(vm, d->r0);
+}
+
+static void h_add_reg(lc3_vm *vm, const decoded_t *d)
+{
+	vm->reg[d->r0] = vm->reg[d->r1] + vm->reg[d->r2];
+	update_flags(vm, d->r0);
+}
+
+static void h_and_imm(lc3_vm *vm, const decoded_t *d)
+{
+	vm->reg[d->r0] = vm->reg[d->r1] & d->imm;
+	update_flags(vm, d->r0);
+}
+
+static void h_and_reg(lc3_vm *vm, const decoded_t *d)
+{
+	vm->reg[d->r0] = vm->reg[d->r1] & vm->reg[d->r2];
+	update_flags(vm, d->r0);
+}
+
+static void h_not(lc3_vm *vm, const decoded_t *d)
+{
+	vm->reg[d->r0] = ~vm->reg[d->r1];
+}
+
+static void h_br(lc3_vm *vm, const decoded_t *d)
+{
+	if(d->r0 & current_flags(vm))
+	{
+		vm->reg[R_PC] += d->imm;
+	}
+}
+
+// BRnzp, no need to look at the flags
+static void h_br_always(lc3_vm *vm, const decoded_t *d)
+{
+	vm->reg[R_PC] += d->imm;
+}
+
+// BR with no condition bits set never branches
+static void h_nop(lc3_vm *vm, const decoded_t *d)
+{
+}
+
+static void h_jmp(lc3_vm *vm, const decoded_t *d)
+{
+	vm->reg[R_PC] = vm->reg[d->r1];
+}
+
+static void h_jsr(lc3_vm *vm, const decoded_t *d)
+{
+	vm->reg[R_R7] = vm->reg[R_PC];
+	vm->reg[R_PC] += d->imm;
+}
+
+static void h_jsrr(lc3_vm *vm, const decoded_t *d)
+{
+	vm->reg[R_R7] = vm->reg[R_PC];
+	vm->reg[R_PC] = vm->reg[d->r1];
+}
+
+static void h_ld(lc3_vm *vm, const decoded_t *d)
+{
+	vm->reg[d->r0] = mem_read(vm, vm->reg[R_PC] + d->imm);
+	update_flags(vm, d->r0);
+}
+
+// LD whose address was resolved at decode time and is plain RAM
+static void h_ld_direct(lc3_vm *vm, const decoded_t *d)
+{
+	vm->reg[d->r0] = memory_peek(vm, d->imm);
+	update_flags(vm, d->r0);
+}
+
+static void h_ldi(lc3_vm *vm, const decoded_t *d)
+{
+	op_ldi(vm, d->instr);
+}
+
+static void h_ldr(lc3_vm *vm, const decoded_t *d)
+{
+	vm->reg[d->r0] = mem_read(vm, vm->reg[d->r1] + d->imm);
+	update_flags(vm, d->r0);
+}
+
+static void h_lea(lc3_vm *vm, const decoded_t *d)
+{
+	vm->reg[d->r0] = vm->reg[R_PC] + d->imm;
+	update_flags(vm, d->r0);
+}
+
+static void h_st(lc3_vm *vm, const decoded_t *d)
+{
+	mem_write(vm, vm->reg[R_PC] + d->imm, vm->reg[d->r0]);
+}
+
+// ST whose address was resolved at decode time and is plain RAM
+static void h_st_direct(lc3_vm *vm, const decoded_t *d)
+{
+	mem_write_ram(vm, d->imm, vm->reg[d->r0]);
+}
+
+static void h_sti(lc3_vm *vm, const decoded_t *d)
+{
+	op_sti(vm, d->instr);
+}
+
+static void h_str(lc3_vm *vm, const decoded_t *d)
+{
+	mem_write(vm, vm->reg[d->r1] + d->imm, vm->reg[d->r0]);
+}
+
+static void h_trap(lc3_vm *vm, const decoded_t *d)
+{
+	op_trap(vm, d->instr);
+}
+
+static void h_rti(lc3_vm *vm, const decoded_t *d)
+{
+	op_rti(vm, d->instr);
+}
+
+static void h_illegal(lc3_vm *vm, const decoded_t *d)
+{
+	raise_exception(vm, EXCEPTION_ILLEGAL);
+}
+
+
+// JIT TIER
+
+// Same as the plain branch handlers, but every taken branch counts as a hit on
+// its target and the target's entry is switched to native code once hot
+
+static void h_jit_enter(lc3_vm *vm, const decoded_t *d);
+
+static inline void jit_count(lc3_vm *vm, uint16_t target)
+{
+	if(jit_hit(vm->jit, target) && target < MR_KBSR && jit_compile(vm->jit, vm->pages, target))
+	{
+		vm->icache[target].fn = h_jit_enter;
+	}
+}
+
+static void h_br_jit(lc3_vm *vm, const decoded_t *d)
+{
+	if(d->r0 & current_flags(vm))
+	{
+		vm->reg[R_PC] += d->imm;
+		jit_count(vm, vm->reg[R_PC]);
+	}
+}
+
+static void h_br_always_jit(lc3_vm *vm, const decoded_t *d)
+{
+	vm->reg[R_PC] += d->imm;
+	jit_count(vm, vm->reg[R_PC]);
+}
+
+static void h_jmp_jit(lc3_vm *vm, const decoded_t *d)
+{
+	vm->reg[R_PC] = vm->reg[d->r1];
+	jit_count(vm, vm->reg[R_PC]);
+}
+
+static void h_jsr_jit(lc3_vm *vm, const decoded_t *d)
+{
+	vm->reg[R_R7] = vm->reg[R_PC];
+	vm->reg[R_PC] += d->imm;
+	jit_count(vm, vm->reg[R_PC]);
+}
+
+static void h_jsrr_jit(lc3_vm *vm, const decoded_t *d)
+{
+	vm->reg[R_R7] = vm->reg[R_PC];
+	vm->reg[R_PC] = vm->reg[d->r1];
+	jit_count(vm, vm->reg[R_PC]);
+}
+
+// FUSED GROUPS
+
+// A fused entry runs its own instruction and then the next one or two, using
+// the following cache entries' fields. Those entries stay ordinary entries, so
+// a branch into the middle of a group just runs them one at a time. When one
+// of them has been invalidated or rewritten into another form since, or the
+// step budget can't cover the whole group, the entry runs only its own
+// instruction, exactly like the plain handler.
+
+// Masks and values of instr that a following entry must still match
+#define FORM_ADD_IMM	0xF020, 0x1020
+#define FORM_BR			0xF000, 0x0000
+#define FORM_STR		0xF000, 0x7000
+#define FORM_PUTS		0xFFFF, 0xF020 | TRAP_PUTS
+
+static inline int still_fusable(const decoded_t *next, uint16_t mask, uint16_t match)
+{
+	return next->fn != h_decode && (next->instr & mask) == match;
+}
+
+// AND Rx,Rx,#0 ; ADD Rx,Rx,#imm -- load immediate
+static void h_fused_load_imm(lc3_vm *vm, const decoded_t *d)
+{
+	const decoded_t *add = d + 1;
+	if(!vm->steps || !still_fusable(add, FORM_ADD_IMM))
+	{
+		h_and_imm(vm, d);
+		return;
+	}
+	vm->steps--;
+	vm->reg[d->r0] = vm->reg[d->r1] & d->imm;
+	vm->reg[add->r0] = vm->reg[add->r1] + add->imm;
+	vm->reg[R_PC]++;
+	update_flags(vm, add->r0);
+}
+
+// ADD Rx,Rx,#imm ; BR -- loop counter
+static void h_fused_add_br(lc3_vm *vm, const decoded_t *d)
+{
+	const decoded_t *br = d + 1;
+	if(!vm->steps || !still_fusable(br, FORM_BR))
+	{
+		h_add_imm(vm, d);
+		return;
+	}
+	vm->steps--;
+	vm->reg[d->r0] = vm->reg[d->r1] + d->imm;
+	update_flags(vm, d->r0);
+	vm->reg[R_PC]++;
+	if(br->r0 & current_flags(vm))
+	{
+		vm->reg[R_PC] += br->imm;
+	}
+}
+
+// LDR Rx,Rb,#o ; ADD Rx,Rx,#imm ; STR Rx,Rb,#o -- read-modify-write
+static void h_fused_ldr_add_str(lc3_vm *vm, const decoded_t *d)
+{
+	const decoded_t *add = d + 1, *str = d + 2;
+	if(vm->steps < 2 || !still_fusable(add, FORM_ADD_IMM) || !still_fusable(str, FORM_STR))
+	{
+		h_ldr(vm, d);
+		return;
+	}
+	vm->reg[d->r0] = mem_read(vm, vm->reg[d->r1] + d->imm);
+	vm->steps -= 2; // after the load so a polled device sees the LDR's own count
+	vm->reg[add->r0] = vm->reg[add->r1] + add->imm;
+	update_flags(vm, add->r0);
+	vm->reg[R_PC] += 2;
+	mem_write(vm, vm->reg[str->r1] + str->imm, vm->reg[str->r0]);
+}
+
+// LEA R0,label ; TRAP x22 -- print a string
+static void h_fused_lea_puts(lc3_vm *vm, const decoded_t *d)
+{
+	const decoded_t *trap = d + 1;
+	if(!vm->steps || !still_fusable(trap, FORM_PUTS))
+	{
+		h_lea(vm, d);
+		return;
+	}
+	vm->steps--;
+	vm->reg[d->r0] = vm->reg[R_PC] + d->imm;
+	update_flags(vm, d->r0);
+	vm->reg[R_PC]++;
+	op_trap(vm, trap->instr);
+}
+
+#undef FORM_ADD_IMM
+#undef FORM_BR
+#undef FORM_STR
+#undef FORM_PUTS
+
+// Fill in a cache entry for instr, found at address pc
+static void decode_instr(lc3_vm *vm, decoded_t *d, uint16_t pc, uint16_t instr)
+{
+	d->instr = instr;
+	d->r0 = (instr >> 9) & 0x7;
+	d->r1 = (instr >> 6) & 0x7;
+	d->r2 = instr & 0x7;
+	d->imm = 0;
+	
+	int imm_flag = (instr >> 5) & 0x1;
+	switch(instr >> 12)
+	{
+		case OP_ADD:
+			d->imm = sign_extend(instr & 0x1F, 5);
+			d->fn = imm_flag ? h_add_imm : h_add_reg;
+			break;
+		case OP_AND:
+			d->imm = sign_extend(instr & 0x1F, 5);
+			d->fn = imm_flag ? h_and_imm : h_and_reg;
+			break;
+		case OP_NOT:
+			d->fn = h_not;
+			break;
+		case OP_BR:
+			d->imm = sign_extend(instr & 0x1FF, 9);
+			if(vm->icache_jit)
+			{
+				d->fn = d->r0 == 0x7 ? h_br_always_jit : d->r0 == 0 ? h_nop : h_br_jit;
+			}
+			else
+			{
+				d->fn = d->r0 == 0x7 ? h_br_always : d->r0 == 0 ? h_nop : h_br;
+			}
+			break;
+		case OP_JMP:
+			d->fn = vm->icache_jit ? h_jmp_jit : h_jmp;
+			break;
+		case OP_JSR:
+			d->imm = sign_extend(instr & 0x7FF, 11);
+			if(vm->icache_jit)
+			{
+				d->fn = ((instr >> 11) & 0x1) ? h_jsr_jit : h_jsrr_jit;
+			}
+			else
+			{
+				d->fn = ((instr >> 11) & 0x1) ? h_jsr : h_jsrr;
+			}
+			break;
+		case OP_LD:
+			d->imm = sign_extend(instr & 0x1FF, 9);
+			d->fn = h_ld;
+			if((uint16_t)(pc + 1 + d->imm) < MMIO_BASE)
+			{
+				d->imm += pc + 1; // absolute address
+				d->fn = h_ld_direct;
+			}
+			break;
+		case OP_LDI:
+			d->fn = h_ldi;
+			break;
+		case OP_LDR:
+			d->imm = sign_extend(instr & 0x3F, 6);
+			d->fn = h_ldr;
+			break;
+		case OP_LEA:
+			d->imm = sign_extend(instr & 0x1FF, 9);
+			d->fn = h_lea;
+			break;
+		case OP_ST:
+			d->imm = sign_extend(instr & 0x1FF, 9);
+			d->fn = h_st;
+			if((uint16_t)(pc + 1 + d->imm) < MMIO_BASE)
+			{
+				d->imm += pc + 1; // absolute address
+				d->fn = h_st_direct;
+			}
+			break;
+		case OP_STI:
+			d->fn = h_sti;
+			break;
+		case OP_STR:
+			d->imm = sign_extend(instr & 0x3F, 6);
+			d->fn = h_str;
+			break;
+		case OP_TRAP:
+			d->fn = h_trap;
+			break;
+		case OP_RTI:
+			d->fn = h_rti;
+			break;
+		default:
+			d->fn = h_illegal;
+			break;
+	}
+}
+
+// Makes e (at pc, already decoded) a fused entry if it starts one of the idioms
+// above. The rest of the group is decoded right away so the fused handler
+// finds it ready.
+static void fuse_entry(lc3_vm *vm, decoded_t *e, uint16_t pc)
+{
+	if(pc + 2 >= MMIO_BASE)
+	{
+		return; // the group must be cached as a whole
+	}
+	uint16_t instr = e->instr;
+	uint16_t next = mem_fetch(vm, pc + 1);
+	uint16_t third = mem_fetch(vm, pc + 2);
+	int x = (instr >> 9) & 0x7;
+	int in_place = ((instr >> 6) & 0x7) == x; // SR1 is DR
+	
+	handler_fn fused = NULL;
+	int length = 2;
+	if(e->fn == h_and_imm && in_place && (instr & 0x1F) == 0 && (next & 0xFFE0) == (0x1020 | x << 9 | x << 6))
+	{
+		fused = h_fused_load_imm;
+	}
+	else if(e->fn == h_add_imm && in_place && (next >> 12) == OP_BR && (next >> 9) & 0x7 && !vm->icache_jit)
+	{
+		// not on the JIT tier, where the branch has to count as a hit on its target
+		fused = h_fused_add_br;
+	}
+	else if(e->fn == h_ldr && (next & 0xFFE0) == (0x1020 | x << 9 | x << 6) && third == (0x7000 | (instr & 0x0FFF)))
+	{
+		fused = h_fused_ldr_add_str;
+		length = 3;
+	}
+	else if(e->fn == h_lea && x == R_R0 && next == (0xF000 | TRAP_PUTS))
+	{
+		fused = h_fused_lea_puts;
+	}
+	if(!fused)
+	{
+		return;
+	}
+	
+	for(int i = 1; i < length; i++)
+	{
+		decoded_t *member = &vm->icache[pc + i];
+		if(member->fn == h_decode)
+		{
+			decode_instr(vm, member, pc + i, mem_fetch(vm, pc + i));
+		}
+	}
+	e->fn = fused;
+}
+
+// Handler for entries that have not been decoded yet (or were invalidated)
+static void h_decode(lc3_vm *vm, const decoded_t *d)
+{
+	uint16_t address = (uint16_t)(d - vm->icache);
+	if(address >= MMIO_BASE)
+	{
+		// Never cache the device page, devices change it behind mem_write()'s back
+		decoded_t tmp;
+		decode_instr(vm, &tmp, address, mem_fetch(vm, address));
+		tmp.fn(vm, &tmp);
+		return;
+	}
+	decoded_t *e = &vm->icache[address];
+	decode_instr(vm, e, address, mem_fetch(vm, address));
+	fuse_entry(vm, e, address);
+	e->fn(vm, e);
+}
+
+// Entry for a translated block start
+static void h_jit_enter(lc3_vm *vm, const decoded_t *d)
+{
+	uint16_t address = (uint16_t)(d - vm->icache);
+	jit_block_fn block = jit_block(vm->jit, address);
+	
+	if(!block)
+	{
+		h_decode(vm, d); // the block was dropped by a write elsewhere on its page
+		return;
+	}
+	
+	// Whole iterations only, so a block never runs past the step budget. The
+	// dispatch loop already took one step for this entry.
+	uint64_t max = (vm->steps + 1) / jit_block_length(vm->jit, address);
+	if(max == 0)
+	{
+		// Less budget left than the block is long: the first instruction on
+		// its own, and the entry stays for the next slice
+		decoded_t tmp;
+		decode_instr(vm, &tmp, address, mem_fetch(vm, address));
+		tmp.fn(vm, &tmp);
+		return;
+	}
+	if(max > JIT_LOOP_FUEL)
+	{
+		max = JIT_LOOP_FUEL;
+	}
+	vm->reg[R_PC] = address; // the block runs from its own first instruction
+	vm->reg[R_COND] = current_flags(vm); // native code keeps its own lazy flags and reads the real ones
+	uint32_t iterations = block(vm->reg, (uint32_t)max);
+	vm->steps -= (uint64_t)iterations * jit_block_length(vm->jit, address) - 1;
+	vm->cond_result = cond_value(vm->reg[R_COND]);
+}
+
+static void run_cached(lc3_vm *vm)
+{
+	while(vm->steps)
+	{
+		vm->steps--;
+		const decoded_t *d = &vm->icache[vm->reg[R_PC]++];
+		d->fn(vm, d);
+	}
+}
+
+
+
+
+static const char *const engine_names[ENGINE_COUNT] = { "switch", "threaded", "cached", "jit" };
+
+int parse_engine(const char *name)
+{
+	for(int i = 0; i < ENGINE_COUNT; i++)
+	{
+		if(strcmp(name, engine_names[i]) == 0)
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+const char *engine_name(int engine)
+{
+	return engine >= 0 && engine < ENGINE_COUNT ? engine_names[engine] : "?";
+}
+
+// Gets vm->icache (and vm->jit) ready for the cached engines, keeping
+// whatever is already decoded if the last run used the same tier
+static int prepare_icache(lc3_vm *vm, int use_jit)
+{
+	if(vm->icache && vm->icache_jit == use_jit)
+	{
+		return 1;
+	}
+	if(!vm->icache)
+	{
+		vm->icache = malloc(MEMORY_MAX * sizeof(decoded_t));
+		if(!vm->icache)
+		{
+			return 0;
+		}
+	}
+	if(use_jit && !vm->jit)
+	{
+		vm->jit = jit_create(vm->jit_pages);
+		if(!vm->jit)
+		{
+			use_jit = 0;
+		}
+	}
+	if(vm->jit)
+	{
+		jit_reset(vm->jit);
+	}
+	
+	// Start with nothing decoded, memory may have changed behind our back
+	for(int i = 0; i < MEMORY_MAX; i++)
+	{
+		vm->icache[i].fn = h_decode;
+	}
+	vm->icache_jit = use_jit;
+	
+	// Then decode what the analysis found to be code, exactly as h_decode() would on first fetch
+	if(vm->analysis)
+	{
+		for(uint16_t pc = 0; pc < MMIO_BASE; pc++)
+		{
+			decoded_t *e = &vm->icache[pc];
+			if(e->fn == h_decode && analysis_test(vm->analysis, ANALYSIS_CODE, pc))
+			{
+				decode_instr(vm, e, pc, mem_fetch(vm, pc));
+				fuse_entry(vm, e, pc);
+			}
+		}
+	}
+	return 1;
+}
+
+void run_engine(lc3_vm *vm, int engine)
+{
+	vm->cond_result = cond_value(vm->reg[R_COND]);
+	
+	if(vm->profile || vm->trace || (vm->until.conditions & (VM_UNTIL_PC | VM_UNTIL_INPUT)))
+	{
+		engine = ENGINE_SWITCH; // only the switch loop comes with profiling, tracing and watching built in
+	}
+	
+	switch(engine)
+	{
+		case ENGINE_JIT:
+		case ENGINE_CACHED:
+			if(prepare_icache(vm, engine == ENGINE_JIT && jit_supported()))
+			{
+				run_cached(vm);
+				break;
+			}
+			// no memory for the cache, the switch loop needs none
+			run_switch(vm);
+			break;
+		case ENGINE_THREADED:
+#ifdef LC3_THREADED_DISPATCH
+			run_threaded(vm);
+			break;
+#endif
+		case ENGINE_SWITCH:
+		default:
+			run_switch(vm);
+			break;
+	}
+	
+	vm->reg[R_COND] = current_flags(vm);
+}
+
+void engine_invalidate(lc3_vm *vm, uint16_t address, size_t count)
+{
+	for(size_t i = 0; i < count; i++)
+	{
+		uint16_t a = (uint16_t)(address + i);
+		invalidate_icache(vm, a);
+		if(vm->jit_pages[a >> JIT_PAGE_SHIFT])
+		{
+			jit_invalidate_page(vm->jit, a >> JIT_PAGE_SHIFT);
+		}
+	}
+}
+
+void engine_release(lc3_vm *vm)
+{
+	free(vm->icache);
+	vm->icache = NULL;
+	jit_destroy(vm->jit);
+	vm->jit = NULL;
+}
@@ -0,0 +1,220 @@
+/*
+
+Output.c
+
+Console output is collected here and only written out when the program is
+about to wait for input, halts, or fills the buffer, instead of one write
+per character. PUTS and PUTSP strings go into the buffer in blocks of eight
+words with SSE2 or NEON where the host has it, with a scalar loop for the
+block holding the terminator.
+
+*/
+
+
+#include <string.h>
+
+#include "Output.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <emmintrin.h>
+#define LC3_OUTPUT_SSE2
+#elif (defined(__ARM_NEON) || defined(__ARM_NEON__)) && !defined(__ARM_BIG_ENDIAN)
+#include <arm_neon.h>
+#define LC3_OUTPUT_NEON
+#endif
+
+#define OUTPUT_BLOCK 8 // words per vector step
+
+void output_init(lc3_output *out, output_write_fn write, void *user)
+{
+	out->used = 0;
+	out->unbuffered = 0;
+	out->written = 0;
+	out->write = write;
+	out->user = user;
+}
+
+void output_set_unbuffered(lc3_output *out, int unbuffered)
+{
+	out->unbuffered = unbuffered;
+}
+
+void output_flush(lc3_output *out)
+{
+	if(out->used == 0)
+	{
+		return;
+	}
+	out->write(out->user, out->buffer, out->used);
+	out->written += out->used;
+	out->used = 0;
+}
+
+void output_char(lc3_output *out, char c)
+{
+	out->buffer[out->used++] = c;
+	if(out->used == OUTPUT_BUFFER_SIZE || out->unbuffered)
+	{
+		output_flush(out);
+	}
+}
+
+void output_bytes(lc3_output *out, const char *bytes, size_t count)
+{
+	while(count > 0)
+	{
+		size_t n = OUTPUT_BUFFER_SIZE - out->used;
+		if(n > count)
+		{
+			n = count;
+		}
+		memcpy(out->buffer + out->used, bytes, n);
+		out->used += n;
+		bytes += n;
+		count -= n;
+		if(out->used == OUTPUT_BUFFER_SIZE)
+		{
+			output_flush(out);
+		}
+	}
+	if(out->unbuffered)
+	{
+		output_flush(out);
+	}
+}
+
+
+
+// STRINGS
+
+// Narrows blocks of words into dst as long as a whole block has no zero word,
+// returns the words taken, a multiple of OUTPUT_BLOCK no larger than count
+static size_t narrow_blocks(char *dst, const uint16_t *words, size_t count)
+{
+	size_t n = 0;
+#if defined(LC3_OUTPUT_SSE2)
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i low = _mm_set1_epi16(0xFF);
+	for(; n + OUTPUT_BLOCK <= count; n += OUTPUT_BLOCK)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(words + n));
+		if(_mm_movemask_epi8(_mm_cmpeq_epi16(v, zero)))
+		{
+			break;
+		}
+		// (char)word keeps the low byte, masking first stops the pack from saturating
+		_mm_storel_epi64((__m128i *)(dst + n), _mm_packus_epi16(_mm_and_si128(v, low), zero));
+	}
+#elif defined(LC3_OUTPUT_NEON)
+	for(; n + OUTPUT_BLOCK <= count; n += OUTPUT_BLOCK)
+	{
+		uint16x8_t v = vld1q_u16(words + n);
+		if(vget_lane_u64(vreinterpret_u64_u8(vmovn_u16(vceqq_u16(v, vdupq_n_u16(0)))), 0))
+		{
+			break;
+		}
+		vst1_u8((uint8_t *)(dst + n), vmovn_u16(v));
+	}
+#endif
+	return n;
+}
+
+// Copies blocks of packed words to dst, two bytes each, as long as a whole
+// block has no zero byte, returns the words taken like narrow_blocks()
+static size_t unpack_blocks(char *dst, const uint16_t *words, size_t count)
+{
+	size_t n = 0;
+#if defined(LC3_OUTPUT_SSE2) || defined(LC3_OUTPUT_NEON)
+	// Low byte first is the little-endian layout already, so a clean block is a plain copy
+	for(; n + OUTPUT_BLOCK <= count; n += OUTPUT_BLOCK)
+	{
+#if defined(LC3_OUTPUT_SSE2)
+		__m128i v = _mm_loadu_si128((const __m128i *)(words + n));
+		if(_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())))
+		{
+			break;
+		}
+		_mm_storeu_si128((__m128i *)(dst + 2 * n), v);
+#else
+		uint8x16_t v = vld1q_u8((const uint8_t *)(words + n));
+		uint8x8_t zeros = vmovn_u16(vreinterpretq_u16_u8(vceqq_u8(v, vdupq_n_u8(0))));
+		if(vget_lane_u64(vreinterpret_u64_u8(zeros), 0))
+		{
+			break;
+		}
+		vst1q_u8((uint8_t *)(dst + 2 * n), v);
+#endif
+	}
+#endif
+	return n;
+}
+
+size_t output_words(lc3_output *out, const uint16_t *words, size_t max)
+{
+	// Narrow straight into the buffer, the terminal sees one write per string
+	size_t n = 0;
+	for(;;)
+	{
+		char *p = out->buffer + out->used;
+		char *end = out->buffer + OUTPUT_BUFFER_SIZE;
+		while(p < end && n < max && words[n])
+		{
+			size_t room = (size_t)(end - p) < max - n ? (size_t)(end - p) : max - n;
+			size_t taken = narrow_blocks(p, words + n, room);
+			p += taken;
+			n += taken;
+			// The block the vector loop stopped at, or what was left over
+			for(size_t stop = n + OUTPUT_BLOCK; p < end && n < max && n < stop && words[n]; )
+			{
+				*p++ = (char)words[n++];
+			}
+		}
+		out->used = (size_t)(p - out->buffer);
+		if(n == max || !words[n])
+		{
+			break;
+		}
+		output_flush(out);
+	}
+	if(out->unbuffered)
+	{
+		output_flush(out);
+	}
+	return n;
+}
+
+size_t output_packed(lc3_output *out, const uint16_t *words, size_t max)
+{
+	size_t n = 0;
+	for(;;)
+	{
+		char *p = out->buffer + out->used;
+		char *end = out->buffer + OUTPUT_BUFFER_SIZE - 1; // room for both bytes of a word
+		while(p < end && n < max && words[n])
+		{
+			size_t room = (size_t)(end - p) / 2 < max - n ? (size_t)(end - p) / 2 : max - n;
+			size_t taken = unpack_blocks(p, words + n, room);
+			p += 2 * taken;
+			n += taken;
+			for(size_t stop = n + OUTPUT_BLOCK; p < end && n < max && n < stop && words[n]; ++n)
+			{
+				*p++ = (char)(words[n] & 0xFF);
+				if(words[n] >> 8)
+				{
+					*p++ = (char)(words[n] >> 8);
+				}
+			}
+		}
+		out->used = (size_t)(p - out->buffer);
+		if(n == max || !words[n])
+		{
+			break;
+		}
+		output_flush(out);
+	}
+	if(out->unbuffered)
+	{
+		output_flush(out);
+	}
+	return n;
+}
@@ -0,0 +1,56 @@
+/*
+
+Output.h
+
+Buffered console output for the output traps and the display device
+
+*/
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+typedef void (*output_write_fn)(void *user, const char *bytes, size_t count);
+
+// One machine's pending output
+typedef struct
+{
+	char buffer[OUTPUT_BUFFER_SIZE];
+	size_t used;
+	int unbuffered;			// write out after every call
+	uint64_t written;		// bytes written out over the machine's lifetime
+	output_write_fn write;
+	void *user;
+} lc3_output;
+
+void output_init(lc3_output *out, output_write_fn write, void *user);
+
+// With unbuffered set every output call is written out before it returns
+void output_set_unbuffered(lc3_output *out, int unbuffered);
+
+void output_char(lc3_output *out, char c);
+void output_bytes(lc3_output *out, const char *bytes, size_t count);
+
+// One character per word up to the first zero word (TRAP_PUTS) or max words,
+// returns the words written, so max when no terminator was seen
+size_t output_words(lc3_output *out, const uint16_t *words, size_t max);
+
+// Two characters per word, low byte first, otherwise like output_words() (TRAP_PUTSP)
+size_t output_packed(lc3_output *out, const uint16_t *words, size_t max);
+
+// Writes out everything buffered so far, called before anything waits for input
+void output_flush(lc3_output *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
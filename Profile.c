@@ -0,0 +1,258 @@
+/*
+
+Profile.c
+
+Call tree bookkeeping and the --profile reports
+
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Profile.h"
+
+#define PROFILE_INDEX_SIZE (PROFILE_MAX_NODES * 2) // power of two, at most half full
+#define PROFILE_TOP_PCS 50
+
+static const char *const opcode_names[16] =
+{
+	"BR", "ADD", "LD", "ST", "JSR", "AND", "LDR", "STR",
+	"RTI", "NOT", "LDI", "STI", "JMP", "RES", "LEA", "TRAP"
+};
+
+
+
+// CALL TREE
+
+int profile_enable(lc3_vm *vm)
+{
+	lc3_profile *p = calloc(1, sizeof(*p));
+	if(!p)
+	{
+		return 0;
+	}
+	p->nodes = malloc(PROFILE_MAX_NODES * sizeof(profile_node));
+	p->node_index = calloc(PROFILE_INDEX_SIZE, sizeof(uint32_t));
+	if(!p->nodes || !p->node_index)
+	{
+		free(p->nodes);
+		free(p->node_index);
+		free(p);
+		return 0;
+	}
+	p->nodes[0].parent = 0;
+	p->nodes[0].function = vm->reg[R_PC];
+	p->nodes[0].instructions = 0;
+	p->node_count = 1;
+	
+	profile_release(vm);
+	vm->profile = p;
+	return 1;
+}
+
+void profile_release(lc3_vm *vm)
+{
+	if(vm->profile)
+	{
+		free(vm->profile->nodes);
+		free(vm->profile->node_index);
+		free(vm->profile);
+		vm->profile = NULL;
+	}
+}
+
+// The node for function called with parent on the stack, created on first use
+static uint32_t child_node(lc3_profile *p, uint32_t parent, uint16_t function)
+{
+	uint32_t slot = (parent * 0x9E3779B1u ^ function * 0x85EBCA6Bu) & (PROFILE_INDEX_SIZE - 1);
+	for(;;)
+	{
+		uint32_t entry = p->node_index[slot];
+		if(entry == 0)
+		{
+			break;
+		}
+		const profile_node *node = &p->nodes[entry - 1];
+		if(node->parent == parent && node->function == function)
+		{
+			return entry - 1;
+		}
+		slot = (slot + 1) & (PROFILE_INDEX_SIZE - 1);
+	}
+	if(p->node_count == PROFILE_MAX_NODES)
+	{
+		return parent;
+	}
+	uint32_t n = p->node_count++;
+	p->nodes[n].parent = parent;
+	p->nodes[n].function = function;
+	p->nodes[n].instructions = 0;
+	p->node_index[slot] = n + 1;
+	return n;
+}
+
+void profile_call(lc3_profile *p, uint16_t target, uint16_t return_address)
+{
+	if(p->depth == PROFILE_MAX_DEPTH)
+	{
+		return;
+	}
+	p->stack[p->depth].caller = p->current;
+	p->stack[p->depth].return_address = return_address;
+	p->depth++;
+	p->current = child_node(p, p->current, target);
+}
+
+
+
+// REPORTS
+
+static double percent(uint64_t part, uint64_t total)
+{
+	return total ? 100.0 * (double)part / (double)total : 0.0;
+}
+
+static const char *trap_name(int vector)
+{
+	switch(vector)
+	{
+		case TRAP_GETC:		return "GETC";
+		case TRAP_OUT:		return "OUT";
+		case TRAP_PUTS:		return "PUTS";
+		case TRAP_IN:		return "IN";
+		case TRAP_PUTSP:	return "PUTSP";
+		case TRAP_HALT:		return "HALT";
+		default:			return "";
+	}
+}
+
+static void write_flat(const lc3_vm *vm, FILE *file)
+{
+	const lc3_profile *p = vm->profile;
+	uint64_t total = 0;
+	for(int op = 0; op < 16; op++)
+	{
+		total += p->opcodes[op];
+	}
+	
+	fprintf(file, "instructions %llu\n", (unsigned long long)total);
+	fprintf(file, "key reads %llu, %.6f s blocked\n", (unsigned long long)p->key_reads, p->key_read_seconds);
+	fprintf(file, "key checks %llu, %.6f s\n", (unsigned long long)p->key_checks, p->key_check_seconds);
+	
+	fprintf(file, "\nopcode         count       %%\n");
+	for(int op = 0; op < 16; op++)
+	{
+		if(p->opcodes[op])
+		{
+			fprintf(file, "%-6s %13llu  %6.2f\n", opcode_names[op],
+				(unsigned long long)p->opcodes[op], percent(p->opcodes[op], total));
+		}
+	}
+	
+	fprintf(file, "\ntrap           count\n");
+	for(int vector = 0; vector < 256; vector++)
+	{
+		if(p->traps[vector])
+		{
+			fprintf(file, "x%02X %-6s %10llu\n", vector, trap_name(vector), (unsigned long long)p->traps[vector]);
+		}
+	}
+	
+	// Selection of the hottest addresses, the table is too big to sort whole
+	fprintf(file, "\npc      instr          count       %%\n");
+	uint8_t *shown = calloc(MEMORY_MAX, 1);
+	for(int rank = 0; shown && rank < PROFILE_TOP_PCS; rank++)
+	{
+		int best = -1;
+		for(int pc = 0; pc < MEMORY_MAX; pc++)
+		{
+			if(p->pcs[pc] && !shown[pc] && (best < 0 || p->pcs[pc] > p->pcs[best]))
+			{
+				best = pc;
+			}
+		}
+		if(best < 0)
+		{
+			break;
+		}
+		shown[best] = 1;
+		uint16_t instr = memory_peek(vm, (uint16_t)best);
+		fprintf(file, "x%04X   x%04X %-4s %11llu  %6.2f\n", best, instr, opcode_names[instr >> 12],
+			(unsigned long long)p->pcs[best], percent(p->pcs[best], total));
+	}
+	free(shown);
+}
+
+static void write_folded(const lc3_profile *p, FILE *file)
+{
+	uint16_t path[PROFILE_MAX_DEPTH + 1];
+	for(uint32_t n = 0; n < p->node_count; n++)
+	{
+		if(p->nodes[n].instructions == 0)
+		{
+			continue;
+		}
+		
+		// Walk up to the root, then print root first
+		int depth = 0;
+		uint32_t node = n;
+		for(;;)
+		{
+			path[depth++] = p->nodes[node].function;
+			if(node == 0 || depth == PROFILE_MAX_DEPTH + 1)
+			{
+				break;
+			}
+			node = p->nodes[node].parent;
+		}
+		for(int i = depth - 1; i >= 0; i--)
+		{
+			fprintf(file, i ? "x%04X;" : "x%04X", path[i]);
+		}
+		fprintf(file, " %llu\n", (unsigned long long)p->nodes[n].instructions);
+	}
+}
+
+int profile_write(const lc3_vm *vm, const char *prefix)
+{
+	if(!vm->profile)
+	{
+		return 0;
+	}
+	size_t length = strlen(prefix);
+	char *path = malloc(length + sizeof(".folded"));
+	if(!path)
+	{
+		return 0;
+	}
+	
+	int ok = 1;
+	memcpy(path, prefix, length);
+	strcpy(path + length, ".txt");
+	FILE *file = fopen(path, "w");
+	if(file)
+	{
+		write_flat(vm, file);
+		ok &= fclose(file) == 0;
+	}
+	else
+	{
+		ok = 0;
+	}
+	
+	strcpy(path + length, ".folded");
+	file = fopen(path, "w");
+	if(file)
+	{
+		write_folded(vm->profile, file);
+		ok &= fclose(file) == 0;
+	}
+	else
+	{
+		ok = 0;
+	}
+	free(path);
+	return ok;
+}
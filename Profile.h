@@ -0,0 +1,97 @@
+/*
+
+Profile.h
+
+Instruction profiler for --profile. The profiled variant of the switch loop
+in Operations.c counts instructions and calls, every other loop is built
+without it. vm_check_key() and vm_read_key() in VM.c add the time spent
+waiting on the console, which is all that happens outside the loop.
+
+*/
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+
+#include "LC3.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PROFILE_MAX_DEPTH 256		// deeper calls are counted against the deepest frame
+#define PROFILE_MAX_NODES (1 << 16)	// distinct call paths, later new ones are folded into their caller
+
+// One distinct call path, function start addresses from the root down
+typedef struct
+{
+	uint32_t parent;
+	uint16_t function;
+	uint64_t instructions;	// retired with exactly this path on the stack
+} profile_node;
+
+typedef struct
+{
+	uint32_t caller;			// node to go back to
+	uint16_t return_address;	// R7 at the call
+} profile_frame;
+
+typedef struct lc3_profile
+{
+	uint64_t opcodes[16];
+	uint64_t traps[256];
+	uint64_t pcs[MEMORY_MAX];
+	
+	// Console input, see vm_check_key() and vm_read_key()
+	uint64_t key_checks;
+	uint64_t key_reads;
+	double key_check_seconds;
+	double key_read_seconds;
+	
+	// Call tree built from JSR/JSRR and the JMP that returns to R7
+	profile_node *nodes;
+	uint32_t node_count;
+	uint32_t *node_index;	// open addressing (parent, function) -> node + 1
+	profile_frame stack[PROFILE_MAX_DEPTH];
+	int depth;
+	uint32_t current;
+} lc3_profile;
+
+// Starts profiling every following vm_run(), the root of the call tree is the
+// current PC. Returns 0 without memory for it.
+int profile_enable(lc3_vm *vm);
+
+// Frees the profile, called by vm_destroy()
+void profile_release(lc3_vm *vm);
+
+// Writes prefix.txt (flat counts) and prefix.folded (collapsed stacks, one
+// "x3000;x3040 count" line per call path, for flamegraph.pl and the like).
+// Returns 0 if either can't be written.
+int profile_write(const lc3_vm *vm, const char *prefix);
+
+// Called by the profiled loop before an instruction at pc runs
+static inline void profile_instruction(lc3_profile *p, uint16_t pc, uint16_t instr)
+{
+	p->opcodes[instr >> 12]++;
+	p->pcs[pc]++;
+	p->nodes[p->current].instructions++;
+}
+
+// After a JSR/JSRR lands on target
+void profile_call(lc3_profile *p, uint16_t target, uint16_t return_address);
+
+// After a JMP lands on target, it returns from the innermost call if target is where that call came from
+static inline void profile_jump(lc3_profile *p, uint16_t target)
+{
+	if(p->depth > 0 && p->stack[p->depth - 1].return_address == target)
+	{
+		p->current = p->stack[--p->depth].caller;
+	}
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
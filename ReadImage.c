@@ -0,0 +1,413 @@
+/*
+
+ReadImage.c
+
+Image loading. The .obj file is mapped rather than read, and the big-endian
+words are converted into memory[] in one pass with the widest byte swap the
+host has (AVX2, SSE2 or NEON, with a scalar loop for the rest).
+
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "LC3.h"
+#include "ReadImage.h"
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#define LC3_SWAP_SSE2
+#if defined(__GNUC__) || defined(__AVX2__)
+#define LC3_SWAP_AVX2
+#endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define LC3_SWAP_NEON
+#endif
+
+
+
+// BYTE SWAPPING
+
+// Swap from big to little endian
+static inline uint16_t swap16(uint16_t x)
+{
+	return (x << 8) | (x >> 8);
+}
+
+static void swap_words_scalar(uint16_t *dst, const uint8_t *src, size_t count)
+{
+	for(size_t i = 0; i < count; i++)
+	{
+		dst[i] = (uint16_t)(src[2 * i] << 8 | src[2 * i + 1]);
+	}
+}
+
+#ifdef LC3_SWAP_AVX2
+
+#ifdef __GNUC__
+__attribute__((target("avx2")))
+#endif
+static void swap_words_avx2(uint16_t *dst, const uint8_t *src, size_t count)
+{
+	const __m256i shuffle = _mm256_setr_epi8(
+		1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+		1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+	size_t i = 0;
+	for(; i + 16 <= count; i += 16)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i *)(src + 2 * i));
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_shuffle_epi8(v, shuffle));
+	}
+	swap_words_scalar(dst + i, src + 2 * i, count - i);
+}
+
+#endif
+
+#ifdef LC3_SWAP_SSE2
+
+// SSE2 is always there on x86-64, shifting each lane both ways is as fast as a shuffle
+static void swap_words_sse2(uint16_t *dst, const uint8_t *src, size_t count)
+{
+	size_t i = 0;
+	for(; i + 8 <= count; i += 8)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		_mm_storeu_si128((__m128i *)(dst + i), v);
+	}
+	swap_words_scalar(dst + i, src + 2 * i, count - i);
+}
+
+#endif
+
+#ifdef LC3_SWAP_NEON
+
+static void swap_words_neon(uint16_t *dst, const uint8_t *src, size_t count)
+{
+	size_t i = 0;
+	for(; i + 8 <= count; i += 8)
+	{
+		uint8x16_t v = vld1q_u8(src + 2 * i);
+		vst1q_u8((uint8_t *)(dst + i), vrev16q_u8(v));
+	}
+	swap_words_scalar(dst + i, src + 2 * i, count - i);
+}
+
+#endif
+
+void swap_words(uint16_t *dst, const uint8_t *src, size_t count)
+{
+#if defined(LC3_SWAP_AVX2) && defined(__GNUC__)
+	if(__builtin_cpu_supports("avx2"))
+	{
+		swap_words_avx2(dst, src, count);
+		return;
+	}
+#elif defined(LC3_SWAP_AVX2)
+	swap_words_avx2(dst, src, count);
+	return;
+#endif
+#if defined(LC3_SWAP_SSE2)
+	swap_words_sse2(dst, src, count);
+#elif defined(LC3_SWAP_NEON)
+	swap_words_neon(dst, src, count);
+#else
+	swap_words_scalar(dst, src, count);
+#endif
+}
+
+
+
+// FILE MAPPING
+
+int map_file(mapped_file *m, const char *path)
+{
+#ifdef _WIN32
+	m->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(m->file == INVALID_HANDLE_VALUE)
+	{
+		return 0;
+	}
+	LARGE_INTEGER size;
+	if(!GetFileSizeEx(m->file, &size) || size.QuadPart == 0)
+	{
+		CloseHandle(m->file);
+		return 0;
+	}
+	m->size = (size_t)size.QuadPart;
+	m->mapping = CreateFileMappingA(m->file, NULL, PAGE_READONLY, 0, 0, NULL);
+	m->data = m->mapping ? MapViewOfFile(m->mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+	if(!m->data)
+	{
+		if(m->mapping)
+		{
+			CloseHandle(m->mapping);
+		}
+		CloseHandle(m->file);
+		return 0;
+	}
+	return 1;
+#else
+	int fd = open(path, O_RDONLY);
+	if(fd < 0)
+	{
+		return 0;
+	}
+	struct stat st;
+	if(fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		close(fd);
+		return 0;
+	}
+	m->size = (size_t)st.st_size;
+	void *p = mmap(NULL, m->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd); /* the mapping keeps the file alive */
+	if(p == MAP_FAILED)
+	{
+		return 0;
+	}
+	m->data = p;
+	return 1;
+#endif
+}
+
+void unmap_file(mapped_file *m)
+{
+#ifdef _WIN32
+	UnmapViewOfFile(m->data);
+	CloseHandle(m->mapping);
+	CloseHandle(m->file);
+#else
+	munmap((void *)m->data, m->size);
+#endif
+}
+
+// Reads a whole file into a zero-terminated buffer, NULL if it can't be read
+char *read_file(const char *path, size_t *size)
+{
+	FILE *file = fopen(path, "rb");
+	if(!file)
+	{
+		return NULL;
+	}
+	size_t capacity = 4096, used = 0;
+	char *data = malloc(capacity);
+	while(data)
+	{
+		used += fread(data + used, 1, capacity - used - 1, file);
+		if(used < capacity - 1)
+		{
+			break;
+		}
+		char *bigger = realloc(data, capacity * 2);
+		if(!bigger)
+		{
+			free(data);
+			data = NULL;
+			break;
+		}
+		data = bigger;
+		capacity *= 2;
+	}
+	int failed = ferror(file);
+	fclose(file);
+	if(!data || failed)
+	{
+		free(data);
+		return NULL;
+	}
+	data[used] = '\0';
+	*size = used;
+	return data;
+}
+
+// Origin and word count of a mapped image, 0 if it is too short to have an origin
+static int image_extent(const mapped_file *m, uint16_t *origin, size_t *length)
+{
+	if(m->size < 2)
+	{
+		return 0;
+	}
+	*origin = (uint16_t)(m->data[0] << 8 | m->data[1]);
+	
+	// Anything past the end of memory is dropped
+	*length = (m->size - 2) / 2;
+	if(*length > (size_t)(MEMORY_MAX - *origin))
+	{
+		*length = MEMORY_MAX - *origin;
+	}
+	return 1;
+}
+
+
+
+// LOADING
+
+// Fallback for things that can't be mapped, such as pipes
+static int read_image_file(uint16_t *memory, FILE *file, uint16_t *origin, size_t *length)
+{
+	// The origin tells us where in memory to place the image
+	if(fread(origin, sizeof(*origin), 1, file) != 1)
+	{
+		return 0;
+	}
+	*origin = swap16(*origin);
+	
+	// We know the max file size so we only need one fread
+	size_t max_read = MEMORY_MAX - *origin;
+	uint16_t *p = memory + *origin;
+	*length = fread(p, sizeof(uint16_t), max_read, file);
+	
+	// Swap to little endian
+	swap_words(p, (const uint8_t *)p, *length);
+	return 1;
+}
+
+int read_image(uint16_t *memory, const char *image_path, uint16_t *origin, size_t *length)
+{
+	mapped_file m;
+	if(map_file(&m, image_path))
+	{
+		int ok = image_extent(&m, origin, length);
+		if(ok)
+		{
+			swap_words(memory + *origin, m.data + 2, *length);
+		}
+		unmap_file(&m);
+		return ok;
+	}
+	
+	FILE* file = fopen(image_path, "rb");
+	if(!file) { return 0; }
+	int ok = read_image_file(memory, file, origin, length);
+	fclose(file);
+	return ok;
+}
+
+
+
+// SHARED IMAGES
+
+// Every image acquired so far, looked up by path. No lock, see ReadImage.h.
+static lc3_image *images = NULL;
+
+// Lets go of what image_load() read the file into
+static void release_image_file(mapped_file *m, char *buffer)
+{
+	if(buffer)
+	{
+		free(buffer);
+		return;
+	}
+	unmap_file(m);
+}
+
+lc3_image *image_load(const char *image_path)
+{
+	mapped_file m;
+	char *buffer = NULL; // the whole file, for things that can't be mapped such as pipes
+	uint16_t origin;
+	size_t length;
+	if(!map_file(&m, image_path))
+	{
+		size_t size;
+		buffer = read_file(image_path, &size);
+		if(!buffer)
+		{
+			return NULL;
+		}
+		m.data = (const uint8_t *)buffer;
+		m.size = size;
+	}
+	if(!image_extent(&m, &origin, &length))
+	{
+		release_image_file(&m, buffer);
+		return NULL;
+	}
+	
+	unsigned first_page = origin >> MEMORY_PAGE_SHIFT;
+	unsigned page_count = length ? (unsigned)((origin + length - 1) >> MEMORY_PAGE_SHIFT) - first_page + 1 : 0;
+	lc3_image *image = malloc(sizeof(*image));
+	uint16_t *pages = calloc(page_count ? page_count : 1, MEMORY_PAGE_SIZE * sizeof(uint16_t));
+	char *path = malloc(strlen(image_path) + 1);
+	if(!image || !pages || !path)
+	{
+		release_image_file(&m, buffer);
+		free(image);
+		free(pages);
+		free(path);
+		return NULL;
+	}
+	uint16_t *words = pages + (origin & MEMORY_PAGE_MASK);
+	swap_words(words, m.data + 2, length);
+	release_image_file(&m, buffer);
+	
+	image->path = strcpy(path, image_path);
+	image->origin = origin;
+	image->length = length;
+	image->words = words;
+	image->pages = pages;
+	image->first_page = first_page;
+	image->page_count = page_count;
+	image->refs = 1;
+	image->next = NULL;
+	return image;
+}
+
+void image_free(lc3_image *image)
+{
+	if(image)
+	{
+		free((void *)image->pages);
+		free(image->path);
+		free(image);
+	}
+}
+
+const lc3_image *image_acquire(const char *image_path)
+{
+	for(lc3_image *image = images; image; image = image->next)
+	{
+		if(strcmp(image->path, image_path) == 0)
+		{
+			image->refs++;
+			return image;
+		}
+	}
+	
+	lc3_image *image = image_load(image_path);
+	if(image)
+	{
+		image->next = images;
+		images = image;
+	}
+	return image;
+}
+
+void image_release(const lc3_image *image)
+{
+	for(lc3_image **link = &images; *link; link = &(*link)->next)
+	{
+		if(*link == image)
+		{
+			if(--(*link)->refs == 0)
+			{
+				*link = image->next;
+				image_free((lc3_image *)image);
+			}
+			return;
+		}
+	}
+}
@@ -0,0 +1,87 @@
+/*
+
+ReadImage.h
+
+Loading LC-3 object images. An image file is a big-endian origin word
+followed by the big-endian words to place there.
+
+*/
+
+#ifndef READ_IMAGE_H
+#define READ_IMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Loads an image file into memory (MEMORY_MAX words) and tells where its
+// words went, returns 0 if it can't be read
+int read_image(uint16_t *memory, const char *image_path, uint16_t *origin, size_t *length);
+
+// Converts count big-endian words at src into host order at dst
+void swap_words(uint16_t *dst, const uint8_t *src, size_t count);
+
+
+
+// FILE MAPPING
+
+// A whole file mapped read-only
+typedef struct
+{
+	const uint8_t *data;
+	size_t size;
+#ifdef _WIN32
+	void *file;		// HANDLEs
+	void *mapping;
+#endif
+} mapped_file;
+
+// Returns 0 if the file can't be opened or is empty
+int map_file(mapped_file *m, const char *path);
+void unmap_file(mapped_file *m);
+
+// Reads a whole file into a zero-terminated buffer from malloc(), NULL if it can't be read
+char *read_file(const char *path, size_t *size);
+
+
+
+// SHARED IMAGES
+
+// A converted, read-only copy of an image file that any number of machines
+// can load without touching the file again. The words sit at their offset in
+// zero-filled whole memory pages so paged machines can map them directly.
+typedef struct lc3_image
+{
+	char *path;
+	uint16_t origin;
+	size_t length;			// words starting at origin
+	const uint16_t *words;	// host order, never written after loading
+	const uint16_t *pages;	// page_count pages from first_page, words points into them
+	unsigned first_page;
+	unsigned page_count;
+	int refs;
+	struct lc3_image *next;
+} lc3_image;
+
+// Reads an image file into a new lc3_image of its own, NULL if it can't be read
+lc3_image *image_load(const char *image_path);
+void image_free(lc3_image *image);
+
+// The shared copies are kept in one list with no lock around it, so
+// image_acquire() and image_release() are for one thread only, the one
+// reading a batch manifest. image_load() and image_free() share nothing.
+
+// Returns the shared copy of an image file, loading and converting it on first use
+const lc3_image *image_acquire(const char *image_path);
+
+// Drops a reference, the copy is freed with the last one
+void image_release(const lc3_image *image);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
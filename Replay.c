@@ -0,0 +1,229 @@
+/*
+
+Replay.c
+
+Input logs. Recording sits between the machine and whatever console it was
+created with and writes down what it answered; replaying answers from the
+log alone. vm_instruction_count() is exact at every poll and read under
+every engine, so a log taken with one engine replays under any other.
+
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Replay.h"
+
+#define REPLAY_READY -1 // event.key for a poll that saw a key waiting
+
+typedef struct
+{
+	uint64_t instructions;
+	int32_t key;
+} input_event;
+
+
+
+// RECORDING
+
+typedef struct
+{
+	lc3_io inner;
+	lc3_vm *vm;
+	FILE *log;
+} input_recorder;
+
+static int record_check_key(void *user)
+{
+	input_recorder *recorder = user;
+	int key = recorder->inner.check_key(recorder->inner.user);
+	if(key)
+	{
+		fprintf(recorder->log, "%llu ready\n", (unsigned long long)vm_instruction_count(recorder->vm));
+	}
+	return key;
+}
+
+static uint16_t record_read_key(void *user)
+{
+	input_recorder *recorder = user;
+	uint16_t key = recorder->inner.read_key(recorder->inner.user);
+	fprintf(recorder->log, "%llu key %u\n", (unsigned long long)vm_instruction_count(recorder->vm), key);
+	return key;
+}
+
+static void record_write(void *user, const char *bytes, size_t count)
+{
+	input_recorder *recorder = user;
+	recorder->inner.write(recorder->inner.user, bytes, count);
+}
+
+static void record_close(void *user)
+{
+	input_recorder *recorder = user;
+	fclose(recorder->log);
+	if(recorder->inner.close)
+	{
+		recorder->inner.close(recorder->inner.user);
+	}
+	free(recorder);
+}
+
+int vm_record_input(lc3_vm *vm, const char *path)
+{
+	input_recorder *recorder = malloc(sizeof(*recorder));
+	if(!recorder)
+	{
+		return 0;
+	}
+	recorder->log = fopen(path, "w");
+	if(!recorder->log)
+	{
+		free(recorder);
+		return 0;
+	}
+	fprintf(recorder->log, "LC3 input %d\n", REPLAY_VERSION);
+	recorder->inner = vm->io;
+	recorder->vm = vm;
+
+	lc3_io io = { recorder, record_check_key, record_read_key, record_write, record_close };
+	vm->io = io; // vm->out keeps writing to the inner console directly
+	return 1;
+}
+
+
+
+// REPLAY
+
+typedef struct
+{
+	lc3_io inner;
+	lc3_vm *vm;
+	input_event *events;
+	size_t count;
+	size_t next;
+} input_player;
+
+static int replay_check_key(void *user)
+{
+	input_player *player = user;
+	if(player->next < player->count && player->events[player->next].key == REPLAY_READY
+		&& player->events[player->next].instructions <= vm_instruction_count(player->vm))
+	{
+		player->next++;
+		return 1;
+	}
+	return 0;
+}
+
+static uint16_t replay_read_key(void *user)
+{
+	input_player *player = user;
+	// A ready nobody polled for can only mean the run has drifted, the keys still come in order
+	while(player->next < player->count && player->events[player->next].key == REPLAY_READY)
+	{
+		player->next++;
+	}
+	if(player->next == player->count)
+	{
+		return (uint16_t)EOF;
+	}
+	return (uint16_t)player->events[player->next++].key;
+}
+
+static void replay_write(void *user, const char *bytes, size_t count)
+{
+	input_player *player = user;
+	player->inner.write(player->inner.user, bytes, count);
+}
+
+static void replay_close(void *user)
+{
+	input_player *player = user;
+	if(player->inner.close)
+	{
+		player->inner.close(player->inner.user);
+	}
+	free(player->events);
+	free(player);
+}
+
+// Reads the whole log, NULL if it isn't one
+static input_event *read_log(const char *path, size_t *count)
+{
+	FILE *log = fopen(path, "r");
+	if(!log)
+	{
+		return NULL;
+	}
+	int version;
+	if(fscanf(log, "LC3 input %d", &version) != 1 || version != REPLAY_VERSION)
+	{
+		fclose(log);
+		return NULL;
+	}
+
+	size_t capacity = 256;
+	input_event *events = malloc(capacity * sizeof(*events));
+	*count = 0;
+	unsigned long long instructions;
+	char kind[8];
+	while(events && fscanf(log, "%llu %7s", &instructions, kind) == 2)
+	{
+		input_event event = { instructions, REPLAY_READY };
+		unsigned key;
+		if(strcmp(kind, "key") == 0 && fscanf(log, "%u", &key) == 1 && key <= 0xFFFF)
+		{
+			event.key = (int32_t)key;
+		}
+		else if(strcmp(kind, "ready") != 0)
+		{
+			break;
+		}
+		if(*count == capacity)
+		{
+			capacity *= 2;
+			input_event *grown = realloc(events, capacity * sizeof(*events));
+			if(!grown)
+			{
+				free(events);
+				events = NULL;
+				break;
+			}
+			events = grown;
+		}
+		events[(*count)++] = event;
+	}
+	// Anything but a clean end of file is a damaged log
+	if(events && !feof(log))
+	{
+		free(events);
+		events = NULL;
+	}
+	fclose(log);
+	return events;
+}
+
+int vm_replay_input(lc3_vm *vm, const char *path)
+{
+	input_player *player = malloc(sizeof(*player));
+	if(!player)
+	{
+		return 0;
+	}
+	player->events = read_log(path, &player->count);
+	if(!player->events)
+	{
+		free(player);
+		return 0;
+	}
+	player->inner = vm->io;
+	player->vm = vm;
+	player->next = 0;
+
+	lc3_io io = { player, replay_check_key, replay_read_key, replay_write, replay_close };
+	vm->io = io;
+	return 1;
+}
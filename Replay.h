@@ -0,0 +1,41 @@
+/*
+
+Replay.h
+
+Recording the keyboard input a machine takes and feeding it back later
+
+*/
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include "LC3.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define REPLAY_VERSION 1
+
+// Wraps the machine's console so every key it is given is logged to path
+// with the instruction count it was taken at, returns 0 if path can't be
+// created. The log is a text file:
+//
+//	LC3 input 1
+//	<instructions> ready		KBSR (or GETC/IN) saw a key waiting
+//	<instructions> key <code>	KBDR (or GETC/IN) read it
+//
+// Polls that found nothing aren't logged, they are whatever isn't listed.
+int vm_record_input(lc3_vm *vm, const char *path);
+
+// Replaces the machine's console input with a log from vm_record_input(),
+// read into memory up front so the run makes no console calls for input.
+// Started from the same image or snapshot the run then repeats exactly,
+// under any engine. Returns 0 if path can't be read or isn't a log.
+int vm_replay_input(lc3_vm *vm, const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
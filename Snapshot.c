@@ -0,0 +1,232 @@
+/*
+
+Snapshot.c
+
+Snapshot files. Everything is little-endian and 4-byte aligned so a mapped
+file can be copied into memory run by run:
+
+	offset 0	magic "LC3SNAP\0"
+	8			u32 version (SNAPSHOT_VERSION)
+	12			u32 number of runs
+	16			u64 instructions retired
+	24			u16 reg[R_COUNT], R_PC and R_COND included
+	44			u16 psr (PSR_* bits)
+	46			u16 saved_sp
+	48			u8 irq_pending, raised interrupts not taken yet
+	49			u8 irq_vectors[8]
+	57			3 bytes of padding
+	60			runs
+
+Each run is a u32 origin and a u32 word count followed by the words, padded
+to a multiple of 4 bytes. Memory outside every run is zero, and most of it
+usually is, so only the stretches holding something are written.
+
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Analysis.h"
+#include "ReadImage.h"
+#include "Snapshot.h"
+
+#define SNAPSHOT_HEADER_SIZE 60
+#define SNAPSHOT_RUN_HEADER_SIZE 8
+#define SNAPSHOT_MIN_GAP 4 // zero words worth ending a run for, a run header costs 4 words
+
+static const char snapshot_magic[8] = "LC3SNAP";
+
+
+
+// LITTLE-ENDIAN FIELDS
+
+static void put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v & 0xFF;
+	p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+	put16(p, v & 0xFFFF);
+	put16(p + 2, v >> 16);
+}
+
+static uint16_t get16(const uint8_t *p)
+{
+	return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+	return get16(p) | (uint32_t)get16(p + 2) << 16;
+}
+
+static int host_is_little_endian(void)
+{
+	const uint16_t one = 1;
+	return *(const uint8_t *)&one;
+}
+
+
+
+// SAVING
+
+int vm_save_snapshot(lc3_vm *vm, const char *path)
+{
+	output_flush(&vm->out);
+	
+	// Worst case is one run over all of memory
+	size_t capacity = SNAPSHOT_HEADER_SIZE + SNAPSHOT_RUN_HEADER_SIZE + MEMORY_MAX * sizeof(uint16_t);
+	uint8_t *data = calloc(1, capacity);
+	if(!data)
+	{
+		return 0;
+	}
+	
+	memcpy(data, snapshot_magic, sizeof(snapshot_magic));
+	put32(data + 8, SNAPSHOT_VERSION);
+	put32(data + 16, (uint32_t)vm->instructions);
+	put32(data + 20, (uint32_t)(vm->instructions >> 32));
+	for(int r = 0; r < R_COUNT; r++)
+	{
+		put16(data + 24 + 2 * r, vm->reg[r]);
+	}
+	put16(data + 44, vm->psr);
+	put16(data + 46, vm->saved_sp);
+	data[48] = vm->irq_pending;
+	memcpy(data + 49, vm->irq_vectors, sizeof(vm->irq_vectors));
+	
+	size_t used = SNAPSHOT_HEADER_SIZE;
+	uint32_t runs = 0;
+	uint32_t address = 0;
+	while(address < MEMORY_MAX)
+	{
+		if(memory_peek(vm, (uint16_t)address) == 0)
+		{
+			address++;
+			continue;
+		}
+		
+		// The run ends at the last non-zero word before a long enough gap
+		uint32_t start = address, end = address + 1, zeros = 0;
+		for(address++; address < MEMORY_MAX && zeros < SNAPSHOT_MIN_GAP; address++)
+		{
+			if(memory_peek(vm, (uint16_t)address))
+			{
+				end = address + 1;
+				zeros = 0;
+			}
+			else
+			{
+				zeros++;
+			}
+		}
+		address = end;
+		
+		uint32_t length = end - start;
+		put32(data + used, start);
+		put32(data + used + 4, length);
+		used += SNAPSHOT_RUN_HEADER_SIZE;
+		for(uint32_t i = 0; i < length; i++)
+		{
+			put16(data + used + 2 * i, memory_peek(vm, (uint16_t)(start + i)));
+		}
+		used += (length * sizeof(uint16_t) + 3) & ~(size_t)3;
+		runs++;
+	}
+	put32(data + 12, runs);
+	
+	FILE *file = fopen(path, "wb");
+	int ok = file && fwrite(data, 1, used, file) == used;
+	if(file && fclose(file) != 0)
+	{
+		ok = 0;
+	}
+	free(data);
+	return ok;
+}
+
+
+
+// LOADING
+
+// Checks every run fits the file and memory before anything is touched
+static int snapshot_valid(const mapped_file *m, uint32_t runs)
+{
+	size_t at = SNAPSHOT_HEADER_SIZE;
+	for(uint32_t i = 0; i < runs; i++)
+	{
+		if(m->size - at < SNAPSHOT_RUN_HEADER_SIZE)
+		{
+			return 0;
+		}
+		uint32_t origin = get32(m->data + at), length = get32(m->data + at + 4);
+		at += SNAPSHOT_RUN_HEADER_SIZE;
+		size_t bytes = ((size_t)length * sizeof(uint16_t) + 3) & ~(size_t)3;
+		if(origin > MEMORY_MAX || length > MEMORY_MAX - origin || m->size - at < bytes)
+		{
+			return 0;
+		}
+		at += bytes;
+	}
+	return 1;
+}
+
+int vm_load_snapshot(lc3_vm *vm, const char *path)
+{
+	mapped_file m;
+	if(!map_file(&m, path))
+	{
+		return 0;
+	}
+	if(m.size < SNAPSHOT_HEADER_SIZE
+		|| memcmp(m.data, snapshot_magic, sizeof(snapshot_magic)) != 0
+		|| get32(m.data + 8) != SNAPSHOT_VERSION
+		|| !snapshot_valid(&m, get32(m.data + 12)))
+	{
+		unmap_file(&m);
+		return 0;
+	}
+	
+	memory_clear(vm);
+	uint32_t runs = get32(m.data + 12);
+	size_t at = SNAPSHOT_HEADER_SIZE;
+	for(uint32_t i = 0; i < runs; i++)
+	{
+		uint32_t origin = get32(m.data + at), length = get32(m.data + at + 4);
+		const uint8_t *words = m.data + at + SNAPSHOT_RUN_HEADER_SIZE;
+		if(host_is_little_endian())
+		{
+			memory_store(vm, (uint16_t)origin, (const uint16_t *)words, length); // runs are 4-byte aligned
+		}
+		else
+		{
+			for(uint32_t w = 0; w < length; w++)
+			{
+				memory_poke(vm, (uint16_t)(origin + w), get16(words + 2 * w));
+			}
+		}
+		at += SNAPSHOT_RUN_HEADER_SIZE + (((size_t)length * sizeof(uint16_t) + 3) & ~(size_t)3);
+	}
+	
+	for(int r = 0; r < R_COUNT; r++)
+	{
+		vm->reg[r] = get16(m.data + 24 + 2 * r);
+	}
+	vm->psr = get16(m.data + 44) & (PSR_USER | PSR_PRIORITY);
+	vm->saved_sp = get16(m.data + 46);
+	vm->irq_pending = m.data[48];
+	memcpy(vm->irq_vectors, m.data + 49, sizeof(vm->irq_vectors));
+	vm->interrupts = 1; // KBSR may have interrupts enabled, the first look settles it
+	vm->instructions = get32(m.data + 16) | (uint64_t)get32(m.data + 20) << 32;
+	unmap_file(&m);
+	
+	engine_invalidate(vm, 0, MEMORY_MAX); // everything may have changed
+	vm->image_hash = memory_hash(vm); // the images' words may be anywhere by now
+	analysis_free(vm->analysis);
+	vm->analysis = NULL;
+	return 1;
+}
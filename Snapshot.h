@@ -0,0 +1,34 @@
+/*
+
+Snapshot.h
+
+Saving and restoring the complete state of a machine
+
+*/
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "LC3.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SNAPSHOT_VERSION 3
+
+// Writes memory (device page included), the registers, the processor status,
+// interrupts raised but not taken yet and the instruction count to path,
+// returns 0 if it can't be written. Pending output is flushed first, keys the
+// console has already collected are not saved.
+int vm_save_snapshot(lc3_vm *vm, const char *path);
+
+// Replaces the machine's state with a snapshot, returns 0 (leaving the
+// machine alone) if path can't be read or isn't a snapshot of this version
+int vm_load_snapshot(lc3_vm *vm, const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
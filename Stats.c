@@ -0,0 +1,189 @@
+/*
+
+Stats.c
+
+vm_get_stats() and the optional Linux hardware counters behind it. Nothing
+here runs unless somebody asks for numbers.
+
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Stats.h"
+#include "Threads.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+struct lc3_perf
+{
+	int cycles;						// perf event descriptors
+	int branch_misses;
+	uint64_t start_instructions;	// vm_instruction_count() when counting started
+};
+
+
+
+// HARDWARE COUNTERS
+
+#ifdef __linux__
+// Counts event for the calling thread in user space only, -1 if not allowed
+static int perf_open(uint64_t event)
+{
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = event;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t perf_read(int fd)
+{
+	uint64_t value = 0;
+	if(read(fd, &value, sizeof(value)) != sizeof(value))
+	{
+		return 0;
+	}
+	return value;
+}
+#endif
+
+int vm_enable_perf_counters(lc3_vm *vm)
+{
+#ifdef __linux__
+	if(vm->perf)
+	{
+		return 1;
+	}
+	struct lc3_perf *perf = malloc(sizeof(*perf));
+	if(!perf)
+	{
+		return 0;
+	}
+	perf->cycles = perf_open(PERF_COUNT_HW_CPU_CYCLES);
+	perf->branch_misses = perf_open(PERF_COUNT_HW_BRANCH_MISSES);
+	if(perf->cycles < 0 || perf->branch_misses < 0)
+	{
+		if(perf->cycles >= 0)
+		{
+			close(perf->cycles);
+		}
+		if(perf->branch_misses >= 0)
+		{
+			close(perf->branch_misses);
+		}
+		free(perf);
+		return 0;
+	}
+	perf->start_instructions = vm_instruction_count(vm);
+	vm->perf = perf;
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+void stats_release(lc3_vm *vm)
+{
+	if(!vm->perf)
+	{
+		return;
+	}
+#ifdef __linux__
+	close(vm->perf->cycles);
+	close(vm->perf->branch_misses);
+#endif
+	free(vm->perf);
+	vm->perf = NULL;
+}
+
+
+
+// SNAPSHOT
+
+void vm_get_stats(const lc3_vm *vm, lc3_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	const lc3_counters *counters = &vm->counters;
+
+	stats->instructions = vm_instruction_count(vm);
+	stats->run_seconds = counters->run_seconds;
+	uint64_t timed = counters->timed_instructions;
+	if(counters->run_start > 0)
+	{
+		stats->run_seconds += monotonic_seconds() - counters->run_start;
+		timed += stats->instructions - counters->run_start_instructions;
+	}
+	if(stats->run_seconds > 0)
+	{
+		stats->mips = timed / stats->run_seconds / 1e6;
+	}
+	memcpy(stats->traps, counters->traps, sizeof(stats->traps));
+	for(int vector = 0; vector < 256; vector++)
+	{
+		stats->trap_total += counters->traps[vector];
+	}
+	stats->key_reads = counters->key_reads;
+	stats->key_wait_seconds = counters->key_wait_seconds;
+	stats->output_bytes = vm->out.written + vm->out.used;
+
+#ifdef __linux__
+	if(vm->perf)
+	{
+		stats->perf_counters = 1;
+		stats->cycles = perf_read(vm->perf->cycles);
+		stats->branch_misses = perf_read(vm->perf->branch_misses);
+		uint64_t counted = stats->instructions - vm->perf->start_instructions;
+		if(counted)
+		{
+			stats->cycles_per_instruction = (double)stats->cycles / counted;
+			stats->branch_misses_per_instruction = (double)stats->branch_misses / counted;
+		}
+	}
+#endif
+}
+
+int stats_format(const lc3_stats *stats, char *buffer, size_t size)
+{
+	size_t n = 0;
+
+	// Appends to buffer as far as it goes, n keeps the full length
+	#define STATS_PRINT(...) do { \
+		int written = snprintf(buffer + (n < size ? n : size), n < size ? size - n : 0, __VA_ARGS__); \
+		n += written > 0 ? (size_t)written : 0; \
+	} while(0)
+
+	STATS_PRINT("instructions %llu\n", (unsigned long long)stats->instructions);
+	STATS_PRINT("run_seconds %.3f\n", stats->run_seconds);
+	STATS_PRINT("mips %.2f\n", stats->mips);
+	STATS_PRINT("traps %llu\n", (unsigned long long)stats->trap_total);
+	for(int vector = 0; vector < 256; vector++)
+	{
+		if(stats->traps[vector])
+		{
+			STATS_PRINT("trap_x%02X %llu\n", vector, (unsigned long long)stats->traps[vector]);
+		}
+	}
+	STATS_PRINT("key_reads %llu\n", (unsigned long long)stats->key_reads);
+	STATS_PRINT("key_wait_seconds %.3f\n", stats->key_wait_seconds);
+	STATS_PRINT("output_bytes %llu\n", (unsigned long long)stats->output_bytes);
+	if(stats->perf_counters)
+	{
+		STATS_PRINT("cycles %llu\n", (unsigned long long)stats->cycles);
+		STATS_PRINT("branch_misses %llu\n", (unsigned long long)stats->branch_misses);
+		STATS_PRINT("cycles_per_instruction %.2f\n", stats->cycles_per_instruction);
+		STATS_PRINT("branch_misses_per_instruction %.4f\n", stats->branch_misses_per_instruction);
+	}
+
+	#undef STATS_PRINT
+	return (int)n;
+}
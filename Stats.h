@@ -0,0 +1,67 @@
+/*
+
+Stats.h
+
+Live numbers for long-running machines: instructions retired, MIPS, TRAPs
+by vector, time blocked on input and bytes written. All of it comes from
+counters the machine already keeps a vm_run() or a TRAP at a time, so the
+loop pays nothing for it. vm_get_stats() only reads, so the host or another
+thread can call it while the machine runs. None of it is async-signal-safe:
+the CLI's SIGUSR1 handler only sets a flag, and the stats are printed
+between vm_run_limited() slices.
+
+*/
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "LC3.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define STATS_TEXT_SIZE 16384 // enough for stats_format() with every trap vector in use
+
+typedef struct
+{
+	uint64_t instructions;		// retired, including the vm_run() in progress
+	double run_seconds;			// wall-clock time spent inside vm_run() calls of VM_TIMED_STEPS or more
+	double mips;				// instructions retired in those calls per run_seconds, in millions
+	uint64_t traps[256];		// TRAPs executed, by vector
+	uint64_t trap_total;
+	uint64_t key_reads;
+	double key_wait_seconds;	// blocked waiting for the console to answer a read
+	uint64_t output_bytes;		// written, including what is still buffered
+
+	// Hardware counters for the thread that called vm_enable_perf_counters()
+	int perf_counters;			// the rest is only valid when set
+	uint64_t cycles;
+	uint64_t branch_misses;
+	double cycles_per_instruction;	// both over the instructions retired since counting started
+	double branch_misses_per_instruction;
+} lc3_stats;
+
+// Fills stats from the machine as it is now
+void vm_get_stats(const lc3_vm *vm, lc3_stats *stats);
+
+// Starts counting host cycles and branch misses of the calling thread, so
+// stats can give them per LC-3 instruction. Linux only, 0 when the kernel
+// won't hand out the counters (perf_event_paranoid, containers) or elsewhere.
+int vm_enable_perf_counters(lc3_vm *vm);
+
+// One "name value" line per number into buffer (STATS_TEXT_SIZE is always enough),
+// returns the length like snprintf()
+int stats_format(const lc3_stats *stats, char *buffer, size_t size);
+
+// vm_destroy() calls this
+void stats_release(lc3_vm *vm);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,148 @@
+/*
+
+Threads.c
+
+Win32 and POSIX backends for Threads.h, picked at compile time
+
+*/
+
+
+#include <stdlib.h>
+
+#include "Threads.h"
+
+#ifndef _WIN32
+#include <time.h>
+#include <unistd.h>
+#endif
+
+// fn and arg travel to the new thread in here, it frees it
+typedef struct
+{
+	thread_fn fn;
+	void *arg;
+} thread_start_info;
+
+
+
+#ifdef _WIN32
+
+// WIN32 BACKEND
+
+static DWORD WINAPI thread_main(LPVOID param)
+{
+	thread_start_info info = *(thread_start_info *)param;
+	free(param);
+	info.fn(info.arg);
+	return 0;
+}
+
+int thread_start(lc3_thread *thread, thread_fn fn, void *arg)
+{
+	thread_start_info *info = malloc(sizeof(*info));
+	if(!info)
+	{
+		return 0;
+	}
+	info->fn = fn;
+	info->arg = arg;
+	*thread = CreateThread(NULL, 0, thread_main, info, 0, NULL);
+	if(!*thread)
+	{
+		free(info);
+		return 0;
+	}
+	return 1;
+}
+
+void thread_join(lc3_thread thread)
+{
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+}
+
+void mutex_init(lc3_mutex *mutex)		{ InitializeCriticalSection(mutex); }
+void mutex_destroy(lc3_mutex *mutex)	{ DeleteCriticalSection(mutex); }
+void mutex_lock(lc3_mutex *mutex)		{ EnterCriticalSection(mutex); }
+void mutex_unlock(lc3_mutex *mutex)		{ LeaveCriticalSection(mutex); }
+
+void cond_init(lc3_cond *cond)						{ InitializeConditionVariable(cond); }
+void cond_destroy(lc3_cond *cond)					{ (void)cond; } // nothing to free on Win32
+void cond_wait(lc3_cond *cond, lc3_mutex *mutex)	{ SleepConditionVariableCS(cond, mutex, INFINITE); }
+void cond_signal(lc3_cond *cond)					{ WakeConditionVariable(cond); }
+
+int cpu_count(void)
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+}
+
+double monotonic_seconds(void)
+{
+	LARGE_INTEGER now, frequency;
+	QueryPerformanceCounter(&now);
+	QueryPerformanceFrequency(&frequency);
+	return (double)now.QuadPart / (double)frequency.QuadPart;
+}
+
+
+
+#else
+
+// PTHREAD BACKEND
+
+static void *thread_main(void *param)
+{
+	thread_start_info info = *(thread_start_info *)param;
+	free(param);
+	info.fn(info.arg);
+	return NULL;
+}
+
+int thread_start(lc3_thread *thread, thread_fn fn, void *arg)
+{
+	thread_start_info *info = malloc(sizeof(*info));
+	if(!info)
+	{
+		return 0;
+	}
+	info->fn = fn;
+	info->arg = arg;
+	if(pthread_create(thread, NULL, thread_main, info) != 0)
+	{
+		free(info);
+		return 0;
+	}
+	return 1;
+}
+
+void thread_join(lc3_thread thread)
+{
+	pthread_join(thread, NULL);
+}
+
+void mutex_init(lc3_mutex *mutex)		{ pthread_mutex_init(mutex, NULL); }
+void mutex_destroy(lc3_mutex *mutex)	{ pthread_mutex_destroy(mutex); }
+void mutex_lock(lc3_mutex *mutex)		{ pthread_mutex_lock(mutex); }
+void mutex_unlock(lc3_mutex *mutex)		{ pthread_mutex_unlock(mutex); }
+
+void cond_init(lc3_cond *cond)						{ pthread_cond_init(cond, NULL); }
+void cond_destroy(lc3_cond *cond)					{ pthread_cond_destroy(cond); }
+void cond_wait(lc3_cond *cond, lc3_mutex *mutex)	{ pthread_cond_wait(cond, mutex); }
+void cond_signal(lc3_cond *cond)					{ pthread_cond_signal(cond); }
+
+int cpu_count(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int)n : 1;
+}
+
+double monotonic_seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#endif
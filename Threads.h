@@ -0,0 +1,51 @@
+/*
+
+Threads.h
+
+Minimal threads, mutexes, condition variables and a clock over Win32 and
+POSIX, for running several machines at once
+
+*/
+
+#ifndef THREADS_H
+#define THREADS_H
+
+#ifdef _WIN32
+#include <Windows.h>
+typedef HANDLE lc3_thread;
+typedef CRITICAL_SECTION lc3_mutex;
+typedef CONDITION_VARIABLE lc3_cond;
+#else
+#include <pthread.h>
+typedef pthread_t lc3_thread;
+typedef pthread_mutex_t lc3_mutex;
+typedef pthread_cond_t lc3_cond;
+#endif
+
+typedef void (*thread_fn)(void *arg);
+
+// Starts fn(arg) on a new thread, returns 0 if it couldn't be created
+int thread_start(lc3_thread *thread, thread_fn fn, void *arg);
+
+// Waits for the thread to return
+void thread_join(lc3_thread thread);
+
+void mutex_init(lc3_mutex *mutex);
+void mutex_destroy(lc3_mutex *mutex);
+void mutex_lock(lc3_mutex *mutex);
+void mutex_unlock(lc3_mutex *mutex);
+
+void cond_init(lc3_cond *cond);
+void cond_destroy(lc3_cond *cond);
+
+// Unlocks mutex, waits for a signal and locks it again. Wakeups can be spurious, check in a loop.
+void cond_wait(lc3_cond *cond, lc3_mutex *mutex);
+void cond_signal(lc3_cond *cond);
+
+// Logical processors available to the process, at least 1
+int cpu_count(void);
+
+// Seconds on a clock that never goes backwards, only differences mean anything
+double monotonic_seconds(void);
+
+#endif
@@ -0,0 +1,404 @@
+/*
+
+Trace.c
+
+The trace writer and the block codec. Records compress well because most
+of what they hold can be predicted from the ones before: PC usually went
+where it went from the previous PC last time, the word at a PC is the one
+seen there last time, a register usually moves by a small amount and the
+condition codes are usually the ones of the value just written, or
+unchanged when none was. Each record becomes a header byte saying which of
+those held, the fields that didn't, and the register's change as a zigzag
+varint, so a typical record takes under two bytes instead of eight. Every
+block starts from a fresh codec, so a damaged block doesn't take the rest
+of the file with it.
+
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Threads.h"
+#include "Trace.h"
+
+// Header byte of an encoded record
+#define CODE_PC_NEXT	0x01	// pc is the one that followed the previous record's last time
+#define CODE_INSTR_SEEN	0x02	// instr is the last one recorded at pc
+#define CODE_COND_GUESSED	0x04	// cond is what predicted_cond() says
+#define CODE_REG_SHIFT	3		// then the register, TRACE_NO_REG for none, in 4 bits
+
+struct trace_codec
+{
+	uint16_t pc;
+	uint8_t cond;
+	uint16_t reg[8];
+	uint16_t instr[MEMORY_MAX];	// by pc
+	uint16_t next[MEMORY_MAX];	// by pc, the pc after it last time, at first the one after it in memory
+};
+
+struct trace_writer
+{
+	lc3_mutex lock;
+	lc3_cond filled;	// a chunk is waiting or the trace is stopping
+	lc3_cond drained;	// the writer is done with a chunk
+	size_t waiting[TRACE_RING_CHUNKS];	// records in each chunk handed over, 0 for a free chunk
+	int stopping;
+
+	// The writer thread's alone once started
+	lc3_thread thread;
+	unsigned tail;		// next chunk to write
+	FILE *file;
+	int failed;			// a write failed, the rest is dropped
+	uint8_t *encoded;
+	trace_codec *codec;
+};
+
+
+
+// ENCODING
+
+trace_codec *trace_codec_create(void)
+{
+	return malloc(sizeof(trace_codec));
+}
+
+void trace_codec_free(trace_codec *codec)
+{
+	free(codec);
+}
+
+static void codec_reset(trace_codec *codec)
+{
+	memset(codec, 0, sizeof(*codec));
+	codec->pc = 0xFFFF;
+	for(size_t pc = 0; pc < MEMORY_MAX; pc++)
+	{
+		codec->next[pc] = (uint16_t)(pc + 1);
+	}
+}
+
+// Writing a register mostly sets the codes from it, only JSR and TRAP don't
+static uint16_t predicted_cond(const trace_codec *codec, const trace_record *r)
+{
+	return r->reg < TRACE_NO_REG ? cond_flags(r->value) : codec->cond;
+}
+
+size_t trace_encode(trace_codec *codec, const trace_record *records, size_t count, uint8_t *out)
+{
+	codec_reset(codec);
+	uint8_t *p = out;
+	for(size_t i = 0; i < count; i++)
+	{
+		const trace_record *r = &records[i];
+		uint8_t *header = p++;
+		uint8_t code = (uint8_t)((r->reg & 0xF) << CODE_REG_SHIFT);
+		if(r->pc == codec->next[codec->pc])
+		{
+			code |= CODE_PC_NEXT;
+		}
+		else
+		{
+			*p++ = (uint8_t)r->pc;
+			*p++ = (uint8_t)(r->pc >> 8);
+		}
+		if(r->instr == codec->instr[r->pc])
+		{
+			code |= CODE_INSTR_SEEN;
+		}
+		else
+		{
+			*p++ = (uint8_t)r->instr;
+			*p++ = (uint8_t)(r->instr >> 8);
+		}
+		if(r->reg < TRACE_NO_REG)
+		{
+			// Zigzag so small steps down are as short as small steps up
+			uint16_t delta = (uint16_t)(r->value - codec->reg[r->reg]);
+			uint32_t zigzag = (uint16_t)(delta << 1) ^ (delta & 0x8000 ? 0xFFFFu : 0);
+			while(zigzag >= 0x80)
+			{
+				*p++ = (uint8_t)(zigzag | 0x80);
+				zigzag >>= 7;
+			}
+			*p++ = (uint8_t)zigzag;
+			codec->reg[r->reg] = r->value;
+		}
+		if(r->cond == predicted_cond(codec, r))
+		{
+			code |= CODE_COND_GUESSED;
+		}
+		else
+		{
+			*p++ = r->cond;
+		}
+		*header = code;
+		codec->next[codec->pc] = r->pc;
+		codec->pc = r->pc;
+		codec->instr[r->pc] = r->instr;
+		codec->cond = r->cond;
+	}
+	return (size_t)(p - out);
+}
+
+int trace_decode(trace_codec *codec, const uint8_t *in, size_t size, trace_record *records, size_t count)
+{
+	codec_reset(codec);
+	const uint8_t *p = in, *end = in + size;
+	for(size_t i = 0; i < count; i++)
+	{
+		trace_record *r = &records[i];
+		if(p == end)
+		{
+			return 0;
+		}
+		uint8_t code = *p++;
+		r->reg = code >> CODE_REG_SHIFT;
+		if(r->reg > TRACE_NO_REG)
+		{
+			return 0;
+		}
+		if(code & CODE_PC_NEXT)
+		{
+			r->pc = codec->next[codec->pc];
+		}
+		else
+		{
+			if(end - p < 2)
+			{
+				return 0;
+			}
+			r->pc = (uint16_t)(p[0] | p[1] << 8);
+			p += 2;
+		}
+		if(code & CODE_INSTR_SEEN)
+		{
+			r->instr = codec->instr[r->pc];
+		}
+		else
+		{
+			if(end - p < 2)
+			{
+				return 0;
+			}
+			r->instr = (uint16_t)(p[0] | p[1] << 8);
+			p += 2;
+		}
+		r->value = 0;
+		if(r->reg < TRACE_NO_REG)
+		{
+			uint32_t zigzag = 0;
+			for(int shift = 0; ; shift += 7)
+			{
+				if(p == end || shift > 14)
+				{
+					return 0;
+				}
+				uint8_t byte = *p++;
+				zigzag |= (uint32_t)(byte & 0x7F) << shift;
+				if(!(byte & 0x80))
+				{
+					break;
+				}
+			}
+			uint16_t delta = (uint16_t)((zigzag >> 1) ^ (0u - (zigzag & 1)));
+			r->value = (uint16_t)(codec->reg[r->reg] + delta);
+			codec->reg[r->reg] = r->value;
+		}
+		if(code & CODE_COND_GUESSED)
+		{
+			r->cond = (uint8_t)predicted_cond(codec, r);
+		}
+		else
+		{
+			if(p == end)
+			{
+				return 0;
+			}
+			r->cond = *p++;
+		}
+		codec->next[codec->pc] = r->pc;
+		codec->pc = r->pc;
+		codec->instr[r->pc] = r->instr;
+		codec->cond = r->cond;
+	}
+	return p == end;
+}
+
+
+
+// WRITER THREAD
+
+static void put_u32(uint8_t *p, uint32_t value)
+{
+	for(int i = 0; i < 4; i++)
+	{
+		p[i] = (uint8_t)(value >> (8 * i));
+	}
+}
+
+static void write_block(struct trace_writer *w, const trace_record *records, size_t count)
+{
+	uint8_t header[8];
+	size_t size = trace_encode(w->codec, records, count, w->encoded);
+	put_u32(header, (uint32_t)count);
+	put_u32(header + 4, (uint32_t)size);
+	if(!w->failed && (fwrite(header, 1, sizeof(header), w->file) != sizeof(header)
+		|| fwrite(w->encoded, 1, size, w->file) != size))
+	{
+		w->failed = 1;
+	}
+}
+
+static void writer_main(void *arg)
+{
+	lc3_trace *trace = arg;
+	struct trace_writer *w = trace->writer;
+	for(;;)
+	{
+		mutex_lock(&w->lock);
+		while(!w->waiting[w->tail] && !w->stopping)
+		{
+			cond_wait(&w->filled, &w->lock);
+		}
+		size_t count = w->waiting[w->tail];
+		mutex_unlock(&w->lock);
+		if(!count)
+		{
+			return; // stopping, and every chunk handed over has been written
+		}
+
+		write_block(w, trace->records + (size_t)w->tail * TRACE_CHUNK_RECORDS, count);
+
+		mutex_lock(&w->lock);
+		w->waiting[w->tail] = 0;
+		cond_signal(&w->drained);
+		mutex_unlock(&w->lock);
+		w->tail = (w->tail + 1) % TRACE_RING_CHUNKS;
+	}
+}
+
+// Hands the head chunk over with however many records it has
+static void hand_over(lc3_trace *trace)
+{
+	struct trace_writer *w = trace->writer;
+	mutex_lock(&w->lock);
+	w->waiting[trace->head] = trace->used;
+	cond_signal(&w->filled);
+	trace->head = (trace->head + 1) % TRACE_RING_CHUNKS;
+	while(w->waiting[trace->head])
+	{
+		cond_wait(&w->drained, &w->lock); // the writer is a whole ring behind
+	}
+	mutex_unlock(&w->lock);
+	trace->used = 0;
+}
+
+void trace_submit(lc3_trace *trace)
+{
+	hand_over(trace);
+}
+
+
+
+// STARTING AND STOPPING
+
+static void free_trace(lc3_trace *trace)
+{
+	if(trace->writer)
+	{
+		trace_codec_free(trace->writer->codec);
+		free(trace->writer->encoded);
+		free(trace->writer);
+	}
+	free(trace->records);
+	free(trace);
+}
+
+int vm_trace_start(lc3_vm *vm, const char *path)
+{
+	if(vm->trace && !vm_trace_stop(vm))
+	{
+		return 0;
+	}
+	lc3_trace *trace = calloc(1, sizeof(*trace));
+	if(!trace)
+	{
+		return 0;
+	}
+	trace->records = malloc((size_t)TRACE_RING_CHUNKS * TRACE_CHUNK_RECORDS * sizeof(trace_record));
+	trace->writer = calloc(1, sizeof(*trace->writer));
+	struct trace_writer *w = trace->writer;
+	if(!trace->records || !w)
+	{
+		free_trace(trace);
+		return 0;
+	}
+	w->encoded = malloc((size_t)TRACE_CHUNK_RECORDS * TRACE_MAX_RECORD_BYTES);
+	w->codec = trace_codec_create();
+	if(!w->encoded || !w->codec)
+	{
+		free_trace(trace);
+		return 0;
+	}
+	w->file = fopen(path, "wb");
+	if(!w->file)
+	{
+		free_trace(trace);
+		return 0;
+	}
+	uint8_t version = TRACE_VERSION;
+	if(fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), w->file) != strlen(TRACE_MAGIC) || fwrite(&version, 1, 1, w->file) != 1)
+	{
+		fclose(w->file);
+		free_trace(trace);
+		return 0;
+	}
+
+	mutex_init(&w->lock);
+	cond_init(&w->filled);
+	cond_init(&w->drained);
+	if(!thread_start(&w->thread, writer_main, trace))
+	{
+		cond_destroy(&w->drained);
+		cond_destroy(&w->filled);
+		mutex_destroy(&w->lock);
+		fclose(w->file);
+		free_trace(trace);
+		return 0;
+	}
+	vm->trace = trace;
+	return 1;
+}
+
+int vm_trace_stop(lc3_vm *vm)
+{
+	lc3_trace *trace = vm->trace;
+	if(!trace)
+	{
+		return 1;
+	}
+	struct trace_writer *w = trace->writer;
+	if(trace->used)
+	{
+		hand_over(trace);
+	}
+	mutex_lock(&w->lock);
+	w->stopping = 1;
+	cond_signal(&w->filled);
+	mutex_unlock(&w->lock);
+	thread_join(w->thread);
+
+	int ok = !w->failed;
+	if(fclose(w->file) != 0)
+	{
+		ok = 0;
+	}
+	cond_destroy(&w->drained);
+	cond_destroy(&w->filled);
+	mutex_destroy(&w->lock);
+	free_trace(trace);
+	vm->trace = NULL;
+	return ok;
+}
@@ -0,0 +1,127 @@
+/*
+
+Trace.h
+
+Instruction traces for --trace. The machine's thread only appends fixed
+size records to a ring of chunks; a writer thread of the trace's own
+compresses every full chunk and writes it out, so a traced run costs a
+record per instruction and never waits on the disk while the ring has room.
+Each traced machine has its own ring, one per thread running a machine.
+tools/lc3trace turns a trace file back into text.
+
+A trace file is TRACE_MAGIC and a version byte followed by blocks, each a
+little-endian 32-bit record count, 32-bit byte length and that many bytes of
+trace_encode() output.
+
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "LC3.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TRACE_MAGIC "LC3TRACE"
+#define TRACE_VERSION 1
+#define TRACE_CHUNK_RECORDS (1 << 16)	// records per chunk of the ring, and so per block at most
+#define TRACE_RING_CHUNKS 4
+#define TRACE_MAX_RECORD_BYTES 9		// encoded, see trace_encode()
+#define TRACE_NO_REG 8
+
+// One retired instruction
+typedef struct
+{
+	uint16_t pc;
+	uint16_t instr;
+	uint16_t value;	// of reg afterwards
+	uint8_t reg;	// the register the instruction wrote, TRACE_NO_REG when none changed
+	uint8_t cond;	// FL_* afterwards
+} trace_record;
+
+// The ring as the machine's thread sees it, the rest is in Trace.c
+typedef struct lc3_trace
+{
+	trace_record *records;			// TRACE_RING_CHUNKS chunks of TRACE_CHUNK_RECORDS
+	unsigned head;					// chunk being filled
+	size_t used;					// records in it
+	struct trace_writer *writer;	// the background thread and what it shares with the machine
+} lc3_trace;
+
+// Starts tracing every instruction of every following vm_run() to a new file
+// at path. Traced runs always use the switch loop. Returns 0 if the file
+// can't be created or out of memory.
+int vm_trace_start(lc3_vm *vm, const char *path);
+
+// Writes out what is still in the ring and closes the file, vm_destroy()
+// calls this. Returns 0 if any of the trace couldn't be written.
+int vm_trace_stop(lc3_vm *vm);
+
+// Hands the full head chunk to the writer, waiting for the next one to be free
+void trace_submit(lc3_trace *trace);
+
+// Records an instruction at pc that took registers from before to after
+static inline void trace_instruction(lc3_trace *trace, uint16_t pc, uint16_t instr,
+	const uint16_t *before, const uint16_t *after, uint16_t cond)
+{
+	// Instructions with a destination report it even when the value didn't change
+	uint8_t reg = TRACE_NO_REG;
+	switch(instr >> 12)
+	{
+		case OP_ADD: case OP_AND: case OP_NOT:
+		case OP_LD: case OP_LDI: case OP_LDR: case OP_LEA:
+			reg = (instr >> 9) & 0x7;
+			break;
+		case OP_JSR:
+			reg = R_R7;
+			break;
+		default:
+			for(uint8_t r = R_R0; r <= R_R7; r++)
+			{
+				if(after[r] != before[r])
+				{
+					reg = r;
+					break;
+				}
+			}
+			break;
+	}
+	trace_record *record = &trace->records[trace->head * TRACE_CHUNK_RECORDS + trace->used];
+	record->pc = pc;
+	record->instr = instr;
+	record->reg = reg;
+	record->value = reg == TRACE_NO_REG ? 0 : after[reg];
+	record->cond = (uint8_t)cond;
+	if(++trace->used == TRACE_CHUNK_RECORDS)
+	{
+		trace_submit(trace);
+	}
+}
+
+
+
+// ENCODING
+
+// Block compression state, both ends keep the same
+typedef struct trace_codec trace_codec;
+
+trace_codec *trace_codec_create(void);
+void trace_codec_free(trace_codec *codec);
+
+// Compresses count records (at most TRACE_CHUNK_RECORDS) into out, which
+// needs room for count * TRACE_MAX_RECORD_BYTES. Returns the bytes used.
+size_t trace_encode(trace_codec *codec, const trace_record *records, size_t count, uint8_t *out);
+
+// Decompresses a block from trace_encode() into count records, returns 0 if it is damaged
+int trace_decode(trace_codec *codec, const uint8_t *in, size_t size, trace_record *records, size_t count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,443 @@
+/*
+
+VM.c
+
+lc3_vm lifetime, loading and the run loop entry point. Everything a machine
+needs lives in its lc3_vm, the only process-wide state is the console itself.
+
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Analysis.h"
+#include "InputBuffering.h"
+#include "InterruptHandling.h"
+#include "LC3.h"
+#include "Profile.h"
+#include "ReadImage.h"
+#include "Stats.h"
+#include "Threads.h"
+#include "Trace.h"
+
+
+
+// PROCESS CONSOLE
+
+static int console_check_key(void *user)
+{
+	return check_key();
+}
+
+static uint16_t console_read_key(void *user)
+{
+	return read_key();
+}
+
+static void console_write(void *user, const char *bytes, size_t count)
+{
+	fwrite(bytes, 1, count, stdout);
+	fflush(stdout);
+}
+
+static const lc3_io console_io = { NULL, console_check_key, console_read_key, console_write, NULL };
+
+
+
+// BUFFERED INPUT
+
+typedef struct
+{
+	lc3_io inner;
+	char *input;
+	size_t size;
+	size_t used;
+} buffered_input;
+
+static int buffered_check_key(void *user)
+{
+	buffered_input *buffered = user;
+	return buffered->used < buffered->size;
+}
+
+static uint16_t buffered_read_key(void *user)
+{
+	buffered_input *buffered = user;
+	if(buffered->used == buffered->size)
+	{
+		return (uint16_t)EOF;
+	}
+	return (unsigned char)buffered->input[buffered->used++];
+}
+
+static void buffered_write(void *user, const char *bytes, size_t count)
+{
+	buffered_input *buffered = user;
+	buffered->inner.write(buffered->inner.user, bytes, count);
+}
+
+static void buffered_close(void *user)
+{
+	buffered_input *buffered = user;
+	if(buffered->inner.close)
+	{
+		buffered->inner.close(buffered->inner.user);
+	}
+	free(buffered->input);
+	free(buffered);
+}
+
+
+
+// MACHINES
+
+lc3_vm *vm_create(const lc3_io *io)
+{
+	lc3_vm *vm = calloc(1, sizeof(*vm));
+	if(!vm || !memory_init(vm))
+	{
+		free(vm);
+		return NULL;
+	}
+	vm->io = io ? *io : console_io;
+	output_init(&vm->out, vm->io.write, vm->io.user);
+
+	// One condition flag must be set at any given time, so initialize with the Z (zero) flag
+	vm->reg[R_COND] = FL_ZRO;
+	vm->reg[R_PC] = PC_START;
+	vm->psr = PSR_USER;
+	vm->saved_sp = SUPERVISOR_STACK;
+	for(int vector = 0; vector < 256; vector++)
+	{
+		vm->traps[vector] = vm_builtin_trap((uint8_t)vector);
+	}
+	vm->engine = ENGINE_CACHED;
+	vm->interactive = 1;
+	return vm;
+}
+
+void vm_destroy(lc3_vm *vm)
+{
+	if(!vm)
+	{
+		return;
+	}
+	output_flush(&vm->out);
+	vm_trace_stop(vm);
+	engine_release(vm);
+	profile_release(vm);
+	stats_release(vm);
+	analysis_free(vm->analysis);
+	memory_release(vm);
+	if(vm->io.close)
+	{
+		vm->io.close(vm->io.user);
+	}
+	free(vm);
+}
+
+lc3_vm *vm_clone(lc3_vm *vm, const lc3_io *io)
+{
+	output_flush(&vm->out); // printed once, by the parent
+	lc3_vm *clone = vm_create(io);
+	if(!clone || !memory_clone(clone, vm))
+	{
+		vm_destroy(clone);
+		return NULL;
+	}
+	memcpy(clone->reg, vm->reg, sizeof(vm->reg));
+	clone->cond_result = vm->cond_result;
+	clone->psr = vm->psr;
+	clone->saved_sp = vm->saved_sp;
+	clone->interrupts = vm->interrupts;
+	clone->irq_pending = vm->irq_pending;
+	memcpy(clone->irq_vectors, vm->irq_vectors, sizeof(vm->irq_vectors));
+	clone->engine = vm->engine;
+	clone->status = vm->status;
+	clone->instructions = vm->instructions;
+	clone->image_hash = vm->image_hash;
+	clone->counters = vm->counters;
+	memcpy(clone->traps, vm->traps, sizeof(vm->traps));
+	clone->out.unbuffered = vm->out.unbuffered;
+	clone->interactive = vm->interactive;
+	return clone;
+}
+
+int vm_buffer_input(lc3_vm *vm, char *input, size_t size)
+{
+	buffered_input *buffered = malloc(sizeof(*buffered));
+	if(!buffered)
+	{
+		free(input);
+		return 0;
+	}
+	buffered->inner = vm->io;
+	buffered->input = input;
+	buffered->size = size;
+	buffered->used = 0;
+
+	lc3_io io = { buffered, buffered_check_key, buffered_read_key, buffered_write, buffered_close };
+	vm->io = io; // vm->out keeps writing to the inner console directly
+	return 1;
+}
+
+void vm_set_interactive(lc3_vm *vm, int interactive)
+{
+	vm->interactive = interactive;
+}
+
+void vm_set_engine(lc3_vm *vm, int engine)
+{
+	vm->engine = engine;
+}
+
+void vm_set_trap(lc3_vm *vm, uint8_t vector, lc3_trap_fn handler)
+{
+	vm->traps[vector] = handler;
+}
+
+int vm_set_paged_memory(lc3_vm *vm)
+{
+	return memory_set_paged(vm);
+}
+
+int vm_load_image(lc3_vm *vm, const char *image_path)
+{
+	if(vm->flat)
+	{
+		uint16_t origin;
+		size_t length;
+		if(!read_image(vm->flat, image_path, &origin, &length))
+		{
+			return 0;
+		}
+		vm->image_hash = memory_hash_words(vm->image_hash, origin, vm->flat + origin, length);
+	}
+	else
+	{
+		// Only the pages the image lands on get allocated
+		lc3_image *image = image_load(image_path);
+		if(!image)
+		{
+			return 0;
+		}
+		memory_store(vm, image->origin, image->words, image->length);
+		vm->image_hash = memory_hash_words(vm->image_hash, image->origin, image->words, image->length);
+		image_free(image);
+	}
+	engine_invalidate(vm, 0, MEMORY_MAX); // anything already decoded may have been overwritten
+	analysis_free(vm->analysis);
+	vm->analysis = NULL;
+	return 1;
+}
+
+void vm_install_image(lc3_vm *vm, const lc3_image *image)
+{
+	memory_install(vm, image);
+	vm->image_hash = memory_hash_words(vm->image_hash, image->origin, image->words, image->length);
+	engine_invalidate(vm, image->origin, image->length);
+	analysis_free(vm->analysis);
+	vm->analysis = NULL;
+}
+
+int vm_run(lc3_vm *vm, uint64_t n_steps)
+{
+	vm->status = VM_RUNNING;
+	int timed = n_steps >= VM_TIMED_STEPS;
+	if(timed)
+	{
+		vm->counters.run_start = monotonic_seconds();
+		vm->counters.run_start_instructions = vm->instructions;
+	}
+	while(n_steps > 0)
+	{
+		// Up to the next slice boundary while a device may want an interrupt
+		uint64_t slice = n_steps;
+		uint64_t to_boundary = VM_INTERRUPT_SLICE - vm->instructions % VM_INTERRUPT_SLICE;
+		if(vm->interrupts && slice > to_boundary)
+		{
+			slice = to_boundary;
+		}
+		vm->steps = vm->run_steps = slice;
+		
+		run_engine(vm, vm->engine);
+		
+		uint64_t left = vm->status == VM_RUNNING ? vm->steps : vm->stop_steps;
+		uint64_t done = vm->run_steps - left; // vm_check_interrupts() may have cut the slice short
+		vm->instructions += done;
+		n_steps -= done;
+		vm->steps = vm->run_steps = 0;
+		if(vm->status != VM_RUNNING)
+		{
+			break;
+		}
+		if(vm->interrupts && vm->instructions % VM_INTERRUPT_SLICE == 0)
+		{
+			service_interrupts(vm);
+		}
+	}
+	if(timed)
+	{
+		vm->counters.run_seconds += monotonic_seconds() - vm->counters.run_start;
+		vm->counters.timed_instructions += vm->instructions - vm->counters.run_start_instructions;
+		vm->counters.run_start = 0;
+	}
+	return vm->status;
+}
+
+int vm_step(lc3_vm *vm)
+{
+	return vm_run(vm, 1);
+}
+
+int vm_run_until(lc3_vm *vm, const lc3_until *until)
+{
+	vm->until = *until;
+	uint64_t steps = UINT64_MAX;
+	if(!(until->conditions & VM_UNTIL_CHECK_FIRST))
+	{
+		vm->until.conditions &= ~(VM_UNTIL_PC | VM_UNTIL_INPUT); // the first instruction runs unchecked, so the machine can move on from pc
+		steps = 1;
+	}
+	int status;
+	for(;;)
+	{
+		if(until->conditions & VM_UNTIL_INSTRUCTIONS)
+		{
+			if(vm->instructions >= until->instructions)
+			{
+				vm->status = status = VM_BREAK;
+				break;
+			}
+			if(steps > until->instructions - vm->instructions)
+			{
+				steps = until->instructions - vm->instructions;
+			}
+		}
+		status = vm_run(vm, steps);
+		if(status != VM_RUNNING)
+		{
+			break;
+		}
+		vm->until.conditions = until->conditions;
+		steps = UINT64_MAX;
+	}
+	vm->until.conditions = 0;
+	return status;
+}
+
+int vm_run_limited(lc3_vm *vm, const lc3_limits *limits)
+{
+	uint64_t start = vm->instructions;
+	double deadline = limits->timeout > 0 ? monotonic_seconds() + limits->timeout : 0;
+	
+	for(;;)
+	{
+		// Without a clock or a callback the whole instruction budget can go in one call
+		uint64_t slice = deadline || limits->between_slices ? VM_LIMIT_SLICE : UINT64_MAX;
+		if(limits->max_instructions)
+		{
+			uint64_t left = limits->max_instructions - (vm->instructions - start);
+			if(left == 0)
+			{
+				vm->status = VM_LIMIT;
+				return VM_LIMIT;
+			}
+			if(left < slice)
+			{
+				slice = left;
+			}
+		}
+		
+		int status = vm_run(vm, slice);
+		if(status != VM_RUNNING)
+		{
+			return status;
+		}
+		if(limits->between_slices && limits->between_slices(vm, limits->user))
+		{
+			return status;
+		}
+		if(deadline && monotonic_seconds() >= deadline)
+		{
+			vm->status = VM_TIMEOUT;
+			return VM_TIMEOUT;
+		}
+	}
+}
+
+uint16_t vm_get_reg(const lc3_vm *vm, int reg)
+{
+	return vm->reg[reg];
+}
+
+void vm_set_reg(lc3_vm *vm, int reg, uint16_t value)
+{
+	vm->reg[reg] = value;
+}
+
+uint16_t vm_get_psr(const lc3_vm *vm)
+{
+	return vm->psr | vm->reg[R_COND];
+}
+
+uint16_t vm_read_memory(const lc3_vm *vm, uint16_t address)
+{
+	return memory_peek(vm, address);
+}
+
+void vm_write_memory(lc3_vm *vm, uint16_t address, uint16_t value)
+{
+	memory_poke(vm, address, value);
+	engine_invalidate(vm, address, 1);
+}
+
+void vm_format_state(const lc3_vm *vm, char *buffer)
+{
+	uint16_t cond = vm->reg[R_COND];
+	int n = sprintf(buffer, "PC=x%04X", vm->reg[R_PC]);
+	for(int r = R_R0; r <= R_R7; r++)
+	{
+		n += sprintf(buffer + n, " R%d=x%04X", r, vm->reg[r]);
+	}
+	sprintf(buffer + n, " CC=%c after %llu instructions",
+		cond & FL_NEG ? 'N' : cond & FL_ZRO ? 'Z' : 'P', (unsigned long long)vm->instructions);
+}
+
+int vm_check_key(lc3_vm *vm)
+{
+	if(vm->interactive)
+	{
+		output_flush(&vm->out); // a program polling for keys has usually just prompted
+	}
+	if(vm->profile)
+	{
+		double start = monotonic_seconds();
+		int key = vm->io.check_key(vm->io.user);
+		vm->profile->key_checks++;
+		vm->profile->key_check_seconds += monotonic_seconds() - start;
+		return key;
+	}
+	return vm->io.check_key(vm->io.user);
+}
+
+uint16_t vm_read_key(lc3_vm *vm)
+{
+	if(vm->interactive)
+	{
+		output_flush(&vm->out);
+	}
+	double start = monotonic_seconds();
+	uint16_t key = vm->io.read_key(vm->io.user);
+	double waited = monotonic_seconds() - start;
+	vm->counters.key_reads++;
+	vm->counters.key_wait_seconds += waited;
+	if(vm->profile)
+	{
+		vm->profile->key_reads++;
+		vm->profile->key_read_seconds += waited;
+	}
+	return key;
+}
@@ -0,0 +1,233 @@
+/*
+
+harness.c
+
+Runs every benchmark image under every engine and prints one JSON object
+per run:
+
+	{"image":"alu","engine":"jit","instructions":30005003,"seconds":0.0412,
+	 "mips":728.3,"ns_per_instruction":1.373,"output_bytes":5,"peak_rss_kb":6012}
+
+seconds is the best of --repeat runs (3 by default). Output goes to a
+counting sink and the keyboard is scripted, so nothing touches the
+terminal. On POSIX every image/engine pair runs in its own child process
+so peak_rss_kb is that run's alone; on Win32 it is the whole harness so far.
+
+	harness [--repeat N] [--engine name] image-directory
+
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "LC3.h"
+#include "Threads.h"
+
+#ifdef _WIN32
+#include <Windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+static const char *const images[] = { "alu", "memory", "branchy", "puts", "kbsr" };
+static const char *const engines[] = { "switch", "threaded", "cached", "jit" };
+
+#define IMAGE_COUNT (int)(sizeof(images) / sizeof(images[0]))
+#define ENGINE_NAMES (int)(sizeof(engines) / sizeof(engines[0]))
+
+#define KBSR_POLLS_PER_KEY 256	// polls that see no key before each scripted one
+#define KBSR_KEYS 20000			// scripted keys before the final '.'
+
+
+
+// SCRIPTED CONSOLE
+
+typedef struct
+{
+	uint64_t polls;
+	uint64_t keys_read;
+	uint64_t output_bytes;
+} bench_console;
+
+static int bench_check_key(void *user)
+{
+	bench_console *console = user;
+	return ++console->polls % KBSR_POLLS_PER_KEY == 0;
+}
+
+static uint16_t bench_read_key(void *user)
+{
+	bench_console *console = user;
+	return console->keys_read++ < KBSR_KEYS ? 'a' + console->keys_read % 26 : '.';
+}
+
+static void bench_write(void *user, const char *bytes, size_t count)
+{
+	((bench_console *)user)->output_bytes += count;
+}
+
+
+
+// RUNS
+
+typedef struct
+{
+	int ok;
+	uint64_t instructions;
+	uint64_t output_bytes;
+	double seconds;
+} bench_result;
+
+static bench_result run_image(const char *path, int engine, int repeat)
+{
+	bench_result result = { 0, 0, 0, 0 };
+	for(int i = 0; i < repeat; i++)
+	{
+		bench_console console = { 0, 0, 0 };
+		lc3_io io = { &console, bench_check_key, bench_read_key, bench_write, NULL };
+		lc3_vm *vm = vm_create(&io);
+		if(!vm || !vm_load_image(vm, path))
+		{
+			vm_destroy(vm);
+			return result;
+		}
+		vm_set_engine(vm, engine);
+
+		double start = monotonic_seconds();
+		int status;
+		while((status = vm_run(vm, UINT64_MAX)) == VM_RUNNING)
+		{
+		}
+		output_flush(&vm->out);
+		double seconds = monotonic_seconds() - start;
+
+		if(status != VM_HALTED)
+		{
+			vm_destroy(vm);
+			return result;
+		}
+		if(i == 0 || seconds < result.seconds)
+		{
+			result.seconds = seconds;
+		}
+		result.instructions = vm->instructions;
+		result.output_bytes = console.output_bytes;
+		result.ok = 1;
+		vm_destroy(vm);
+	}
+	return result;
+}
+
+// Runs one image/engine pair, in a child process where that is possible
+static bench_result measure(const char *path, int engine, int repeat, long *peak_rss_kb)
+{
+#ifdef _WIN32
+	bench_result result = run_image(path, engine, repeat);
+	PROCESS_MEMORY_COUNTERS counters;
+	*peak_rss_kb = GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))
+		? (long)(counters.PeakWorkingSetSize / 1024) : -1;
+	return result;
+#else
+	bench_result result = { 0, 0, 0, 0 };
+	*peak_rss_kb = -1;
+	int fds[2];
+	if(pipe(fds) != 0)
+	{
+		return result;
+	}
+	fflush(stdout);
+	pid_t child = fork();
+	if(child == 0)
+	{
+		close(fds[0]);
+		result = run_image(path, engine, repeat);
+		ssize_t written = write(fds[1], &result, sizeof(result));
+		_exit(written == (ssize_t)sizeof(result) ? 0 : 1);
+	}
+	close(fds[1]);
+	if(child < 0)
+	{
+		close(fds[0]);
+		return result;
+	}
+	if(read(fds[0], &result, sizeof(result)) != (ssize_t)sizeof(result))
+	{
+		result.ok = 0;
+	}
+	close(fds[0]);
+
+	int status;
+	struct rusage usage;
+	if(wait4(child, &status, 0, &usage) == child)
+	{
+#ifdef __APPLE__
+		*peak_rss_kb = usage.ru_maxrss / 1024; // bytes there
+#else
+		*peak_rss_kb = usage.ru_maxrss;
+#endif
+	}
+	return result;
+#endif
+}
+
+
+
+int main(int argc, const char **argv)
+{
+	int repeat = 3;
+	const char *only_engine = NULL;
+	const char *dir = NULL;
+	for(int j = 1; j < argc; j++)
+	{
+		if(strcmp(argv[j], "--repeat") == 0 && j + 1 < argc)
+		{
+			repeat = atoi(argv[++j]);
+			continue;
+		}
+		if(strcmp(argv[j], "--engine") == 0 && j + 1 < argc)
+		{
+			only_engine = argv[++j];
+			continue;
+		}
+		dir = argv[j];
+	}
+	if(!dir || repeat < 1)
+	{
+		printf("harness [--repeat N] [--engine name] image-directory\n");
+		return 2;
+	}
+
+	int failures = 0;
+	for(int i = 0; i < IMAGE_COUNT; i++)
+	{
+		char path[1024];
+		snprintf(path, sizeof(path), "%s/%s.obj", dir, images[i]);
+		for(int e = 0; e < ENGINE_NAMES; e++)
+		{
+			if(only_engine && strcmp(only_engine, engines[e]) != 0)
+			{
+				continue;
+			}
+			long peak_rss_kb;
+			bench_result r = measure(path, parse_engine(engines[e]), repeat, &peak_rss_kb);
+			if(!r.ok)
+			{
+				printf("{\"image\":\"%s\",\"engine\":\"%s\",\"error\":\"did not halt\"}\n", images[i], engines[e]);
+				failures++;
+				continue;
+			}
+			double mips = r.seconds > 0 ? r.instructions / r.seconds / 1e6 : 0;
+			double ns = r.instructions ? r.seconds * 1e9 / r.instructions : 0;
+			printf("{\"image\":\"%s\",\"engine\":\"%s\",\"instructions\":%llu,\"seconds\":%.6f,"
+				"\"mips\":%.1f,\"ns_per_instruction\":%.3f,\"output_bytes\":%llu,\"peak_rss_kb\":%ld}\n",
+				images[i], engines[e], (unsigned long long)r.instructions, r.seconds,
+				mips, ns, (unsigned long long)r.output_bytes, peak_rss_kb);
+		}
+	}
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,222 @@
+/*
+
+mkimages.c
+
+Writes the benchmark images into the directory given on the command line.
+Each image is assembled here from the encodings below, so the suite needs
+nothing but a C compiler:
+
+	alu.obj		ADD/AND/NOT in a tight nested loop
+	memory.obj	LDR/ADD/STR sweeps over an 8K-word array
+	branchy.obj	data-dependent branches driven by an LCG
+	puts.obj	PUTS of a 64-character line, over and over
+	kbsr.obj	KBSR/KBDR polling until the scripted input sends '.'
+
+*/
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ORIGIN 0x3000
+#define MAX_WORDS 4096
+
+static uint16_t code[MAX_WORDS];
+static int here;
+
+
+
+// ENCODING
+
+static void emit(uint16_t word) { code[here++] = word; }
+
+static uint16_t add_imm(int dr, int sr, int imm)	{ return (uint16_t)(0x1000 | dr << 9 | sr << 6 | 0x20 | (imm & 0x1F)); }
+static uint16_t add_reg(int dr, int sr1, int sr2)	{ return (uint16_t)(0x1000 | dr << 9 | sr1 << 6 | sr2); }
+static uint16_t and_imm(int dr, int sr, int imm)	{ return (uint16_t)(0x5000 | dr << 9 | sr << 6 | 0x20 | (imm & 0x1F)); }
+static uint16_t not_reg(int dr, int sr)				{ return (uint16_t)(0x9000 | dr << 9 | sr << 6 | 0x3F); }
+static uint16_t ldr(int dr, int base, int offset)	{ return (uint16_t)(0x6000 | dr << 9 | base << 6 | (offset & 0x3F)); }
+static uint16_t str(int sr, int base, int offset)	{ return (uint16_t)(0x7000 | sr << 9 | base << 6 | (offset & 0x3F)); }
+static uint16_t trap(int vector)					{ return (uint16_t)(0xF000 | vector); }
+
+enum { N = 4, Z = 2, P = 1 };
+
+// BR to an address already emitted
+static void br_back(int nzp, int target)
+{
+	emit((uint16_t)(nzp << 9 | ((target - (here + 1)) & 0x1FF)));
+}
+
+// Instructions with a PCoffset9 to something not emitted yet, patched by fix()
+static int forward(uint16_t word)
+{
+	emit(word);
+	return here - 1;
+}
+
+static void fix(int at)
+{
+	code[at] |= (uint16_t)((here - (at + 1)) & 0x1FF);
+}
+
+#define BR(nzp)		((uint16_t)((nzp) << 9))
+#define LD(dr)		((uint16_t)(0x2000 | (dr) << 9))
+#define LEA(dr)		((uint16_t)(0xE000 | (dr) << 9))
+
+
+
+// IMAGES
+
+static void alu(void)
+{
+	int outer = forward(LD(6));
+	int top = here;
+	int inner = forward(LD(5));
+	int loop = here;
+	emit(add_reg(1, 1, 5));
+	emit(and_imm(2, 1, 15));
+	emit(not_reg(3, 2));
+	emit(add_reg(4, 3, 1));
+	emit(add_imm(5, 5, -1));
+	br_back(P, loop);
+	emit(add_imm(6, 6, -1));
+	br_back(P, top);
+	emit(trap(0x25));
+	fix(outer); emit(5000);
+	fix(inner); emit(1000);
+}
+
+static void memory(void)
+{
+	int passes = forward(LD(6));
+	int top = here;
+	int base = forward(LD(2));
+	int count = forward(LD(3));
+	int loop = here;
+	emit(ldr(1, 2, 0));
+	emit(add_imm(1, 1, 1));
+	emit(str(1, 2, 0));
+	emit(add_imm(2, 2, 1));
+	emit(add_imm(3, 3, -1));
+	br_back(P, loop);
+	emit(add_imm(6, 6, -1));
+	br_back(P, top);
+	emit(trap(0x25));
+	fix(passes); emit(400);
+	fix(base); emit(0x4000);
+	fix(count); emit(8192);
+}
+
+static void branchy(void)
+{
+	int outer = forward(LD(7));
+	int top = here;
+	int inner = forward(LD(6));
+	int loop = here;
+	
+	// R1 = R1 * 5 + 13
+	emit(add_reg(2, 1, 1));
+	emit(add_reg(2, 2, 2));
+	emit(add_reg(1, 2, 1));
+	emit(add_imm(1, 1, 13));
+	
+	// Branch on bits 15, 14 and 13 of the result
+	int a = forward(BR(N));
+	emit(add_imm(5, 5, 1));
+	fix(a);
+	emit(add_reg(4, 1, 1));
+	int b = forward(BR(N));
+	emit(add_imm(5, 5, -1));
+	fix(b);
+	emit(add_reg(4, 4, 4));
+	int c = forward(BR(Z | P));
+	emit(add_imm(3, 3, 1));
+	fix(c);
+	
+	emit(add_imm(6, 6, -1));
+	br_back(P, loop);
+	emit(add_imm(7, 7, -1));
+	br_back(P, top);
+	emit(trap(0x25));
+	fix(outer); emit(200);
+	fix(inner); emit(10000);
+}
+
+static void puts_heavy(void)
+{
+	int count = forward(LD(6));
+	int loop = here;
+	int line = forward(LEA(0));
+	emit(trap(0x22));
+	emit(add_imm(6, 6, -1));
+	br_back(P, loop);
+	emit(trap(0x25));
+	fix(count); emit(30000);
+	fix(line);
+	const char *text = "The quick brown fox jumps over the lazy dog, again and again.\n\n";
+	for(const char *p = text; *p; p++)
+	{
+		emit((uint16_t)*p);
+	}
+	emit(0);
+}
+
+static void kbsr(void)
+{
+	int device = forward(LD(1));
+	int dot = forward(LD(4));
+	int poll = here;
+	emit(ldr(0, 1, 0));		// KBSR
+	br_back(Z | P, poll);
+	emit(ldr(0, 1, 2));		// KBDR
+	emit(add_imm(5, 5, 1));
+	emit(add_reg(2, 0, 4));
+	br_back(N | P, poll);
+	emit(trap(0x25));
+	fix(device); emit(0xFE00);
+	fix(dot); emit((uint16_t)-'.');
+}
+
+
+
+static int write_image(const char *dir, const char *name, void (*build)(void))
+{
+	here = 0;
+	memset(code, 0, sizeof(code));
+	build();
+	
+	char path[1024];
+	snprintf(path, sizeof(path), "%s/%s.obj", dir, name);
+	FILE *file = fopen(path, "wb");
+	if(!file)
+	{
+		printf("Can't write %s\n", path);
+		return 0;
+	}
+	uint8_t word[2] = { ORIGIN >> 8, ORIGIN & 0xFF };
+	int ok = fwrite(word, 1, 2, file) == 2;
+	for(int i = 0; i < here && ok; i++)
+	{
+		word[0] = code[i] >> 8;
+		word[1] = code[i] & 0xFF;
+		ok = fwrite(word, 1, 2, file) == 2;
+	}
+	ok &= fclose(file) == 0;
+	return ok;
+}
+
+int main(int argc, const char **argv)
+{
+	if(argc != 2)
+	{
+		printf("mkimages output-directory\n");
+		return 2;
+	}
+	int ok = write_image(argv[1], "alu", alu)
+		&& write_image(argv[1], "memory", memory)
+		&& write_image(argv[1], "branchy", branchy)
+		&& write_image(argv[1], "puts", puts_heavy)
+		&& write_image(argv[1], "kbsr", kbsr);
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,148 @@
+/*
+
+lc3trace.c
+
+Prints a trace written by lc3 --trace, one line per instruction:
+
+	12 x3004 x1261 ADD  R1=x0005 P
+
+that is the instruction's index in the run, its PC and word, the register
+it wrote with the new value (left out when none changed) and the condition
+codes afterwards. --from and --count pick a window of a long trace.
+
+	lc3trace [--from N] [--count N] trace-file
+
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Trace.h"
+
+static const char *const opcode_names[16] =
+{
+	"BR", "ADD", "LD", "ST", "JSR", "AND", "LDR", "STR",
+	"RTI", "NOT", "LDI", "STI", "JMP", "RES", "LEA", "TRAP"
+};
+
+static uint32_t get_u32(const uint8_t *p)
+{
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void print_record(uint64_t index, const trace_record *r)
+{
+	printf("%llu x%04X x%04X %-4s", (unsigned long long)index, r->pc, r->instr, opcode_names[r->instr >> 12]);
+	if(r->reg < TRACE_NO_REG)
+	{
+		printf(" R%d=x%04X", r->reg, r->value);
+	}
+	printf(" %s\n", r->cond & FL_NEG ? "N" : r->cond & FL_ZRO ? "Z" : r->cond & FL_POS ? "P" : "-");
+}
+
+int main(int argc, const char **argv)
+{
+	uint64_t from = 0;
+	uint64_t count = UINT64_MAX;
+	const char *path = NULL;
+	for(int j = 1; j < argc; j++)
+	{
+		if(strcmp(argv[j], "--from") == 0 && j + 1 < argc)
+		{
+			from = strtoull(argv[++j], NULL, 0);
+			continue;
+		}
+		if(strcmp(argv[j], "--count") == 0 && j + 1 < argc)
+		{
+			count = strtoull(argv[++j], NULL, 0);
+			continue;
+		}
+		path = argv[j];
+	}
+	if(!path)
+	{
+		printf("lc3trace [--from N] [--count N] trace-file\n");
+		return 2;
+	}
+
+	FILE *file = fopen(path, "rb");
+	if(!file)
+	{
+		fprintf(stderr, "Failed to open trace: %s\n", path);
+		return 1;
+	}
+	char magic[sizeof(TRACE_MAGIC) - 1];
+	if(fread(magic, 1, sizeof(magic), file) != sizeof(magic) || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0
+		|| fgetc(file) != TRACE_VERSION)
+	{
+		fprintf(stderr, "Not a version %d trace: %s\n", TRACE_VERSION, path);
+		fclose(file);
+		return 1;
+	}
+
+	trace_codec *codec = trace_codec_create();
+	trace_record *records = malloc(TRACE_CHUNK_RECORDS * sizeof(trace_record));
+	uint8_t *encoded = malloc((size_t)TRACE_CHUNK_RECORDS * TRACE_MAX_RECORD_BYTES);
+	if(!codec || !records || !encoded)
+	{
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	int result = 0;
+	uint64_t index = 0;
+	uint64_t end = count > UINT64_MAX - from ? UINT64_MAX : from + count;
+	uint8_t header[8];
+	size_t got;
+	while(index < end && (got = fread(header, 1, sizeof(header), file)) != 0)
+	{
+		uint32_t records_in_block = get_u32(header);
+		uint32_t size = get_u32(header + 4);
+		if(got != sizeof(header) || records_in_block == 0 || records_in_block > TRACE_CHUNK_RECORDS
+			|| size > (size_t)records_in_block * TRACE_MAX_RECORD_BYTES)
+		{
+			fprintf(stderr, "Damaged block header after instruction %llu\n", (unsigned long long)index);
+			result = 1;
+			break;
+		}
+		if(index + records_in_block <= from)
+		{
+			// Nothing wanted in here, no need to decode it
+			if(fseek(file, size, SEEK_CUR) != 0)
+			{
+				fprintf(stderr, "Trace cut short after instruction %llu\n", (unsigned long long)index);
+				result = 1;
+				break;
+			}
+			index += records_in_block;
+			continue;
+		}
+		if(fread(encoded, 1, size, file) != size)
+		{
+			fprintf(stderr, "Trace cut short after instruction %llu\n", (unsigned long long)index);
+			result = 1;
+			break;
+		}
+		if(!trace_decode(codec, encoded, size, records, records_in_block))
+		{
+			fprintf(stderr, "Damaged block after instruction %llu\n", (unsigned long long)index);
+			result = 1;
+			break;
+		}
+		for(uint32_t i = 0; i < records_in_block && index < end; i++, index++)
+		{
+			if(index >= from)
+			{
+				print_record(index, &records[i]);
+			}
+		}
+	}
+
+	free(encoded);
+	free(records);
+	trace_codec_free(codec);
+	fclose(file);
+	return result;
+}